@@ -3,19 +3,28 @@
 clear
 
 typeset -i RELEASE=0
+typeset -i BENCH=0
 
 if [[ $1 == "release" ]] then
     RELEASE=1
+elif [[ $1 == "bench" ]] then
+    BENCH=1
 elif [[ -n $1 ]] then
-    echo "ERROR: Unsupported build mode $RELEASE"
+    echo "ERROR: Unsupported build mode $1"
     echo "Build modes:"
-    echo "    release: optimizations"
+    echo "    release: optimizations, no memory accounting, debug logs compiled out"
+    echo "    bench:   optimizations, runs the benchmarks (./build.sh bench [--sizes 1,100,1000]) into bench_output.txt"
     exit 1
 fi
 
-if (( $RELEASE )) then
+if (( $BENCH )) then
+    echo "bench"
+    gcc -o bench editor.c -lncurses -lm -lpthread -Wall -Wextra -Werror -Wno-switch -Wno-discarded-qualifiers -O2 \
+        -DBENCH -DMEM_STATS -DBENCH_VERSION="\"$(git rev-parse --short HEAD 2>/dev/null)\"" && ./bench "${@:2}"
+elif (( $RELEASE )) then
     echo "release"
-    gcc -o editor editor.c -lncurses -lm -Wall -Wextra -Werror -Wno-switch -Wno-discarded-qualifiers -O2
+    gcc -o editor editor.c -lncurses -lm -lpthread -Wall -Wextra -Werror -Wno-switch -Wno-discarded-qualifiers -O2 \
+        -DLOG_LEVEL_MIN=LOG_INFO
 else
-    gcc -o editor editor.c -lncurses -lm -Wall -Wextra -Werror -Wno-switch -Wno-discarded-qualifiers -ggdb
+    gcc -o editor editor.c -lncurses -lm -lpthread -Wall -Wextra -Werror -Wno-switch -Wno-discarded-qualifiers -ggdb -DMEM_STATS -DDEBUG=true
 fi
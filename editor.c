@@ -1,6 +1,8 @@
 // Reference: https://viewsourcecode.org/snaptoken/kilo/index.html
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <assert.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <string.h>
@@ -17,17 +19,167 @@
 #include <ncurses.h>
 #include <stddef.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/// BEGIN Memory
+
+/* NOTE: with MEM_STATS (debug and bench builds) every allocation of this file goes through these
+ *       wrappers, strings.h ones included. A block starts with its size and the subsystem it is
+ *       accounted to: the one of the innermost mem_scope when it was first allocated, a realloc
+ *       keeps it. Memory allocated by libc (e.g. by getline) must be released with (free)(ptr).
+ *       Release builds leave the allocator alone, the header would cost 16 bytes per row. */
+
+typedef enum {
+    MEM_OTHER,
+    MEM_ROWS,
+    MEM_REGISTERS,
+    MEM_HISTORY,
+    MEM_TOKENS,
+    MEM_CONFIG,
+    MEM_SNIPPETS,
+    MEM_SEARCH,
+    MEM_TAGS_COUNT,
+} MemTag;
+
+static const char *mem_tag_names[] = {"other", "rows", "registers", "history", "tokens", "config", "snippets", "search"};
+static_assert(sizeof(mem_tag_names)/sizeof(mem_tag_names[0]) == MEM_TAGS_COUNT, "Name all the memory tags");
+
+#ifdef MEM_STATS
+
+typedef struct {
+    size_t size;
+    MemTag tag;
+} __attribute__((aligned(16))) MemHeader; // NOTE: keeps the blocks aligned like malloc does
+
+/* NOTE: updated from every thread, hence the atomics */
+static struct {
+    size_t current[MEM_TAGS_COUNT];
+    size_t peak[MEM_TAGS_COUNT];
+    size_t allocs[MEM_TAGS_COUNT]; // NOTE: blocks allocated since the start
+    size_t live[MEM_TAGS_COUNT];   // NOTE: blocks not freed yet
+} mem_stats;
+
+static __thread MemTag mem_tag = MEM_OTHER;
+
+static void mem_account(MemTag tag, size_t added, size_t removed)
+{
+    size_t current = __atomic_add_fetch(&mem_stats.current[tag], added - removed, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&mem_stats.peak[tag], __ATOMIC_RELAXED);
+    while (current > peak && !__atomic_compare_exchange_n(&mem_stats.peak[tag], &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void *mem_realloc(void *ptr, size_t size)
+{
+    if (size > SIZE_MAX - sizeof(MemHeader)) return NULL;
+    MemHeader *header = ptr ? (MemHeader *)ptr - 1 : NULL;
+    MemTag tag = header ? header->tag : mem_tag;
+    size_t old_size = header ? header->size : 0;
+
+    MemHeader *moved = (realloc)(header, sizeof(MemHeader) + size);
+    if (moved == NULL) return NULL;
+    if (header == NULL) {
+        __atomic_add_fetch(&mem_stats.allocs[tag], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mem_stats.live[tag], 1, __ATOMIC_RELAXED);
+    }
+    moved->size = size;
+    moved->tag = tag;
+    mem_account(tag, size, old_size);
+    return moved+1;
+}
+
+void mem_free(void *ptr)
+{
+    if (ptr == NULL) return;
+    MemHeader *header = (MemHeader *)ptr - 1;
+    __atomic_sub_fetch(&mem_stats.live[header->tag], 1, __ATOMIC_RELAXED);
+    mem_account(header->tag, 0, header->size);
+    (free)(header);
+}
+
+static inline void *mem_malloc(size_t size) { return mem_realloc(NULL, size); }
+
+void *mem_calloc(size_t n, size_t size)
+{
+    if (size > 0 && n > SIZE_MAX/size) return NULL;
+    void *ptr = mem_realloc(NULL, n*size);
+    if (ptr) memset(ptr, 0, n*size);
+    return ptr;
+}
+
+static char *mem_copy_str(const char *s, size_t len)
+{
+    char *copy = mem_realloc(NULL, len+1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static inline char *mem_strdup(const char *s) { return mem_copy_str(s, strlen(s)); }
+
+static inline char *mem_strndup(const char *s, size_t n) { return mem_copy_str(s, strnlen(s, n)); }
+
+static inline MemTag mem_scope_begin(MemTag tag)
+{
+    MemTag previous = mem_tag;
+    mem_tag = tag;
+    return previous;
+}
+
+static inline void mem_scope_end(MemTag *previous) { mem_tag = *previous; }
+
+/* NOTE: blocks first allocated from here to the end of the enclosing block are accounted to tag */
+#define mem_scope(tag) MemTag mem_previous_tag __attribute__((cleanup(mem_scope_end))) = mem_scope_begin(tag)
+
+#define malloc(size)       mem_malloc(size)
+#define calloc(n, size)    mem_calloc(n, size)
+#define realloc(ptr, size) mem_realloc(ptr, size)
+#define free(ptr)          mem_free(ptr)
+#define strdup(s)          mem_strdup(s)
+#define strndup(s, n)      mem_strndup(s, n)
+
+#else
+
+#define mem_scope(tag) (void)(tag)
+
+#endif // MEM_STATS
+
+/// END Memory
 
 #define STRINGS_IMPLEMENTATION
 #include "strings.h"
 
-#define DEBUG true
+/* NOTE: debug builds pass -DDEBUG=true (see build.sh) */
+#ifndef DEBUG
+#define DEBUG false
+#endif
+
+/* NOTE: log calls below this level are compiled out, e.g. -DLOG_LEVEL_MIN=LOG_WARNING */
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN (DEBUG ? LOG_DEBUG : LOG_INFO)
+#endif
 
 static inline bool streq(const char *s1, const char *s2) { return strcmp(s1, s2) == 0; }
 static inline bool strneq(const char *s1, const char *s2, size_t n) { return strncmp(s1, s2, n) == 0; }
 
 #define BOOL_AS_CSTR(value) ((value) ? "true" : "false")
 
+uint64_t hash_bytes(const void *data, size_t n)
+{
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037ull; // NOTE: FNV-1a
+    for (size_t i = 0; i < n; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
 typedef struct
 {
     String content;
@@ -47,13 +199,23 @@ typedef struct
     size_t capacity;
 } Rows;
 
+#define MESSAGES_CAPACITY 64
+#define MESSAGE_MAX_LEN   1024
+
 typedef struct
 {
-    char **items;
-    size_t count;
-    size_t capacity;
-    size_t index;
-} CyclableStrings;
+    char text[MESSAGE_MAX_LEN];
+    size_t repeats; // NOTE: written again right after itself, shown as (xN)
+} Message;
+
+/* NOTE: fixed ring, once it is full the oldest message is overwritten */
+typedef struct
+{
+    Message items[MESSAGES_CAPACITY];
+    size_t count;      // NOTE: messages written so far, the newest is items[(count-1) % MESSAGES_CAPACITY]
+    size_t age;        // NOTE: of the message shown, 0 is the newest
+    uint64_t shown_ns; // NOTE: when it was last shown, it is hidden msg_lifetime seconds later
+} Messages;
 
 typedef struct
 {
@@ -69,6 +231,41 @@ typedef struct
     bool is_enabled;
 } MultiCursor;
 
+typedef int AnchorId;
+
+typedef struct
+{
+    AnchorId *items;
+    size_t count;
+    size_t capacity;
+} AnchorIds;
+
+typedef struct
+{
+    Cursor pos;
+    uint32_t priority;
+    AnchorId left;
+    AnchorId right;  // NOTE: next free node when the node is not used
+    AnchorId parent;
+
+    // NOTE: move not yet applied to the children: first the assignment (if any), then the shift
+    bool has_assign;
+    Cursor assign;
+    size_t dy; // NOTE: added modulo 2^64, so they can be negative
+    size_t dx;
+} AnchorNode;
+
+typedef struct
+{
+    AnchorNode *items;
+    size_t count;
+    size_t capacity;
+
+    AnchorId root;
+    AnchorId free;
+    uint32_t seed;
+} Anchors;
+
 typedef struct
 {
     Cursor **items;
@@ -76,6 +273,23 @@ typedef struct
     size_t capacity;
 } CursorPtrs;
 
+typedef struct
+{
+    bool is_reference; // NOTE: the text still lives in the buffer between begin and end
+    Cursor begin;
+    Cursor end;
+    String text;
+} Register;
+
+#define REGISTERS_COUNT 37 // a-z, 0-9 and the unnamed one
+#define UNNAMED_REGISTER (REGISTERS_COUNT-1)
+
+typedef struct
+{
+    bool is_active;
+    Cursor anchor;
+} Selection;
+
 typedef struct
 {
     char *name;
@@ -90,14 +304,30 @@ typedef struct
     size_t capacity;
 } SnippetMarks;
 
+typedef struct
+{
+    size_t offset; // NOTE: in the body of the snippet
+    size_t len;
+    bool is_indented; // NOTE: lines after the first get the indentation of the handle, unless empty
+} SnippetLine;
+
+typedef struct
+{
+    SnippetLine *items;
+    size_t count;
+    size_t capacity;
+} SnippetLines;
+
 typedef struct
 {
     char *handle;
     size_t handle_len;
-    char *body;
+    char *body; // NOTE: parsed once by load_config and never modified afterwards
+    size_t body_len;
+    SnippetLine *lines;
+    size_t lines_count;
     bool is_inline;
-    bool handle_is_prefix;
-    SnippetMark *marks;
+    SnippetMark *marks; // NOTE: x is relative to the beginning of line y of the body
     size_t marks_count;
 } Snippet;
 
@@ -108,6 +338,33 @@ typedef struct
     size_t capacity;
 } Snippets;
 
+typedef struct
+{
+    int snippet;        // NOTE: index of the snippet whose handle ends here, -1 if none
+    int inline_snippet; // NOTE: same but only inline ones, the only ones allowed in the command line
+    int fail;           // NOTE: only in the automaton, node of the longest proper suffix in the trie
+    int output;         // NOTE: only in the automaton, nearest node on the fail chain where a handle ends, -1 if none
+} SnippetTrieNode;
+
+typedef struct
+{
+    uint64_t key;
+    int child;
+} SnippetTrieEdge;
+
+typedef struct
+{
+    SnippetTrieNode *items; // NOTE: the root is the first one
+    size_t count;
+    size_t capacity;
+
+    SnippetTrieEdge *edges;
+    size_t edges_count;
+    size_t edges_capacity;
+
+    size_t max_depth;
+} SnippetTrie;
+
 typedef enum
 {
     PISQUY_INT,
@@ -137,8 +394,141 @@ typedef struct
     size_t capacity;
 } Vars;
 
+typedef struct { uint64_t bits[4]; } ByteSet;
+
+typedef struct
+{
+    ByteSet *items;
+    size_t count;
+    size_t capacity;
+} ByteSets;
+
+typedef enum { RE_OP_BYTE, RE_OP_SPLIT, RE_OP_AT_START, RE_OP_AT_END, RE_OP_MATCH } RegexOp;
+
+typedef struct
+{
+    RegexOp op;
+    int out;
+    int out1; // NOTE: only for RE_OP_SPLIT
+    int set;  // NOTE: only for RE_OP_BYTE
+} RegexInst;
+
+typedef struct
+{
+    RegexInst *items;
+    size_t count;
+    size_t capacity;
+    int start;
+} RegexProgram;
+
+/* NOTE: the forward program finds where a match ends, the reverse one (the same
+ *       pattern read right to left) where it begins, see regex_find. */
+typedef struct
+{
+    ByteSets sets;
+    RegexProgram forward;
+    RegexProgram reverse;
+} Regex;
+
+typedef struct
+{
+    int *nfa; // NOTE: sorted, so equal sets of NFA states are the same DFA state
+    size_t nfa_count;
+    uint64_t hash;
+    bool is_match;
+    bool is_match_at_end;
+    int next[256];
+} DfaState;
+
+typedef struct
+{
+    DfaState *items;
+    size_t count;
+    size_t capacity;
+
+    const RegexProgram *prog;
+    const ByteSets *sets;
+    bool unanchored;
+    int start[2]; // NOTE: indexed by whether the scan begins at the edge of the row
+    size_t flushes;
+
+    int *stack;
+    int *set;
+    int *end_set;
+    unsigned *mark;
+    unsigned generation;
+} Dfa;
+
+/* NOTE: the DFA caches are mutable, every thread matching the same Regex needs its own matcher */
+typedef struct
+{
+    Dfa scan;    // NOTE: unanchored forward program
+    Dfa forward;
+    Dfa reverse;
+} RegexMatcher;
+
+typedef enum { PROMPT_COMMAND, PROMPT_SEARCH, PROMPT_HISTORY } PromptKind;
+
+typedef struct
+{
+    size_t col;
+    size_t len;
+} RowMatch;
+
+typedef struct
+{
+    RowMatch *items;
+    size_t count;
+    size_t capacity;
+    uint64_t generation; // NOTE: valid only when equal to the one of the index
+} RowMatches;
+
+typedef struct
+{
+    RowMatches *items; // NOTE: one per row, kept in sync with editor.rows
+    size_t count;
+    size_t capacity;
+
+    bool is_enabled;
+    uint64_t generation; // NOTE: bumped to drop every match at once, rows start at 0 so never valid
+    size_t valid_rows;
+    size_t total;    // NOTE: matches in the valid rows
+    size_t next_row; // NOTE: where indexing in the background resumes
+    size_t *tree;    // NOTE: Fenwick tree of the matches per row
+    bool tree_is_stale;
+} MatchIndex;
+
+typedef struct
+{
+    String pattern;
+    bool ignore_case;
+    bool is_regex;
+    bool is_invalid;
+    String error;
+    Regex regex;
+    RegexMatcher matcher;
+
+    Cursor origin; // NOTE: where the cursor was when the search prompt was opened
+    size_t origin_offset;
+
+    bool is_scanning;
+    bool backwards;
+    bool is_first_row;
+    bool wrapped;
+    Cursor start;
+    size_t next_row;
+    size_t rows_left;
+
+    bool has_match;
+    Cursor match;
+    size_t match_len;
+
+    MatchIndex index;
+} Search;
+
 typedef enum { LN_NO, LN_ABS, LN_REL } ConfigLineNumbers;
 typedef enum { CONFIGLOG_ALL, CONFIGLOG_WARNING, CONFIGLOG_ERROR } ConfigLogLevel;
+typedef enum { LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR, LOG_OFF, LOG_LEVELS_COUNT } LogLevel;
 
 typedef struct
 {
@@ -147,6 +537,9 @@ typedef struct
     bool tab_to_spaces;
     size_t tab_spaces_number;
     ConfigLogLevel configlog_level;
+    bool auto_snippets;
+    LogLevel log_level;
+    size_t msg_lifetime;
 
     Vars vars;
 } Config;
@@ -158,6 +551,9 @@ typedef enum
     CONFIG_TAB_TO_SPACES,
     CONFIG_TAB_SPACES_NUMBER,
     CONFIG_CONFIGLOG_LEVEL,
+    CONFIG_AUTO_SNIPPETS,
+    CONFIG_LOG_LEVEL,
+    CONFIG_MSG_LIFETIME,
 
     CONFIG_FIELDS_COUNT
 } __ActualConfigFields;
@@ -172,26 +568,40 @@ typedef struct
     Cursor cursor;
     MultiCursor multicursor;
     CursorPtrs sorted_multicursor;
+    Anchors anchors;
 
-    size_t offset;
+    Selection selection;
+    Register registers[REGISTERS_COUNT];
+    size_t referencing_registers;
+    int current_register;
+    bool is_choosing_register;
+
+    size_t offset; // NOTE: first row on screen, see Viewport
     size_t screen_rows;
     size_t screen_cols;
-    size_t page;
 
-    CyclableStrings messages;
+    Messages messages;
     bool is_showing_message;
 
     String cmd;
     size_t cmd_pos;
     bool in_cmd;
-    CyclableStrings commands_history;
+    PromptKind prompt;
+
+    Search search;
 
     Snippets snippets;
+    SnippetTrie snippet_trie;      // NOTE: handles reversed, to find the one ending at the cursor
+    SnippetTrie snippet_automaton; // NOTE: handles as they are typed, with the failure links to match them as you type
+    struct {
+        int state;
+        Cursor cursor; // NOTE: the state is valid only if nothing moved or changed since it was computed
+        int dirty;
+    } auto_snippet;
     struct {
         Snippet *snippet;
         int mark_index;
-        Cursor base_cursor;
-        SnippetMarks active_marks;
+        AnchorIds marks; // NOTE: marks_count for each expansion, the one of the main cursor first
     } expanding_snippet;
 
     Config config;
@@ -203,14 +613,31 @@ typedef struct
 } Editor;
 static Editor editor = {0};
 
+typedef struct
+{
+    int *items;
+    size_t count;
+    size_t capacity;
+} Keys;
+
+static struct
+{
+    bool is_enabled;
+    char *script_path;
+    char *output_path;
+    char *config_path; // NOTE: --config, without it the built-in defaults are used
+    Keys keys;
+    size_t next;
+    uint64_t begin_ns;
+} headless = {0};
+
 #define N_DEFAULT -1 
 #define N_OR_DEFAULT(n) (assert(n >= 0), (size_t)(editor.N == N_DEFAULT ? (n) : editor.N))
-#define N_TIMES for (size_t i = 0; i < N_OR_DEFAULT(1); i++)
 
 #define LINE_NUMBERS_SPACE \
     (editor.config.line_numbers == LN_NO ? 0 : (size_t)log10(editor.rows.count == 0 ? 1 : editor.rows.count)+3)
 
-#define CURRENT_Y_POS (editor.offset+editor.cursor.y)
+#define CURRENT_Y_POS (editor.cursor.y)
 #define CURRENT_X_POS (editor.cursor.x)
 #define ROW(i) (assert((i) <= editor.rows.count), &editor.rows.items[i])
 #define CURRENT_ROW ROW(CURRENT_Y_POS)
@@ -218,7 +645,6 @@ static Editor editor = {0};
 #define CURRENT_LINE LINE(CURRENT_Y_POS)
 #define CHAR(row, i) (LINE(row)[i])
 #define CURRENT_CHAR CHAR(CURRENT_Y_POS, CURRENT_X_POS)
-#define N_PAGES (editor.rows.count/win_main.height + 1)
 
 /* ANSI escape sequences */
 #define ANSI_ERASE_LINE_FROM_CURSOR "\x1b[K"
@@ -251,6 +677,7 @@ typedef enum
     CTRL_N    = 14,
     CTRL_P    = 16,
     CTRL_Q    = 17,
+    CTRL_R    = 18,
     CTRL_S    = 19,
     ESC       = 27,
 
@@ -265,154 +692,2304 @@ typedef enum
     ALT_8,
     ALT_9, // NOTE: ALT_digit sequences must be consecutive
 
-    ALT_k,
-    ALT_j,
-    ALT_h,
-    ALT_l,
+    ALT_k,
+    ALT_j,
+    ALT_h,
+    ALT_l,
+
+    ALT_c,
+    ALT_C,
+    ALT_K,
+    ALT_J,
+    ALT_H,
+    ALT_L,
+
+    ALT_m,
+    ALT_n,
+    ALT_p,
+    ALT_P,
+
+    ALT_v,
+    ALT_y,
+    ALT_x,
+    ALT_QUOTE,
+
+    ALT_g,
+    ALT_G,
+
+    CTRL_ALT_C,
+    CTRL_ALT_K,
+    CTRL_ALT_J,
+    CTRL_ALT_H,
+    CTRL_ALT_L,
+
+    ALT_BACKSPACE,
+    ALT_COLON,
+    ALT_SLASH,
+    ALT_QUESTION_MARK,
+} Key;
+
+typedef struct
+{
+    WINDOW *win;
+    size_t height;
+    size_t width;
+    size_t start_y;
+    size_t start_x;
+} Window;
+
+static Window win_main = {0};
+static Window win_line_numbers = {0};
+static Window win_message = {0};
+static Window win_command = {0};
+static Window win_status = {0};
+
+_Noreturn void print_error_and_exit(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (headless.is_enabled) {
+        fprintf(stderr, "ERROR: ");
+        vfprintf(stderr, fmt, ap);
+        exit(1);
+    }
+    clear();
+    printw("ERROR: ");
+    vw_printw(stdscr, fmt, ap);
+    refresh();
+    nodelay(stdscr, FALSE);
+    getch();
+    exit(1);
+}
+
+static inline uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+/// BEGIN Log
+
+/* Log calls only format the message in a slot of a lock-free ring, the flush thread writes the slots to the
+ * log file in batches. Messages below LOG_LEVEL_MIN are compiled out, the others are filtered at runtime
+ * with the log_level config field. */
+
+#define LOG_RING_SLOTS        1024 // NOTE: power of two
+#define LOG_MESSAGE_SIZE      232
+#define LOG_FLUSH_INTERVAL_NS 20000000
+
+typedef struct
+{
+    uint64_t sequence;     // NOTE: the slot can be written at position sequence, read at position sequence-1
+    uint64_t timestamp_ns; // NOTE: CLOCK_REALTIME, turned into text only when flushed
+    LogLevel level;
+    uint32_t len;
+    char text[LOG_MESSAGE_SIZE];
+} LogSlot;
+
+static struct
+{
+    LogSlot slots[LOG_RING_SLOTS];
+    uint64_t write_pos; // NOTE: shared by all the threads that log
+    uint64_t read_pos;  // NOTE: owned by whoever holds flush_lock
+    uint64_t dropped;
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t flush_lock;
+} logger = { .fd = -1, .flush_lock = PTHREAD_MUTEX_INITIALIZER };
+
+const char *logpath = "./log.txt";
+
+const char *log_level_as_cstr(LogLevel level)
+{
+    static_assert(LOG_LEVELS_COUNT == 5, "log_level_as_cstr");
+    switch (level)
+    {
+        case LOG_DEBUG:   return "DEBUG";
+        case LOG_INFO:    return "INFO";
+        case LOG_WARNING: return "WARNING";
+        case LOG_ERROR:   return "ERROR";
+        default:          return "?";
+    }
+}
+
+#define log_at(level, ...) do {                                                 \
+        if ((level) >= LOG_LEVEL_MIN && (level) >= editor.config.log_level)    \
+            log_write((level), __VA_ARGS__);                                   \
+    } while (0)
+#define log_debug(...)   log_at(LOG_DEBUG,   __VA_ARGS__)
+#define log_info(...)    log_at(LOG_INFO,    __VA_ARGS__)
+#define log_warning(...) log_at(LOG_WARNING, __VA_ARGS__)
+#define log_error(...)   log_at(LOG_ERROR,   __VA_ARGS__)
+
+__attribute__((format(printf, 2, 3)))
+void log_write(LogLevel level, const char *fmt, ...)
+{
+    LogSlot *slot;
+    uint64_t pos = __atomic_load_n(&logger.write_pos, __ATOMIC_RELAXED);
+    while (true) {
+        slot = &logger.slots[pos % LOG_RING_SLOTS];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&logger.write_pos, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&logger.dropped, 1, __ATOMIC_RELAXED); // NOTE: the ring is full
+            return;
+        } else pos = __atomic_load_n(&logger.write_pos, __ATOMIC_RELAXED);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->timestamp_ns = (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+    slot->level = level;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(slot->text, LOG_MESSAGE_SIZE, fmt, ap);
+    va_end(ap);
+    slot->len = len < 0 ? 0 : len >= LOG_MESSAGE_SIZE ? LOG_MESSAGE_SIZE-1 : (uint32_t)len;
+    __atomic_store_n(&slot->sequence, pos+1, __ATOMIC_RELEASE);
+}
+
+static void logger_write(const char *buf, size_t len)
+{
+    for (size_t written = 0; written < len && logger.fd != -1; ) {
+        ssize_t n = write(logger.fd, buf + written, len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+}
+
+void logger_flush(void)
+{
+    pthread_mutex_lock(&logger.flush_lock);
+    static char buf[64*1024];
+    size_t len = 0;
+
+    while (true) {
+        LogSlot *slot = &logger.slots[logger.read_pos % LOG_RING_SLOTS];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != logger.read_pos+1) break;
+
+        if (len + LOG_MESSAGE_SIZE + 64 > sizeof(buf)) {
+            logger_write(buf, len);
+            len = 0;
+        }
+        time_t seconds = slot->timestamp_ns / 1000000000;
+        struct tm tm;
+        localtime_r(&seconds, &tm);
+        len += strftime(buf + len, sizeof(buf) - len, "%Y-%m-%d %H:%M:%S", &tm);
+        len += snprintf(buf + len, sizeof(buf) - len, ".%06"PRIu64" %-7s %.*s\n",
+                (slot->timestamp_ns % 1000000000) / 1000, log_level_as_cstr(slot->level), (int)slot->len, slot->text);
+
+        __atomic_store_n(&slot->sequence, logger.read_pos + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        logger.read_pos++;
+    }
+
+    uint64_t dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) len += snprintf(buf + len, sizeof(buf) - len, "... %"PRIu64" log messages dropped\n", dropped);
+    logger_write(buf, len);
+    pthread_mutex_unlock(&logger.flush_lock);
+}
+
+void *logger_run(void *arg)
+{
+    (void)arg;
+    const struct timespec interval = { .tv_nsec = LOG_FLUSH_INTERVAL_NS };
+    while (true) {
+        nanosleep(&interval, NULL);
+        logger_flush();
+    }
+    return NULL;
+}
+
+void logger_init(void)
+{
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) logger.slots[i].sequence = i;
+    if (LOG_LEVEL_MIN >= LOG_OFF) return;
+
+    logger.fd = open(logpath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (logger.fd == -1) return; // NOTE: logging is best effort, the messages are dropped when flushed
+
+    /* NOTE: signals are handled by the main thread, so a handler never waits for a lock held by the flush thread */
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    if (pthread_create(&logger.thread, NULL, logger_run, NULL) == 0) pthread_detach(logger.thread);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    atexit(logger_flush);
+}
+
+/// END Log
+
+/// BEGIN Messages
+
+static inline bool messages_is_empty(void) { return editor.messages.count == 0; }
+
+static inline size_t messages_stored(void)
+{
+    return editor.messages.count < MESSAGES_CAPACITY ? editor.messages.count : MESSAGES_CAPACITY;
+}
+
+/* NOTE: age 0 is the newest message, it must be < messages_stored() */
+static inline Message *messages_get(size_t age)
+{
+    return &editor.messages.items[(editor.messages.count-1-age) % MESSAGES_CAPACITY];
+}
+
+void messages_show(void)
+{
+    if (messages_is_empty()) return;
+    editor.is_showing_message = true;
+    editor.messages.shown_ns = monotonic_ns();
+}
+
+/* Older message, from the oldest one it goes back to the newest */
+void messages_previous(void)
+{
+    if (messages_is_empty()) return;
+    editor.messages.age = (editor.messages.age+1) % messages_stored();
+    messages_show();
+}
+
+/* Newer message, from the newest one it goes to the oldest */
+void messages_next(void)
+{
+    if (messages_is_empty()) return;
+    editor.messages.age = (editor.messages.age + messages_stored()-1) % messages_stored();
+    messages_show();
+}
+
+/* NOTE: called by the main loop */
+void messages_expire(void)
+{
+    if (!editor.is_showing_message || editor.in_cmd) return;
+    if (monotonic_ns() - editor.messages.shown_ns >= editor.config.msg_lifetime*1000000000ull)
+        editor.is_showing_message = false;
+}
+
+void write_message(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    char buf[MESSAGE_MAX_LEN] = {0};
+    if (headless.is_enabled) {
+        va_list copy;
+        va_copy(copy, ap);
+        vfprintf(stderr, fmt, copy);
+        fputc('\n', stderr);
+        va_end(copy);
+    }
+    size_t width = win_message.width < sizeof(buf) ? win_message.width : sizeof(buf);
+    vsnprintf(buf, width, fmt, ap);  // TODO: aumentare la dimensione della finestra
+                                     //       se il messaggio e' lungo o su piu' righe
+    va_end(ap);
+
+    Messages *m = &editor.messages;
+    if (!messages_is_empty() && streq(messages_get(0)->text, buf)) {
+        messages_get(0)->repeats++;
+    } else {
+        Message *slot = &m->items[m->count++ % MESSAGES_CAPACITY];
+        memcpy(slot->text, buf, sizeof(buf));
+        slot->repeats = 1;
+    }
+    m->age = 0;
+    if (!editor.in_cmd) messages_show();
+}
+
+/// END Messages
+
+static inline bool editor_is_expanding_snippet(void) { return editor.expanding_snippet.snippet != NULL; }
+
+static inline const char *prompt_label(void)
+{
+    if (editor.prompt == PROMPT_SEARCH) return editor.search.is_regex ? "Regex: " : "Search: ";
+    if (editor.prompt == PROMPT_HISTORY) return "History: ";
+    return "Command: ";
+}
+
+/// BEGIN Anchors
+
+/* Anchors are positions in the buffer that follow the edits. They are kept sorted in a treap
+ * whose nodes carry the moves not yet applied to their children, so every edit moves all the
+ * anchors after it in O(log n), and an anchor is read in O(log n) too. */
+
+#define ANCHOR_NONE -1
+
+static inline bool position_is_before(Cursor a, Cursor b) { return a.y < b.y || (a.y == b.y && a.x < b.x); }
+
+static void anchor_apply(Anchors *anchors, AnchorId id, bool has_assign, Cursor assign, size_t dy, size_t dx)
+{
+    if (id == ANCHOR_NONE) return;
+    AnchorNode *node = &anchors->items[id];
+    if (has_assign) {
+        node->pos = assign;
+        node->has_assign = true;
+        node->assign = assign;
+        node->dy = node->dx = 0;
+    }
+    node->pos.y += dy;
+    node->pos.x += dx;
+    node->dy += dy;
+    node->dx += dx;
+}
+
+static void anchor_push_down(Anchors *anchors, AnchorId id)
+{
+    AnchorNode *node = &anchors->items[id];
+    if (!node->has_assign && node->dy == 0 && node->dx == 0) return;
+    anchor_apply(anchors, node->left,  node->has_assign, node->assign, node->dy, node->dx);
+    anchor_apply(anchors, node->right, node->has_assign, node->assign, node->dy, node->dx);
+    node->has_assign = false;
+    node->dy = node->dx = 0;
+}
+
+static inline void anchor_adopt(Anchors *anchors, AnchorId id)
+{
+    AnchorNode *node = &anchors->items[id];
+    if (node->left  != ANCHOR_NONE) anchors->items[node->left].parent  = id;
+    if (node->right != ANCHOR_NONE) anchors->items[node->right].parent = id;
+}
+
+/* Anchors before pos go in left, the others in right */
+static void anchors_split(Anchors *anchors, AnchorId id, Cursor pos, AnchorId *left, AnchorId *right)
+{
+    if (id == ANCHOR_NONE) {
+        *left = *right = ANCHOR_NONE;
+        return;
+    }
+    anchor_push_down(anchors, id);
+    AnchorNode *node = &anchors->items[id];
+    if (position_is_before(node->pos, pos)) {
+        anchors_split(anchors, node->right, pos, &node->right, right);
+        *left = id;
+    } else {
+        anchors_split(anchors, node->left, pos, left, &node->left);
+        *right = id;
+    }
+    anchor_adopt(anchors, id);
+}
+
+/* All the anchors in left must come before the ones in right */
+static AnchorId anchors_merge(Anchors *anchors, AnchorId left, AnchorId right)
+{
+    if (left  == ANCHOR_NONE) return right;
+    if (right == ANCHOR_NONE) return left;
+    if (anchors->items[left].priority > anchors->items[right].priority) {
+        anchor_push_down(anchors, left);
+        AnchorId merged = anchors_merge(anchors, anchors->items[left].right, right);
+        anchors->items[left].right = merged;
+        anchor_adopt(anchors, left);
+        return left;
+    }
+    anchor_push_down(anchors, right);
+    AnchorId merged = anchors_merge(anchors, left, anchors->items[right].left);
+    anchors->items[right].left = merged;
+    anchor_adopt(anchors, right);
+    return right;
+}
+
+static inline void anchors_set_root(Anchors *anchors, AnchorId root)
+{
+    anchors->root = root;
+    if (root != ANCHOR_NONE) anchors->items[root].parent = ANCHOR_NONE;
+}
+
+AnchorId anchor_add(Anchors *anchors, Cursor pos)
+{
+    if (anchors->count == 0) anchors->root = anchors->free = ANCHOR_NONE;
+    AnchorId id = anchors->free;
+    if (id == ANCHOR_NONE) {
+        AnchorNode node = {0};
+        da_push(anchors, node);
+        id = anchors->count-1;
+    } else anchors->free = anchors->items[id].right;
+
+    if (anchors->seed == 0) anchors->seed = 2463534242;
+    anchors->seed ^= anchors->seed << 13; // NOTE: xorshift32
+    anchors->seed ^= anchors->seed >> 17;
+    anchors->seed ^= anchors->seed << 5;
+    anchors->items[id] = (AnchorNode){
+        .pos = pos,
+        .priority = anchors->seed,
+        .left = ANCHOR_NONE,
+        .right = ANCHOR_NONE,
+        .parent = ANCHOR_NONE,
+    };
+
+    AnchorId left, right;
+    anchors_split(anchors, anchors->root, pos, &left, &right);
+    anchors_set_root(anchors, anchors_merge(anchors, anchors_merge(anchors, left, id), right));
+    return id;
+}
+
+/* Applies the moves pending on the ancestors of the anchor */
+static void anchor_settle(Anchors *anchors, AnchorId id)
+{
+    static AnchorIds path = {0};
+    da_clear(&path);
+    for (AnchorId it = anchors->items[id].parent; it != ANCHOR_NONE; it = anchors->items[it].parent)
+        da_push(&path, it);
+    for (size_t i = path.count; i > 0; i--) anchor_push_down(anchors, path.items[i-1]);
+}
+
+Cursor anchor_get(Anchors *anchors, AnchorId id)
+{
+    anchor_settle(anchors, id);
+    return anchors->items[id].pos;
+}
+
+void anchor_remove(Anchors *anchors, AnchorId id)
+{
+    anchor_settle(anchors, id);
+    anchor_push_down(anchors, id);
+    AnchorNode *node = &anchors->items[id];
+    AnchorId parent = node->parent;
+    AnchorId merged = anchors_merge(anchors, node->left, node->right);
+    if (parent == ANCHOR_NONE) anchors_set_root(anchors, merged);
+    else {
+        if (anchors->items[parent].left == id) anchors->items[parent].left = merged;
+        else anchors->items[parent].right = merged;
+        if (merged != ANCHOR_NONE) anchors->items[merged].parent = parent;
+    }
+    node->right = anchors->free;
+    anchors->free = id;
+}
+
+void anchors_remove_all(Anchors *anchors, AnchorIds *ids)
+{
+    da_foreach (*ids, AnchorId, id) anchor_remove(anchors, *id);
+    da_clear(ids);
+}
+
+/* The text between begin and end has been replaced by text ending at new_end: the anchors in between
+ * go to begin, the ones after keep their distance from the end. Anchors at begin are pushed forward. */
+void anchors_splice(Anchors *anchors, Cursor begin, Cursor end, Cursor new_end)
+{
+    if (anchors->count == 0 || anchors->root == ANCHOR_NONE) return;
+    AnchorId before, inside, same_row, after;
+    anchors_split(anchors, anchors->root, begin, &before, &after);
+    anchors_split(anchors, after, end, &inside, &after);
+    anchors_split(anchors, after, (Cursor){ .x = 0, .y = end.y+1 }, &same_row, &after);
+
+    anchor_apply(anchors, inside, true, begin, 0, 0);
+    anchor_apply(anchors, same_row, false, (Cursor){0}, new_end.y-end.y, new_end.x-end.x);
+    anchor_apply(anchors, after, false, (Cursor){0}, new_end.y-end.y, 0);
+
+    AnchorId root = anchors_merge(anchors, inside, anchors_merge(anchors, same_row, after));
+    anchors_set_root(anchors, anchors_merge(anchors, before, root));
+}
+
+/* Same as rows_rotate: the rows [middle, end) now come before the rows [begin, middle) */
+void anchors_rotate_rows(Anchors *anchors, size_t begin, size_t middle, size_t end)
+{
+    if (anchors->count == 0 || anchors->root == ANCHOR_NONE) return;
+    AnchorId before, first, second, after;
+    anchors_split(anchors, anchors->root, (Cursor){ .x = 0, .y = begin }, &before, &after);
+    anchors_split(anchors, after, (Cursor){ .x = 0, .y = middle }, &first, &after);
+    anchors_split(anchors, after, (Cursor){ .x = 0, .y = end }, &second, &after);
+
+    anchor_apply(anchors, first, false, (Cursor){0}, end-middle, 0);
+    anchor_apply(anchors, second, false, (Cursor){0}, -(middle-begin), 0);
+
+    AnchorId root = anchors_merge(anchors, second, anchors_merge(anchors, first, after));
+    anchors_set_root(anchors, anchors_merge(anchors, before, root));
+}
+
+/* NOTE: when the whole buffer is replaced the anchors stay registered, at the beginning */
+void anchors_collapse(Anchors *anchors)
+{
+    if (anchors->count == 0) return;
+    anchor_apply(anchors, anchors->root, true, (Cursor){0}, 0, 0);
+}
+
+/// END Anchors
+
+/// BEGIN Cursors
+
+int compare_cursors_reverse(const void *p1, const void *p2)
+{
+    Cursor *c1 = *(Cursor **)p1;
+    Cursor *c2 = *(Cursor **)p2;
+    if (c1->y != c2->y) return c2->y - c1->y;
+    return c2->x - c1->x;
+}
+
+void add_multicursor_mark(void)
+{
+    if (editor.multicursor.is_enabled || editor.in_cmd) return;
+
+    da_foreach (editor.multicursor, Cursor, cursor)
+        if (editor.cursor.x == cursor->x && editor.cursor.y == cursor->y)
+            return;
+
+    da_push(&editor.multicursor, editor.cursor);
+    write_message("Added cursor mark at (%zu, %zu)", editor.cursor.x, editor.cursor.y);
+}
+
+void sort_multicursor(void)
+{
+    da_clear(&editor.sorted_multicursor);
+    da_push(&editor.sorted_multicursor, &editor.cursor);
+    
+    da_foreach (editor.multicursor, Cursor, cursor)
+        if (editor.cursor.x != cursor->x || editor.cursor.y != cursor->y)
+            da_push(&editor.sorted_multicursor, cursor);
+
+    qsort(editor.sorted_multicursor.items, editor.sorted_multicursor.count, sizeof(Cursor*), compare_cursors_reverse);
+}
+
+/* The main cursor and the multicursor marks are anchored while an edit is done at each of them,
+ * so what is done at one moves the others where they belong. Returns the anchors in sorted order. */
+AnchorIds multicursor_anchor(void)
+{
+    AnchorIds ids = {0};
+    da_foreach (editor.sorted_multicursor, Cursor *, cursor)
+        da_push(&ids, anchor_add(&editor.anchors, **cursor));
+    return ids;
+}
+
+void multicursor_release(AnchorIds *ids)
+{
+    da_enumerate (*ids, AnchorId, i, id)
+        *editor.sorted_multicursor.items[i] = anchor_get(&editor.anchors, *id);
+    anchors_remove_all(&editor.anchors, ids);
+    da_free(ids);
+}
+
+void enable_multicursor(void)
+{
+    if (editor.multicursor.is_enabled || editor.in_cmd) return;
+
+    if (!da_is_empty(&editor.multicursor)) {
+        sort_multicursor();
+        editor.multicursor.is_enabled = true;
+        //write_message("Multicursor has been enabled");
+    } //else write_message("No marks to enable multicursor");
+}
+
+void expanding_snippet_stop(void)
+{
+    editor.expanding_snippet.snippet = NULL;
+    editor.expanding_snippet.mark_index = -1;
+    anchors_remove_all(&editor.anchors, &editor.expanding_snippet.marks);
+}
+
+void disable_multicursor(void)
+{
+    if (!editor.multicursor.is_enabled || editor.in_cmd) return;
+
+    da_clear(&editor.multicursor);
+    editor.multicursor.is_enabled = false;
+
+    if (editor_is_expanding_snippet()) expanding_snippet_stop();
+    //else write_message("Multicursor has been disabled and all marks have been cleared");
+}
+
+/// END Cursors
+
+/// BEGIN Registers
+
+int register_index_from_char(int c)
+{
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= '0' && c <= '9') return 26 + c - '0';
+    if (c == '"')             return UNNAMED_REGISTER;
+    return -1;
+}
+
+char register_name(int index)
+{
+    if (index < 26)               return 'a' + index;
+    if (index < UNNAMED_REGISTER) return '0' + index - 26;
+    return '"';
+}
+
+Cursor clamp_position(Cursor pos)
+{
+    if (editor.rows.count == 0) return (Cursor){0};
+    if (pos.y >= editor.rows.count) {
+        pos.y = editor.rows.count-1;
+        pos.x = ROW(pos.y)->content.count;
+    }
+    if (pos.x > ROW(pos.y)->content.count) pos.x = ROW(pos.y)->content.count;
+    return pos;
+}
+
+
+/* Appends to dst the text between begin (included) and end (excluded),
+ * rows are joined with '\n'. Both positions must be already clamped. */
+void buffer_copy_range(String *dst, Cursor begin, Cursor end)
+{
+    for (size_t y = begin.y; y <= end.y; y++) {
+        Row *row = ROW(y);
+        size_t from = y == begin.y ? begin.x : 0;
+        size_t to   = y == end.y   ? end.x   : row->content.count;
+        if (to > from) s_push_str(dst, row->content.items+from, to-from);
+        if (y != end.y) s_push(dst, '\n');
+    }
+}
+
+void register_materialize(Register *reg)
+{
+    mem_scope(MEM_REGISTERS);
+    if (!reg->is_reference) return;
+    s_clear(&reg->text);
+    buffer_copy_range(&reg->text, reg->begin, reg->end);
+    reg->is_reference = false;
+    editor.referencing_registers--;
+}
+
+void register_set_reference(Register *reg, Cursor begin, Cursor end)
+{
+    if (!reg->is_reference) editor.referencing_registers++;
+    s_clear(&reg->text);
+    reg->is_reference = true;
+    reg->begin = begin;
+    reg->end = end;
+}
+
+static inline bool register_is_empty(Register *reg) { return !reg->is_reference && reg->text.count == 0; }
+
+/* NOTE: registers only keep a reference to the yanked range, the actual copy
+ *       is made the first time the buffer is about to change there.
+ *       Every function that modifies editor.rows must call this first, with the
+ *       first row it touches: the rows above it keep their content and position.
+ *       A running search is dropped too, its positions would be stale. */
+static inline void buffer_before_edit(size_t first_row)
+{
+    editor.search.is_scanning = false;
+    editor.search.has_match = false;
+    if (editor.referencing_registers == 0) return;
+    for (size_t i = 0; i < REGISTERS_COUNT; i++) {
+        Register *reg = &editor.registers[i];
+        if (reg->is_reference && first_row <= reg->end.y) register_materialize(reg);
+    }
+}
+
+/// END Registers
+
+/// BEGIN Selection
+
+void selection_start(void)
+{
+    if (editor.in_cmd) return;
+    editor.selection.is_active = true;
+    editor.selection.anchor = (Cursor){ .x = CURRENT_X_POS, .y = CURRENT_Y_POS };
+}
+
+static inline void selection_stop(void) { editor.selection.is_active = false; }
+
+/* The character under the cursor is part of the selection. If the cursor
+ * is past the end of its row the newline is selected too. */
+bool selection_get_range(Cursor *begin, Cursor *end)
+{
+    if (!editor.selection.is_active || editor.rows.count == 0) return false;
+
+    Cursor current = { .x = CURRENT_X_POS, .y = CURRENT_Y_POS };
+    Cursor b = editor.selection.anchor;
+    Cursor e = current;
+    if (position_is_before(e, b)) {
+        b = current;
+        e = editor.selection.anchor;
+    }
+    b = clamp_position(b);
+    if (e.y < editor.rows.count-1 && e.x >= ROW(e.y)->content.count) {
+        e.y++;
+        e.x = 0;
+    } else {
+        e.x++;
+        e = clamp_position(e);
+    }
+    if (!position_is_before(b, e)) return false;
+
+    *begin = b;
+    *end = e;
+    return true;
+}
+
+/// END Selection
+
+/// BEGIN Viewport
+
+/* NOTE: editor.cursor is an absolute position in the buffer and editor.offset is the
+ *       first row on screen. The screen row of the cursor and the current page are
+ *       always derived from them, so nothing else has to be kept in sync. */
+
+static inline size_t viewport_height(void) { return win_main.height > 0 ? win_main.height : 1; }
+static inline size_t viewport_page(void) { return editor.offset/viewport_height(); }
+static inline size_t viewport_pages_count(void) { return editor.rows.count/viewport_height() + 1; }
+static inline size_t viewport_last_row(void) { return editor.offset + viewport_height() - 1; }
+static inline bool viewport_contains(size_t y) { return y >= editor.offset && y <= viewport_last_row(); }
+
+/* NOTE: the cursor can go one row past the end of the buffer, typing there appends a new row */
+static inline size_t last_cursor_row(void) { return editor.rows.count; }
+
+void viewport_set_offset(size_t offset)
+{
+    size_t max_offset = editor.rows.count > 0 ? editor.rows.count-1 : 0;
+    editor.offset = offset > max_offset ? max_offset : offset;
+}
+
+/* Scrolls just enough to have the cursor on screen */
+void viewport_follow_cursor(void)
+{
+    if (editor.cursor.y < editor.offset) editor.offset = editor.cursor.y;
+    else if (editor.cursor.y > viewport_last_row()) editor.offset = editor.cursor.y - viewport_height() + 1;
+}
+
+void viewport_center_on(size_t y)
+{
+    size_t half = viewport_height()/2;
+    viewport_set_offset(y > half ? y-half : 0);
+}
+
+/* Scrolls the view leaving the cursor where it is, unless it would go off screen */
+void viewport_scroll(long delta)
+{
+    if (delta < 0 && (size_t)-delta > editor.offset) viewport_set_offset(0);
+    else viewport_set_offset(editor.offset + delta);
+
+    if (editor.cursor.y < editor.offset) editor.cursor.y = editor.offset;
+    else if (editor.cursor.y > viewport_last_row()) editor.cursor.y = viewport_last_row();
+}
+
+/* Puts the cursor at the absolute position (x, y), scrolling just enough to keep it on screen */
+void move_cursor_to(size_t y, size_t x)
+{
+    editor.cursor.y = y > last_cursor_row() ? last_cursor_row() : y;
+    editor.cursor.x = x;
+    viewport_follow_cursor();
+}
+
+/// END Viewport
+
+/// BEGIN Regex
+
+/* Supported syntax: literals, `.`, `[...]` and `[^...]` classes, `\d \w \s` and their
+ * negations, `^`, `$`, groups, `|`, `* + ?` and `{n}`, `{n,}`, `{n,m}`.
+ * Patterns compile to a Thompson NFA, which is run through a DFA built lazily one
+ * transition at a time, so matching is linear in the length of the row. */
+
+#define REGEX_MAX_INSTS 20000
+#define REGEX_MAX_REPEAT 1000
+#define DFA_MAX_STATES 512 // NOTE: when the cache is full it is flushed and rebuilt as needed
+#define DFA_UNKNOWN -1
+#define DFA_DEAD -2
+
+typedef enum { RE_NODE_SET, RE_NODE_EMPTY, RE_NODE_CONCAT, RE_NODE_ALT, RE_NODE_REPEAT, RE_NODE_BOL, RE_NODE_EOL } RegexNodeKind;
+
+typedef struct
+{
+    RegexNodeKind kind;
+    int left;
+    int right;
+    int min;
+    int max; // NOTE: -1 is unbounded
+    int set;
+} RegexNode;
+
+typedef struct
+{
+    RegexNode *items;
+    size_t count;
+    size_t capacity;
+} RegexNodes;
+
+typedef struct
+{
+    const char *src;
+    size_t n;
+    size_t i;
+    bool ignore_case;
+    RegexNodes nodes;
+    ByteSets *sets;
+    String *error;
+} RegexParser;
+
+static inline void byteset_add(ByteSet *set, unsigned char c) { set->bits[c/64] |= (uint64_t)1 << (c%64); }
+static inline bool byteset_has(const ByteSet *set, unsigned char c) { return set->bits[c/64] & ((uint64_t)1 << (c%64)); }
+
+static void byteset_add_range(ByteSet *set, unsigned char from, unsigned char to, bool ignore_case)
+{
+    for (unsigned c = from; c <= to; c++) {
+        byteset_add(set, c);
+        if (ignore_case && isalpha(c)) {
+            byteset_add(set, tolower(c));
+            byteset_add(set, toupper(c));
+        }
+    }
+}
+
+static void byteset_negate(ByteSet *set) { for (size_t i = 0; i < 4; i++) set->bits[i] = ~set->bits[i]; }
+
+static void byteset_merge(ByteSet *dst, const ByteSet *src) { for (size_t i = 0; i < 4; i++) dst->bits[i] |= src->bits[i]; }
+
+/* \d \w \s and their negations */
+static bool byteset_from_escape(char c, ByteSet *set)
+{
+    *set = (ByteSet){0};
+    switch (tolower((unsigned char)c)) {
+        case 'd': byteset_add_range(set, '0', '9', false); break;
+        case 'w':
+            byteset_add_range(set, 'a', 'z', false);
+            byteset_add_range(set, 'A', 'Z', false);
+            byteset_add_range(set, '0', '9', false);
+            byteset_add(set, '_');
+            break;
+        case 's':
+            byteset_add(set, ' ');
+            byteset_add_range(set, '\t', '\r', false);
+            break;
+        default: return false;
+    }
+    if (isupper((unsigned char)c)) byteset_negate(set);
+    return true;
+}
+
+static char regex_escaped_char(char c)
+{
+    switch (c) {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        default:  return c;
+    }
+}
+
+static int regex_error(RegexParser *p, const char *msg)
+{
+    s_clear(p->error);
+    s_push_fstr(p->error, "%s at column %zu", msg, p->i+1);
+    return -1;
+}
+
+static int regex_node(RegexParser *p, RegexNodeKind kind, int left, int right)
+{
+    RegexNode node = { .kind = kind, .left = left, .right = right, .set = -1 };
+    da_push(&p->nodes, node);
+    return p->nodes.count-1;
+}
+
+static int regex_set_node(RegexParser *p, ByteSet set)
+{
+    da_push(p->sets, set);
+    int node = regex_node(p, RE_NODE_SET, -1, -1);
+    p->nodes.items[node].set = p->sets->count-1;
+    return node;
+}
+
+static inline bool regex_at(RegexParser *p, char c) { return p->i < p->n && p->src[p->i] == c; }
+
+static int regex_parse_alternation(RegexParser *p);
+
+static int regex_parse_class(RegexParser *p)
+{
+    p->i++; // [
+    ByteSet set = {0};
+    bool negate = regex_at(p, '^');
+    if (negate) p->i++;
+
+    bool first = true;
+    while (p->i < p->n && (first || p->src[p->i] != ']')) {
+        first = false;
+        unsigned char from = p->src[p->i++];
+        if (from == '\\') {
+            if (p->i >= p->n) return regex_error(p, "trailing `\\`");
+            ByteSet escaped;
+            if (byteset_from_escape(p->src[p->i], &escaped)) {
+                byteset_merge(&set, &escaped);
+                p->i++;
+                continue;
+            }
+            from = regex_escaped_char(p->src[p->i++]);
+        }
+        unsigned char to = from;
+        if (p->i+1 < p->n && p->src[p->i] == '-' && p->src[p->i+1] != ']') {
+            p->i++;
+            to = p->src[p->i++];
+            if (to == '\\') {
+                if (p->i >= p->n) return regex_error(p, "trailing `\\`");
+                to = regex_escaped_char(p->src[p->i++]);
+            }
+            if (to < from) return regex_error(p, "invalid range in `[...]`");
+        }
+        byteset_add_range(&set, from, to, p->ignore_case);
+    }
+    if (!regex_at(p, ']')) return regex_error(p, "missing `]`");
+    p->i++;
+
+    if (negate) byteset_negate(&set);
+    return regex_set_node(p, set);
+}
+
+static int regex_parse_atom(RegexParser *p)
+{
+    char c = p->src[p->i];
+    ByteSet set = {0};
+    switch (c) {
+        case '(': {
+            p->i++;
+            if (p->i+1 < p->n && p->src[p->i] == '?' && p->src[p->i+1] == ':') p->i += 2; // NOTE: groups never capture anyway
+            int node = regex_parse_alternation(p);
+            if (node < 0) return node;
+            if (!regex_at(p, ')')) return regex_error(p, "missing `)`");
+            p->i++;
+            return node;
+        }
+        case '[': return regex_parse_class(p);
+        case '.':
+            p->i++;
+            byteset_negate(&set);
+            return regex_set_node(p, set);
+        case '^': p->i++; return regex_node(p, RE_NODE_BOL, -1, -1);
+        case '$': p->i++; return regex_node(p, RE_NODE_EOL, -1, -1);
+        case '*':
+        case '+':
+        case '?': return regex_error(p, "nothing to repeat");
+        case '\\':
+            p->i++;
+            if (p->i >= p->n) return regex_error(p, "trailing `\\`");
+            c = p->src[p->i++];
+            if (byteset_from_escape(c, &set)) return regex_set_node(p, set);
+            c = regex_escaped_char(c);
+            break;
+        default: p->i++; break;
+    }
+    byteset_add_range(&set, c, c, p->ignore_case);
+    return regex_set_node(p, set);
+}
+
+static bool regex_parse_number(RegexParser *p, int *n)
+{
+    if (p->i >= p->n || !isdigit((unsigned char)p->src[p->i])) return false;
+    *n = 0;
+    while (p->i < p->n && isdigit((unsigned char)p->src[p->i])) {
+        if (*n <= REGEX_MAX_REPEAT) *n = *n*10 + (p->src[p->i] - '0');
+        p->i++;
+    }
+    return true;
+}
+
+/* Parses `{n}`, `{n,}` or `{n,m}`, anything else is left alone and `{` is a literal */
+static bool regex_parse_braces(RegexParser *p, int *min, int *max)
+{
+    size_t saved = p->i;
+    p->i++; // {
+    if (!regex_parse_number(p, min)) goto literal;
+    *max = *min;
+    if (regex_at(p, ',')) {
+        p->i++;
+        if (!regex_parse_number(p, max)) *max = -1;
+    }
+    if (!regex_at(p, '}')) goto literal;
+    p->i++;
+    return true;
+literal:
+    p->i = saved;
+    return false;
+}
+
+static int regex_parse_repetition(RegexParser *p)
+{
+    int node = regex_parse_atom(p);
+    while (node >= 0 && p->i < p->n) {
+        int min, max;
+        char c = p->src[p->i];
+        if      (c == '*') { min = 0; max = -1; p->i++; }
+        else if (c == '+') { min = 1; max = -1; p->i++; }
+        else if (c == '?') { min = 0; max = 1;  p->i++; }
+        else if (c == '{' && regex_parse_braces(p, &min, &max)) {
+            if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT) return regex_error(p, "repetition count too big");
+            if (max != -1 && max < min) return regex_error(p, "invalid repetition count");
+        } else break;
+
+        node = regex_node(p, RE_NODE_REPEAT, node, -1);
+        p->nodes.items[node].min = min;
+        p->nodes.items[node].max = max;
+    }
+    return node;
+}
+
+static int regex_parse_concatenation(RegexParser *p)
+{
+    int node = -1;
+    while (p->i < p->n && p->src[p->i] != '|' && p->src[p->i] != ')') {
+        int next = regex_parse_repetition(p);
+        if (next < 0) return next;
+        node = node < 0 ? next : regex_node(p, RE_NODE_CONCAT, node, next);
+    }
+    return node < 0 ? regex_node(p, RE_NODE_EMPTY, -1, -1) : node;
+}
+
+static int regex_parse_alternation(RegexParser *p)
+{
+    int node = regex_parse_concatenation(p);
+    while (node >= 0 && regex_at(p, '|')) {
+        p->i++;
+        int right = regex_parse_concatenation(p);
+        if (right < 0) return right;
+        node = regex_node(p, RE_NODE_ALT, node, right);
+    }
+    return node;
+}
+
+static int regex_emit(RegexProgram *prog, RegexOp op, int out, int out1, int set)
+{
+    if (prog->count >= REGEX_MAX_INSTS) return -1;
+    RegexInst inst = { .op = op, .out = out, .out1 = out1, .set = set };
+    da_push(prog, inst);
+    return prog->count-1;
+}
+
+/* Compiles node so that it continues to next and returns its first instruction.
+ * In reverse the concatenations are swapped and so are the anchors. */
+static int regex_compile_node(RegexProgram *prog, RegexNodes *nodes, int index, int next, bool reverse)
+{
+    RegexNode node = nodes->items[index];
+    switch (node.kind) {
+        case RE_NODE_SET:   return regex_emit(prog, RE_OP_BYTE, next, -1, node.set);
+        case RE_NODE_EMPTY: return next;
+        case RE_NODE_BOL:   return regex_emit(prog, reverse ? RE_OP_AT_END : RE_OP_AT_START, next, -1, -1);
+        case RE_NODE_EOL:   return regex_emit(prog, reverse ? RE_OP_AT_START : RE_OP_AT_END, next, -1, -1);
+        case RE_NODE_CONCAT: {
+            int second = reverse ? node.left : node.right;
+            int first  = reverse ? node.right : node.left;
+            int pc = regex_compile_node(prog, nodes, second, next, reverse);
+            return pc < 0 ? pc : regex_compile_node(prog, nodes, first, pc, reverse);
+        }
+        case RE_NODE_ALT: {
+            int left = regex_compile_node(prog, nodes, node.left, next, reverse);
+            if (left < 0) return left;
+            int right = regex_compile_node(prog, nodes, node.right, next, reverse);
+            if (right < 0) return right;
+            return regex_emit(prog, RE_OP_SPLIT, left, right, -1);
+        }
+        case RE_NODE_REPEAT: {
+            int pc = next;
+            if (node.max == -1) {
+                int loop = regex_emit(prog, RE_OP_SPLIT, -1, next, -1);
+                if (loop < 0) return loop;
+                int body = regex_compile_node(prog, nodes, node.left, loop, reverse);
+                if (body < 0) return body;
+                prog->items[loop].out = body;
+                pc = loop;
+            } else {
+                for (int i = node.min; i < node.max; i++) {
+                    int body = regex_compile_node(prog, nodes, node.left, pc, reverse);
+                    if (body < 0) return body;
+                    pc = regex_emit(prog, RE_OP_SPLIT, body, next, -1);
+                    if (pc < 0) return pc;
+                }
+            }
+            for (int i = 0; i < node.min; i++) {
+                pc = regex_compile_node(prog, nodes, node.left, pc, reverse);
+                if (pc < 0) return pc;
+            }
+            return pc;
+        }
+    }
+    return -1;
+}
+
+static bool regex_compile_program(RegexProgram *prog, RegexNodes *nodes, int root, bool reverse)
+{
+    int match = regex_emit(prog, RE_OP_MATCH, -1, -1, -1);
+    prog->start = regex_compile_node(prog, nodes, root, match, reverse);
+    return prog->start >= 0;
+}
+
+void regex_free(Regex *re)
+{
+    da_free(&re->sets);
+    da_free(&re->forward);
+    da_free(&re->reverse);
+}
+
+/* On failure the reason is written to error */
+bool regex_compile(Regex *re, const char *pattern, size_t n, bool ignore_case, String *error)
+{
+    *re = (Regex){0};
+    RegexParser p = { .src = pattern, .n = n, .ignore_case = ignore_case, .sets = &re->sets, .error = error };
+
+    int root = regex_parse_alternation(&p);
+    if (root >= 0 && p.i < p.n) root = regex_error(&p, "unmatched `)`");
+    bool ok = root >= 0;
+    if (ok && (!regex_compile_program(&re->forward, &p.nodes, root, false)
+               || !regex_compile_program(&re->reverse, &p.nodes, root, true))) {
+        s_clear(error);
+        s_push_fstr(error, "pattern too big");
+        ok = false;
+    }
+
+    da_free(&p.nodes);
+    if (!ok) regex_free(re);
+    return ok;
+}
+
+static void dfa_init(Dfa *dfa, const RegexProgram *prog, const ByteSets *sets, bool unanchored)
+{
+    *dfa = (Dfa){ .prog = prog, .sets = sets, .unanchored = unanchored, .start = { DFA_UNKNOWN, DFA_UNKNOWN } };
+    // NOTE: every state can be pushed at most twice, by a SPLIT and as a start
+    dfa->stack   = malloc(sizeof(int)*(2*prog->count+1));
+    dfa->set     = malloc(sizeof(int)*prog->count);
+    dfa->end_set = malloc(sizeof(int)*prog->count);
+    dfa->mark    = calloc(prog->count, sizeof(unsigned));
+}
+
+static void dfa_flush(Dfa *dfa)
+{
+    da_foreach (*dfa, DfaState, state) free(state->nfa);
+    da_clear(dfa);
+    dfa->start[0] = dfa->start[1] = DFA_UNKNOWN;
+    dfa->flushes++;
+}
+
+static void dfa_free(Dfa *dfa)
+{
+    dfa_flush(dfa);
+    da_free(dfa);
+    free(dfa->stack);
+    free(dfa->set);
+    free(dfa->end_set);
+    free(dfa->mark);
+}
+
+/* Adds to set the states reachable from pc without consuming bytes. AT_END ones
+ * are kept in the set when not at the end, the row may still end right there. */
+static void dfa_closure(Dfa *dfa, int pc, bool at_start, bool at_end, int *set, size_t *n)
+{
+    size_t sp = 0;
+    dfa->stack[sp++] = pc;
+    while (sp > 0) {
+        pc = dfa->stack[--sp];
+        if (pc < 0 || dfa->mark[pc] == dfa->generation) continue;
+        dfa->mark[pc] = dfa->generation;
+
+        const RegexInst *inst = &dfa->prog->items[pc];
+        switch (inst->op) {
+            case RE_OP_BYTE:
+            case RE_OP_MATCH: set[(*n)++] = pc; break;
+            case RE_OP_SPLIT:
+                dfa->stack[sp++] = inst->out1;
+                dfa->stack[sp++] = inst->out;
+                break;
+            case RE_OP_AT_START: if (at_start) dfa->stack[sp++] = inst->out; break;
+            case RE_OP_AT_END:
+                if (at_end) dfa->stack[sp++] = inst->out;
+                else set[(*n)++] = pc;
+                break;
+        }
+    }
+}
+
+static int compare_ints(const void *a, const void *b) { return *(const int *)a - *(const int *)b; }
+
+static int dfa_intern(Dfa *dfa, int *set, size_t n)
+{
+    qsort(set, n, sizeof(int), compare_ints);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++) hash = (hash ^ (uint64_t)set[i]) * 1099511628211ull;
+
+    for (size_t i = 0; i < dfa->count; i++) {
+        DfaState *state = &dfa->items[i];
+        if (state->hash == hash && state->nfa_count == n && memcmp(state->nfa, set, n*sizeof(int)) == 0) return i;
+    }
+    if (dfa->count >= DFA_MAX_STATES) dfa_flush(dfa);
+
+    DfaState state = { .nfa = malloc(n*sizeof(int)), .nfa_count = n, .hash = hash };
+    memcpy(state.nfa, set, n*sizeof(int));
+    memset(state.next, 0xff, sizeof(state.next)); // NOTE: all DFA_UNKNOWN
+
+    size_t end_count = 0;
+    dfa->generation++;
+    for (size_t i = 0; i < n; i++) {
+        const RegexInst *inst = &dfa->prog->items[set[i]];
+        if (inst->op == RE_OP_MATCH) state.is_match = true;
+        else if (inst->op == RE_OP_AT_END) dfa_closure(dfa, inst->out, false, true, dfa->end_set, &end_count);
+    }
+    state.is_match_at_end = state.is_match;
+    for (size_t i = 0; i < end_count; i++)
+        if (dfa->prog->items[dfa->end_set[i]].op == RE_OP_MATCH) state.is_match_at_end = true;
+
+    da_push(dfa, state);
+    return dfa->count-1;
+}
+
+static int dfa_start(Dfa *dfa, bool at_start)
+{
+    if (dfa->start[at_start] != DFA_UNKNOWN) return dfa->start[at_start];
+    size_t n = 0;
+    dfa->generation++;
+    dfa_closure(dfa, dfa->prog->start, at_start, false, dfa->set, &n);
+    int state = dfa_intern(dfa, dfa->set, n);
+    dfa->start[at_start] = state;
+    return state;
+}
+
+static int dfa_compute_next(Dfa *dfa, int from, unsigned char c)
+{
+    size_t n = 0;
+    dfa->generation++;
+    DfaState *state = &dfa->items[from];
+    for (size_t i = 0; i < state->nfa_count; i++) {
+        const RegexInst *inst = &dfa->prog->items[state->nfa[i]];
+        if (inst->op == RE_OP_BYTE && byteset_has(&dfa->sets->items[inst->set], c))
+            dfa_closure(dfa, inst->out, false, false, dfa->set, &n);
+    }
+    if (dfa->unanchored) dfa_closure(dfa, dfa->prog->start, false, false, dfa->set, &n);
+    if (n == 0) return dfa->items[from].next[c] = DFA_DEAD;
+
+    size_t flushes = dfa->flushes;
+    int next = dfa_intern(dfa, dfa->set, n);
+    if (dfa->flushes == flushes) dfa->items[from].next[c] = next; // NOTE: after a flush from is gone
+    return next;
+}
+
+static inline int dfa_next(Dfa *dfa, int from, unsigned char c)
+{
+    int next = dfa->items[from].next[c];
+    return next != DFA_UNKNOWN ? next : dfa_compute_next(dfa, from, c);
+}
+
+static inline bool dfa_is_match(Dfa *dfa, int state, bool at_end)
+{
+    return at_end ? dfa->items[state].is_match_at_end : dfa->items[state].is_match;
+}
+
+void regex_matcher_init(RegexMatcher *m, const Regex *re)
+{
+    dfa_init(&m->scan, &re->forward, &re->sets, true);
+    dfa_init(&m->forward, &re->forward, &re->sets, false);
+    dfa_init(&m->reverse, &re->reverse, &re->sets, false);
+}
+
+void regex_matcher_free(RegexMatcher *m)
+{
+    dfa_free(&m->scan);
+    dfa_free(&m->forward);
+    dfa_free(&m->reverse);
+}
+
+/* Finds the first match that ends at column from or after it, taken from its leftmost
+ * start and made as long as possible: an unanchored scan of the forward program stops
+ * at the first column where a match ends, an anchored scan of the reverse program from
+ * there back to from gives the start, an anchored scan of the forward program from the
+ * start gives the longest end.
+ * NOTE: the scans stop at the match instead of the end of the row, so looping over the
+ *       matches of a row is linear in its length (the last scan only goes past the match
+ *       while a longer one is still possible). For `abcd|c` in "abcd" this gives "c",
+ *       where a leftmost-longest engine would give "abcd". */
+bool regex_find(RegexMatcher *m, const char *line, size_t len, size_t from, size_t *col, size_t *match_len)
+{
+    if (from > len) return false;
+
+    Dfa *dfa = &m->scan;
+    int state = dfa_start(dfa, from == 0);
+    size_t first_end = dfa_is_match(dfa, state, from == len) ? from : SIZE_MAX;
+    for (size_t p = from; p < len && first_end == SIZE_MAX; p++) {
+        state = dfa_next(dfa, state, line[p]);
+        if (state == DFA_DEAD) break; // NOTE: only when nothing can match anymore, like `^` away from the start
+        if (dfa_is_match(dfa, state, p+1 == len)) first_end = p+1;
+    }
+    if (first_end == SIZE_MAX) return false;
+
+    dfa = &m->reverse;
+    state = dfa_start(dfa, first_end == len);
+    size_t start = dfa_is_match(dfa, state, first_end == 0) ? first_end : SIZE_MAX;
+    for (size_t p = first_end; p > from; p--) {
+        state = dfa_next(dfa, state, line[p-1]);
+        if (state == DFA_DEAD) break;
+        if (dfa_is_match(dfa, state, p-1 == 0)) start = p-1;
+    }
+    assert(start != SIZE_MAX);
+
+    dfa = &m->forward;
+    state = dfa_start(dfa, start == 0);
+    size_t end = dfa_is_match(dfa, state, start == len) ? start : SIZE_MAX;
+    for (size_t p = start; p < len; p++) {
+        state = dfa_next(dfa, state, line[p]);
+        if (state == DFA_DEAD) break;
+        if (dfa_is_match(dfa, state, p+1 == len)) end = p+1;
+    }
+    if (end == SIZE_MAX) return false;
+
+    *col = start;
+    *match_len = end-start;
+    return true;
+}
+
+/// END Regex
+
+/// BEGIN Search
+
+void match_index_reset(void);
+
+#define SEARCH_NOT_FOUND ((size_t)-1)
+#define SEARCH_TIME_SLICE_NS (2*1000*1000) // NOTE: how long a scan can hold the main loop
+#define SEARCH_CLOCK_CHECK_BYTES (64*1024)
+
+/* With ignore_case the needle must be already lowercase */
+static inline bool bytes_match(const char *haystack, const char *needle, size_t n, bool ignore_case)
+{
+    if (!ignore_case) return memcmp(haystack, needle, n) == 0;
+    for (size_t i = 0; i < n; i++)
+        if (tolower((unsigned char)haystack[i]) != needle[i]) return false;
+    return true;
+}
+
+/* Returns the index of the first occurrence of needle in haystack or SEARCH_NOT_FOUND.
+ * Candidates are filtered comparing the first and the last byte of the needle, 16
+ * positions at a time when SSE2 is available, only the survivors are compared in full. */
+size_t find_substring(const char *haystack, size_t n, const char *needle, size_t m, bool ignore_case)
+{
+    if (m == 0) return 0;
+    if (m > n) return SEARCH_NOT_FOUND;
+
+    size_t last = m-1;
+    size_t i = 0;
+#ifdef __SSE2__
+    // NOTE: setting 0x20 lowercases ASCII letters, other bytes may end up equal
+    //       but that only lets a few more candidates through the filter
+    const __m128i fold = _mm_set1_epi8(ignore_case ? 0x20 : 0);
+    const __m128i first_byte = _mm_or_si128(_mm_set1_epi8(needle[0]), fold);
+    const __m128i last_byte  = _mm_or_si128(_mm_set1_epi8(needle[last]), fold);
+    for (; i + last + 16 <= n; i += 16) {
+        __m128i block_first = _mm_or_si128(_mm_loadu_si128((const __m128i *)(haystack+i)), fold);
+        __m128i block_last  = _mm_or_si128(_mm_loadu_si128((const __m128i *)(haystack+i+last)), fold);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first_byte),
+                                                        _mm_cmpeq_epi8(block_last, last_byte)));
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (bytes_match(haystack+at, needle, m, ignore_case)) return at;
+            mask &= mask-1;
+        }
+    }
+#endif
+    for (; i + last < n; i++) {
+        if (!ignore_case) {
+            const char *p = memchr(haystack+i, needle[0], n-last-i);
+            if (p == NULL) break;
+            i = p-haystack;
+        } else if (tolower((unsigned char)haystack[i]) != needle[0]) continue;
+        if (bytes_match(haystack+i, needle, m, ignore_case)) return i;
+    }
+    return SEARCH_NOT_FOUND;
+}
+
+/* First match in row y at column from or after it */
+bool search_find_in_row(size_t y, size_t from, size_t *col, size_t *len)
+{
+    String *line = &ROW(y)->content;
+    if (from > line->count) return false;
+    if (editor.search.is_regex) return regex_find(&editor.search.matcher, line->items, line->count, from, col, len);
+    size_t at = find_substring(line->items+from, line->count-from,
+                               editor.search.pattern.items, editor.search.pattern.count, editor.search.ignore_case);
+    if (at == SEARCH_NOT_FOUND) return false;
+    *col = from+at;
+    *len = editor.search.pattern.count;
+    return true;
+}
+
+/* Last match in row y beginning before column limit */
+bool search_find_last_in_row(size_t y, size_t limit, size_t *col, size_t *len)
+{
+    bool found = false;
+    size_t from = 0, c, l;
+    while (from < limit && search_find_in_row(y, from, &c, &l) && c < limit) {
+        *col = c;
+        *len = l;
+        found = true;
+        from = c+1;
+    }
+    return found;
+}
+
+void search_found(size_t y, size_t x, size_t len)
+{
+    Search *s = &editor.search;
+    s->is_scanning = false;
+    s->has_match = true;
+    s->match = (Cursor){ .x = x, .y = y };
+    s->match_len = len;
+    editor.cursor = s->match;
+    if (!viewport_contains(y)) viewport_center_on(y);
+    if (s->wrapped && !editor.in_cmd) write_message("Search wrapped around");
+}
+
+/* Scans rows until a match is found or the deadline is passed, in which case the
+ * main loop resumes the scan at the next iteration so typing never waits for it. */
+void search_scan(uint64_t deadline)
+{
+    Search *s = &editor.search;
+    size_t scanned = 0;
+    while (s->is_scanning) {
+        if (s->rows_left == 0) {
+            s->is_scanning = false;
+            if (!editor.in_cmd) write_message("Pattern not found: "S_FMT, S_ARG(s->pattern));
+            break;
+        }
+
+        size_t y = s->next_row;
+        size_t col, len;
+        bool found = s->backwards
+            ? search_find_last_in_row(y, s->is_first_row ? s->start.x : SIZE_MAX, &col, &len)
+            : search_find_in_row(y, s->is_first_row ? s->start.x : 0, &col, &len);
+        s->is_first_row = false;
+        s->rows_left--;
+        if (found) {
+            search_found(y, col, len);
+            break;
+        }
+
+        if (s->backwards) {
+            if (y == 0) s->wrapped = true;
+            s->next_row = y == 0 ? editor.rows.count-1 : y-1;
+        } else {
+            if (y+1 == editor.rows.count) s->wrapped = true;
+            s->next_row = y+1 == editor.rows.count ? 0 : y+1;
+        }
+
+        scanned += ROW(y)->content.count+1;
+        if (scanned >= SEARCH_CLOCK_CHECK_BYTES) {
+            scanned = 0;
+            if (monotonic_ns() >= deadline) break;
+        }
+    }
+}
+
+/* Forward scans accept matches starting at from, backward ones only before it.
+ * NOTE: the first row is visited twice, the second time for the part skipped at the beginning. */
+void search_start_scan(Cursor from, bool backwards)
+{
+    Search *s = &editor.search;
+    s->has_match = false;
+    s->is_scanning = s->pattern.count > 0 && !s->is_invalid && editor.rows.count > 0;
+    if (!s->is_scanning) return;
+
+    if (from.y >= editor.rows.count) from = (Cursor){ .x = backwards ? SIZE_MAX : 0, .y = backwards ? editor.rows.count-1 : 0 };
+    s->backwards = backwards;
+    s->start = from;
+    s->next_row = from.y;
+    s->is_first_row = true;
+    s->wrapped = false;
+    s->rows_left = editor.rows.count+1;
+
+    // NOTE: the scan starts from the cursor, so the rows on screen are the first to be looked at
+    search_scan(monotonic_ns() + SEARCH_TIME_SLICE_NS);
+}
+
+/* NOTE: smart case, patterns are case sensitive only if they have uppercase letters */
+bool pattern_ignores_case(const char *pattern, size_t n, bool is_regex)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (is_regex && pattern[i] == '\\') i++; // NOTE: `\W` and friends are not letters
+        else if (isupper((unsigned char)pattern[i])) return false;
+    }
+    return true;
+}
+
+void search_set_pattern(const char *pattern, size_t n, bool is_regex)
+{
+    mem_scope(MEM_SEARCH);
+    Search *s = &editor.search;
+    if (s->is_regex && !s->is_invalid && s->pattern.count > 0) { // NOTE: empty patterns are never compiled
+        regex_matcher_free(&s->matcher);
+        regex_free(&s->regex);
+    }
+    s_clear(&s->pattern);
+    if (n > 0) s_push_str(&s->pattern, pattern, n);
+    s->is_regex = is_regex;
+    s->is_invalid = false;
+    s->ignore_case = pattern_ignores_case(pattern, n, is_regex);
+
+    if (is_regex && n > 0) {
+        if (regex_compile(&s->regex, pattern, n, s->ignore_case, &s->error)) regex_matcher_init(&s->matcher, &s->regex);
+        else s->is_invalid = true;
+    }
+    match_index_reset();
+}
+
+void search_open_prompt(bool is_regex)
+{
+    if (editor.in_cmd) return;
+    editor.in_cmd = true;
+    editor.prompt = PROMPT_SEARCH;
+    search_set_pattern(NULL, 0, is_regex);
+    editor.search.origin = editor.cursor;
+    editor.search.origin_offset = editor.offset;
+    editor.search.is_scanning = false;
+    editor.search.has_match = false;
+}
+
+void search_close_prompt(void)
+{
+    editor.in_cmd = false;
+    editor.prompt = PROMPT_COMMAND;
+    s_clear(&editor.cmd);
+    editor.cmd_pos = 0;
+}
+
+/* Restarts the search from where the prompt was opened every time the pattern changes */
+void search_sync_with_prompt(void)
+{
+    Search *s = &editor.search;
+    if (s->pattern.count == editor.cmd.count
+        && (s->pattern.count == 0 || memcmp(s->pattern.items, editor.cmd.items, s->pattern.count) == 0)) return;
+
+    search_set_pattern(editor.cmd.items, editor.cmd.count, s->is_regex);
+    editor.cursor = s->origin;
+    editor.offset = s->origin_offset;
+    search_start_scan(s->origin, false);
+}
+
+void search_accept(void)
+{
+    search_close_prompt();
+    Search *s = &editor.search;
+    if (s->is_invalid) write_message("ERROR: invalid pattern: "S_FMT, S_ARG(s->error));
+    else if (s->pattern.count > 0 && !s->has_match && !s->is_scanning)
+        write_message("Pattern not found: "S_FMT, S_ARG(s->pattern));
+}
+
+void search_cancel(void)
+{
+    search_close_prompt();
+    Search *s = &editor.search;
+    search_set_pattern(NULL, 0, false);
+    s->is_scanning = false;
+    s->has_match = false;
+    editor.cursor = s->origin;
+    editor.offset = s->origin_offset;
+}
+
+void search_next(bool backwards)
+{
+    if (editor.search.pattern.count == 0 || editor.search.is_invalid) {
+        if (!editor.in_cmd) write_message("No previous search pattern");
+        return;
+    }
+    if (!editor.search.index.is_enabled) match_index_reset();
+    Cursor from = editor.cursor;
+    if (!backwards) from.x++;
+    search_start_scan(from, backwards);
+}
+
+/// END Search
+
+/// BEGIN History
+
+/* NOTE: the commands run from the command line, one per line in an append-only file that every session
+ *       maps on startup. A command run again is moved to the end, only the last HISTORY_CAPACITY distinct
+ *       ones are kept, and the file is rewritten when most of its lines are stale.
+ *       CTRL-R in the command line searches it backwards, through an index of the trigrams of every entry. */
+
+#define HISTORY_PATH         ".config/editor/history"
+#define HISTORY_CAPACITY     10000
+#define HISTORY_NO_ENTRY     SIZE_MAX
+
+typedef struct
+{
+    const char *text; // NOTE: in the mapping of the file or allocated by this session, not null terminated
+    size_t len;
+    uint64_t hash;
+    bool is_dead;     // NOTE: run again later or dropped for the capacity
+} HistoryEntry;
+
+typedef struct
+{
+    HistoryEntry *items;
+    size_t count;
+    size_t capacity;
+} HistoryEntries;
+
+typedef struct
+{
+    uint32_t *items; // NOTE: ascending entry indices
+    size_t count;
+    size_t capacity;
+    uint32_t trigram; // NOTE: 0 for an empty slot, so the trigrams are stored +1
+} HistoryPosting;
+
+static struct {
+    HistoryEntries entries; // NOTE: oldest first
+    size_t live;
+    size_t oldest;          // NOTE: no live entry before this one
+    size_t *by_hash;        // NOTE: open addressing, entry index of the last entry with that text
+    size_t by_hash_capacity;
+    size_t by_hash_used;
+    HistoryPosting *postings;
+    size_t postings_capacity;
+    size_t postings_used;
+    size_t indexed;         // NOTE: entries already in the postings, the rest are added by the next search
+    const char *mapping;
+    size_t mapping_len;
+    int fd;                 // NOTE: -1 when nothing is persisted, e.g. in headless mode
+    size_t browsed;         // NOTE: entry shown by ALT-p/ALT-n
+    size_t found;           // NOTE: entry matched by CTRL-R
+    String saved_cmd;       // NOTE: command line before CTRL-R, back with ESC
+} history = { .fd = -1, .browsed = HISTORY_NO_ENTRY, .found = HISTORY_NO_ENTRY };
+
+static void history_by_hash_rebuild(size_t capacity)
+{
+    free(history.by_hash);
+    history.by_hash = malloc(capacity*sizeof(size_t));
+    for (size_t i = 0; i < capacity; i++) history.by_hash[i] = HISTORY_NO_ENTRY;
+    history.by_hash_capacity = capacity;
+    history.by_hash_used = 0;
+    da_enumerate (history.entries, HistoryEntry, i, entry) {
+        if (entry->is_dead) continue;
+        size_t slot = entry->hash & (capacity-1);
+        while (history.by_hash[slot] != HISTORY_NO_ENTRY) slot = (slot+1) & (capacity-1);
+        history.by_hash[slot] = i;
+        history.by_hash_used++;
+    }
+}
+
+/* NOTE: slot of text, or the empty one where it goes. Slots of dropped entries are reused only by the same text */
+static size_t history_by_hash_slot(const char *text, size_t len, uint64_t hash)
+{
+    size_t mask = history.by_hash_capacity-1;
+    size_t slot = hash & mask;
+    for (size_t i; (i = history.by_hash[slot]) != HISTORY_NO_ENTRY; slot = (slot+1) & mask) {
+        HistoryEntry *entry = &history.entries.items[i];
+        if (entry->hash == hash && entry->len == len && memcmp(entry->text, text, len) == 0) break;
+    }
+    return slot;
+}
+
+static void history_drop(size_t i)
+{
+    HistoryEntry *entry = &history.entries.items[i];
+    if (entry->is_dead) return;
+    entry->is_dead = true;
+    history.live--;
+    // NOTE: the text stays, the postings and the hash table still point to the entry
+}
+
+/* Adds text as the newest entry, the previous one with the same text is dropped */
+static void history_add(const char *text, size_t len, bool copy)
+{
+    mem_scope(MEM_HISTORY);
+    if (history.by_hash_used*2 >= history.by_hash_capacity)
+        history_by_hash_rebuild(history.by_hash_capacity ? history.by_hash_capacity*2 : 1024);
+
+    uint64_t hash = hash_bytes(text, len);
+    size_t slot = history_by_hash_slot(text, len, hash);
+    size_t previous = history.by_hash[slot];
+    if (previous != HISTORY_NO_ENTRY) {
+        history_drop(previous);
+        text = history.entries.items[previous].text; // NOTE: no need for another copy
+    } else {
+        history.by_hash_used++;
+        if (copy) text = strndup(text, len);
+    }
+
+    HistoryEntry entry = { .text = text, .len = len, .hash = hash };
+    da_push(&history.entries, entry);
+    history.by_hash[slot] = history.entries.count-1;
+    history.live++;
+
+    for (; history.live > HISTORY_CAPACITY; history.oldest++) history_drop(history.oldest);
+}
+
+/* NOTE: writes the live entries to a new file, the mapping of the old one stays valid */
+static void history_compact(const char *path)
+{
+    String content = {0};
+    da_foreach (history.entries, HistoryEntry, entry) {
+        if (entry->is_dead) continue;
+        s_push_str(&content, entry->text, entry->len);
+        s_push(&content, '\n');
+    }
+    char tmp_path[PATH_MAX+8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    bool ok = fd != -1 && write(fd, content.items, content.count) == (ssize_t)content.count;
+    if (fd != -1) close(fd);
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        log_warning("Could not compact the history %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    s_free(&content);
+    if (ok) {
+        close(history.fd);
+        history.fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+    }
+}
+
+void history_load(void)
+{
+    char *home = getenv("HOME");
+    if (home == NULL) return;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/"HISTORY_PATH, home);
+
+    history.fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+    if (history.fd == -1) {
+        log_warning("Could not open the history %s: %s", path, strerror(errno));
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd != -1) close(fd);
+        return;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return;
+    history.mapping = addr;
+    history.mapping_len = st.st_size;
+
+    size_t lines = 0;
+    for (const char *it = history.mapping, *end = it + history.mapping_len; it < end; lines++) {
+        const char *newline = memchr(it, '\n', end-it);
+        if (newline == NULL) break; // NOTE: a line still being written by another session
+        if (newline > it) history_add(it, newline-it, false);
+        it = newline+1;
+    }
+    if (lines > 2*history.live && lines > HISTORY_CAPACITY/10) history_compact(path);
+}
+
+void history_push(const char *text, size_t len)
+{
+    if (len == 0 || memchr(text, '\n', len)) return;
+    history_add(text, len, true);
+    history.browsed = HISTORY_NO_ENTRY;
+    if (history.fd == -1) return;
+
+    String line = {0};
+    s_push_str(&line, text, len);
+    s_push(&line, '\n');
+    if (write(history.fd, line.items, line.count) != (ssize_t)line.count)
+        log_warning("Could not append to the history: %s", strerror(errno));
+    s_free(&line);
+}
+
+static void history_set_cmd(const HistoryEntry *entry)
+{
+    s_clear(&editor.cmd);
+    if (entry->len > 0) s_push_str(&editor.cmd, entry->text, entry->len);
+    editor.cmd_pos = entry->len;
+}
+
+/* NOTE: direction -1 goes to older commands, +1 to newer ones, past the newest the command line is emptied */
+void history_browse(int direction)
+{
+    size_t i = history.browsed == HISTORY_NO_ENTRY ? history.entries.count : history.browsed;
+    do {
+        if (direction < 0 && i == 0) return;
+        i += direction;
+    } while (i < history.entries.count && history.entries.items[i].is_dead);
+
+    if (i >= history.entries.count) {
+        history.browsed = HISTORY_NO_ENTRY;
+        s_clear(&editor.cmd);
+        editor.cmd_pos = 0;
+        return;
+    }
+    history.browsed = i;
+    history_set_cmd(&history.entries.items[i]);
+}
+
+static inline uint32_t history_trigram(const char *s)
+{
+    return ((uint32_t)(unsigned char)s[0] << 16 | (uint32_t)(unsigned char)s[1] << 8 | (unsigned char)s[2]) + 1;
+}
+
+static HistoryPosting *history_posting(uint32_t trigram, bool create)
+{
+    if (create && history.postings_used*2 >= history.postings_capacity) {
+        HistoryPosting *old = history.postings;
+        size_t old_capacity = history.postings_capacity;
+        history.postings_capacity = old_capacity ? old_capacity*2 : 4096;
+        history.postings = calloc(history.postings_capacity, sizeof(HistoryPosting));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].trigram == 0) continue;
+            size_t slot = (old[i].trigram * 2654435761u) & (history.postings_capacity-1);
+            while (history.postings[slot].trigram != 0) slot = (slot+1) & (history.postings_capacity-1);
+            history.postings[slot] = old[i];
+        }
+        free(old);
+    }
+    if (history.postings_capacity == 0) return NULL;
+
+    size_t mask = history.postings_capacity-1;
+    size_t slot = (trigram * 2654435761u) & mask;
+    while (history.postings[slot].trigram != 0 && history.postings[slot].trigram != trigram) slot = (slot+1) & mask;
+    if (history.postings[slot].trigram == 0) {
+        if (!create) return NULL;
+        history.postings[slot].trigram = trigram;
+        history.postings_used++;
+    }
+    return &history.postings[slot];
+}
+
+static void history_index_pending(void)
+{
+    mem_scope(MEM_HISTORY);
+    for (; history.indexed < history.entries.count; history.indexed++) {
+        HistoryEntry *entry = &history.entries.items[history.indexed];
+        if (entry->is_dead) continue;
+        for (size_t i = 0; i+3 <= entry->len; i++) {
+            HistoryPosting *posting = history_posting(history_trigram(entry->text+i), true);
+            if (posting->count == 0 || posting->items[posting->count-1] != history.indexed)
+                da_push(posting, (uint32_t)history.indexed);
+        }
+    }
+}
+
+static inline bool history_entry_contains(const HistoryEntry *entry, const char *query, size_t len)
+{
+    return !entry->is_dead && find_substring(entry->text, entry->len, query, len, false) != SEARCH_NOT_FOUND;
+}
+
+/* Newest live entry before `before` that contains query, HISTORY_NO_ENTRY if none */
+size_t history_search(const char *query, size_t len, size_t before)
+{
+    if (before > history.entries.count) before = history.entries.count;
+    if (len < 3) {
+        for (size_t i = before; i > 0; i--)
+            if (history_entry_contains(&history.entries.items[i-1], query, len)) return i-1;
+        return HISTORY_NO_ENTRY;
+    }
+
+    // NOTE: the candidates are the entries with the rarest trigram of the query
+    history_index_pending();
+    HistoryPosting *rarest = NULL;
+    for (size_t i = 0; i+3 <= len; i++) {
+        HistoryPosting *posting = history_posting(history_trigram(query+i), false);
+        if (posting == NULL) return HISTORY_NO_ENTRY;
+        if (rarest == NULL || posting->count < rarest->count) rarest = posting;
+    }
+    size_t lo = 0, hi = rarest->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi-lo)/2;
+        if (rarest->items[mid] < before) lo = mid+1;
+        else hi = mid;
+    }
+    for (size_t i = lo; i > 0; i--) {
+        size_t candidate = rarest->items[i-1];
+        if (history_entry_contains(&history.entries.items[candidate], query, len)) return candidate;
+    }
+    return HISTORY_NO_ENTRY;
+}
+
+void history_search_open(void)
+{
+    if (!editor.in_cmd || editor.prompt != PROMPT_COMMAND) return;
+    s_clear(&history.saved_cmd);
+    if (editor.cmd.count > 0) s_push_str(&history.saved_cmd, editor.cmd.items, editor.cmd.count);
+    s_clear(&editor.cmd);
+    editor.cmd_pos = 0;
+    editor.prompt = PROMPT_HISTORY;
+    history.found = HISTORY_NO_ENTRY;
+}
+
+/* NOTE: CTRL-R again looks for an older match of the same query */
+void history_search_older(void)
+{
+    if (history.found == HISTORY_NO_ENTRY) return;
+    size_t older = history_search(editor.cmd.items, editor.cmd.count, history.found);
+    if (older != HISTORY_NO_ENTRY) history.found = older;
+}
+
+/* Called after every key, the match is looked up again from the newest entry when the query changes */
+void history_search_sync_with_prompt(void)
+{
+    static String last_query = {0};
+    if (last_query.count == editor.cmd.count && history.found != HISTORY_NO_ENTRY
+        && (last_query.count == 0 || memcmp(last_query.items, editor.cmd.items, last_query.count) == 0)) return;
+    s_clear(&last_query);
+    if (editor.cmd.count > 0) s_push_str(&last_query, editor.cmd.items, editor.cmd.count);
+    history.found = editor.cmd.count > 0 ? history_search(editor.cmd.items, editor.cmd.count, SIZE_MAX) : HISTORY_NO_ENTRY;
+}
+
+static inline const HistoryEntry *history_found(void)
+{
+    return history.found == HISTORY_NO_ENTRY ? NULL : &history.entries.items[history.found];
+}
+
+/* NOTE: the match goes in the command line, to be edited or run with ENTER */
+void history_search_accept(void)
+{
+    editor.prompt = PROMPT_COMMAND;
+    const HistoryEntry *entry = history_found();
+    if (entry) history_set_cmd(entry);
+    else {
+        s_clear(&editor.cmd);
+        if (history.saved_cmd.count > 0) s_push_str(&editor.cmd, history.saved_cmd.items, history.saved_cmd.count);
+        editor.cmd_pos = editor.cmd.count;
+    }
+}
+
+void history_search_cancel(void)
+{
+    history.found = HISTORY_NO_ENTRY;
+    history_search_accept();
+}
+
+/// END History
 
-    ALT_c,
-    ALT_C,
-    ALT_K,
-    ALT_J,
-    ALT_H,
-    ALT_L,
+/// BEGIN Match index
 
-    ALT_m,
-    ALT_n,
-    ALT_p,
+/* NOTE: the matches of every row are cached for highlighting and for the `n of m` count.
+ *       Edits only invalidate the rows they touch, the rows on screen are rescanned right
+ *       away and the others in the background, a slice of time per frame. */
 
-    CTRL_ALT_C,
-    CTRL_ALT_K,
-    CTRL_ALT_J,
-    CTRL_ALT_H,
-    CTRL_ALT_L,
+#define MATCH_INDEX_SKIP_COST 64 // NOTE: bytes a valid row counts for toward the clock check
 
-    ALT_BACKSPACE,
-    ALT_COLON,
-} Key;
+static inline bool match_index_is_complete(void) { return editor.search.index.valid_rows == editor.search.index.count; }
 
-typedef struct
+static inline bool match_index_row_is_valid(size_t y)
 {
-    WINDOW *win;
-    size_t height;
-    size_t width;
-    size_t start_y;
-    size_t start_x;
-} Window;
+    return editor.search.index.items[y].generation == editor.search.index.generation;
+}
 
-static Window win_main = {0};
-static Window win_line_numbers = {0};
-static Window win_message = {0};
-static Window win_command = {0};
-static Window win_status = {0};
+static void match_index_tree_add(size_t y, size_t count, bool subtract)
+{
+    MatchIndex *index = &editor.search.index;
+    if (index->tree_is_stale) return;
+    for (size_t i = y+1; i <= index->count; i += i & -i) {
+        if (subtract) index->tree[i] -= count;
+        else index->tree[i] += count;
+    }
+}
 
-_Noreturn void print_error_and_exit(const char *fmt, ...)
+static void match_index_tree_rebuild(void)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    clear();
-    printw("ERROR: ");
-    vw_printw(stdscr, fmt, ap);
-    refresh();
-    nodelay(stdscr, FALSE);
-    getch();
-    exit(1);
+    MatchIndex *index = &editor.search.index;
+    index->tree = realloc(index->tree, (index->count+1)*sizeof(size_t));
+    index->tree[0] = 0;
+    for (size_t i = 1; i <= index->count; i++) index->tree[i] = match_index_row_is_valid(i-1) ? index->items[i-1].count : 0;
+    for (size_t i = 1; i <= index->count; i++) {
+        size_t parent = i + (i & -i);
+        if (parent <= index->count) index->tree[parent] += index->tree[i];
+    }
+    index->tree_is_stale = false;
 }
 
-const char *logpath = "./log.txt";
-void log_this(char *format, ...)
+/* Number of matches in the rows before y */
+size_t match_index_prefix(size_t y)
+{
+    MatchIndex *index = &editor.search.index;
+    if (index->tree_is_stale) match_index_tree_rebuild();
+    size_t sum = 0;
+    for (size_t i = y; i > 0; i -= i & -i) sum += index->tree[i];
+    return sum;
+}
+
+static void match_index_invalidate(size_t y)
 {
-    if (!DEBUG) return;
+    MatchIndex *index = &editor.search.index;
+    RowMatches *row = &index->items[y];
+    if (!match_index_row_is_valid(y)) return;
+    match_index_tree_add(y, row->count, true);
+    index->total -= row->count;
+    index->valid_rows--;
+    da_clear(row);
+    row->generation = 0;
+}
+
+void match_index_disable(void)
+{
+    MatchIndex *index = &editor.search.index;
+    da_foreach (*index, RowMatches, row) da_free(row);
+    da_free(index);
+    free(index->tree);
+    *index = (MatchIndex){0};
+}
 
-    FILE *logfile = fopen(logpath, "a");
-    if (logfile == NULL) {
-        print_error_and_exit("Could not open log file at `%s`\n", logpath);
+/* Drops every match, to be called when the pattern or the whole buffer changes.
+ * NOTE: unless the rows changed in number no row is touched, they are just left
+ *       behind by the generation and cleared when scanned again. */
+void match_index_reset(void)
+{
+    mem_scope(MEM_SEARCH);
+    MatchIndex *index = &editor.search.index;
+    Search *s = &editor.search;
+    if (s->pattern.count == 0 || s->is_invalid) {
+        match_index_disable();
+        return;
     }
-    va_list fmt; 
 
-    va_start(fmt, format);
-    vfprintf(logfile, format, fmt);
-    fprintf(logfile, "\n");
+    if (index->count != editor.rows.count) {
+        match_index_disable();
+        index->items = calloc(editor.rows.count, sizeof(RowMatches));
+        index->count = index->capacity = editor.rows.count;
+    }
+    index->is_enabled = true;
+    index->generation++;
+    index->valid_rows = 0;
+    index->total = 0;
+    index->next_row = 0;
+    index->tree_is_stale = true;
+}
 
-    va_end(fmt);
-    fclose(logfile);
+void match_index_rows_changed(size_t y, size_t n)
+{
+    MatchIndex *index = &editor.search.index;
+    if (!index->is_enabled) return;
+    for (size_t i = y; i < y+n && i < index->count; i++) match_index_invalidate(i);
 }
 
-void write_message(const char *fmt, ...)
+void match_index_rows_inserted(size_t at, size_t n)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    char buf[1024] = {0};
-    vsnprintf(buf, win_message.width, fmt, ap);  // TODO: aumentare la dimensione della finestra
-                                                 //       se il messaggio e' lungo o su piu' righe
-    va_end(ap);
+    mem_scope(MEM_SEARCH);
+    MatchIndex *index = &editor.search.index;
+    if (!index->is_enabled || n == 0) return;
+    for (size_t i = 0; i < n; i++) {
+        RowMatches empty = {0};
+        da_push(index, empty);
+    }
+    memmove(&index->items[at+n], &index->items[at], (index->count-n-at)*sizeof(RowMatches));
+    memset(&index->items[at], 0, n*sizeof(RowMatches));
+    index->tree_is_stale = true;
+}
 
-    // maybe I can do some sort of temporary messages
-    // maybe I can display in the status that there is a new message so that they're not invasive (config?)
-    editor.messages.index = editor.messages.count;
-    da_push(&editor.messages, strdup(buf)); // NOTE: rember to free
-    if (!editor.in_cmd) editor.is_showing_message = true;
+void match_index_rows_removed(size_t at, size_t n)
+{
+    MatchIndex *index = &editor.search.index;
+    if (!index->is_enabled || n == 0) return;
+    for (size_t i = at; i < at+n; i++) {
+        match_index_invalidate(i);
+        da_free(&index->items[i]);
+    }
+    memmove(&index->items[at], &index->items[at+n], (index->count-at-n)*sizeof(RowMatches));
+    index->count -= n;
+    index->tree_is_stale = true;
 }
 
-static inline bool editor_is_expanding_snippet(void) { return editor.expanding_snippet.snippet != NULL; }
+static void match_index_scan_row(size_t y)
+{
+    mem_scope(MEM_SEARCH);
+    MatchIndex *index = &editor.search.index;
+    RowMatches *row = &index->items[y];
+    if (match_index_row_is_valid(y)) return;
 
-/// BEGIN Cursors
+    da_clear(row);
+    size_t from = 0, col, len;
+    while (search_find_in_row(y, from, &col, &len)) {
+        RowMatch match = { .col = col, .len = len };
+        da_push(row, match);
+        from = col + (len > 0 ? len : 1);
+    }
+    row->generation = index->generation;
+    index->valid_rows++;
+    index->total += row->count;
+    match_index_tree_add(y, row->count, false);
+}
 
-int compare_cursors_reverse(const void *p1, const void *p2)
+void match_index_update(uint64_t deadline)
 {
-    Cursor *c1 = *(Cursor **)p1;
-    Cursor *c2 = *(Cursor **)p2;
-    if (c1->y != c2->y) return c2->y - c1->y;
-    return c2->x - c1->x;
+    MatchIndex *index = &editor.search.index;
+    if (!index->is_enabled) return;
+    assert(index->count == editor.rows.count);
+
+    for (size_t y = editor.offset; y < editor.offset+viewport_height() && y < index->count; y++)
+        match_index_scan_row(y);
+
+    size_t scanned = 0;
+    while (!match_index_is_complete()) {
+        if (index->next_row >= index->count) index->next_row = 0;
+        size_t y = index->next_row++;
+        if (match_index_row_is_valid(y)) scanned += MATCH_INDEX_SKIP_COST; // NOTE: a lone invalid row can be far away
+        else {
+            match_index_scan_row(y);
+            scanned += ROW(y)->content.count+1;
+        }
+        if (scanned >= SEARCH_CLOCK_CHECK_BYTES) {
+            scanned = 0;
+            if (monotonic_ns() >= deadline) break;
+        }
+    }
 }
 
-void add_multicursor_mark(void)
+/* 1-based position of the current match among all the matches, 0 if unknown */
+size_t match_index_position(void)
 {
-    if (editor.multicursor.is_enabled || editor.in_cmd) return;
+    MatchIndex *index = &editor.search.index;
+    Search *s = &editor.search;
+    if (!index->is_enabled || !s->has_match || !match_index_is_complete()) return 0;
+    RowMatches *row = &index->items[s->match.y];
+    for (size_t i = 0; i < row->count; i++)
+        if (row->items[i].col == s->match.x) return match_index_prefix(s->match.y) + i + 1;
+    return 0;
+}
 
-    da_foreach (editor.multicursor, Cursor, cursor)
-        if (editor.cursor.x == cursor->x && editor.cursor.y == cursor->y)
-            return;
+static inline void search_continue(void)
+{
+    if (editor.search.is_scanning) search_scan(monotonic_ns() + SEARCH_TIME_SLICE_NS);
+    match_index_update(monotonic_ns() + SEARCH_TIME_SLICE_NS);
+}
 
-    da_push(&editor.multicursor, editor.cursor);
-    write_message("Added cursor mark at (%zu, %zu)", editor.cursor.x, editor.cursor.y);
+/// END Match index
+
+/// BEGIN Frame stats
+
+/* Every iteration of the main loop is a frame, the ones with a key are timed phase by phase and the
+ * time from the key being read to the end of doupdate goes in a log-linear (HDR style) histogram. */
+
+#define HISTOGRAM_SUB_BITS 4 // NOTE: 16 buckets per power of two, values are within ~6%
+#define HISTOGRAM_SUBS     (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS  ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUBS)
+
+typedef struct
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+typedef enum { FRAME_READ_KEY, FRAME_PROCESS_KEY, FRAME_UPDATE_WINDOWS, FRAME_DOUPDATE, FRAME_PHASES_COUNT } FramePhase;
+
+static struct
+{
+    /* NOTE: current frame */
+    uint64_t phase_begin_ns;
+    uint64_t phase_ns[FRAME_PHASES_COUNT];
+    bool has_key;
+    uint64_t key_ns;
+    size_t rows_touched;
+    uint64_t bytes_before;
+
+    Histogram key_to_paint;
+    uint64_t keys;
+    uint64_t key_phases_ns[FRAME_PHASES_COUNT]; // NOTE: summed over the frames with a key
+    uint64_t frames;                            // NOTE: only the ones that wrote something to the terminal
+    uint64_t rows_redrawn;
+    uint64_t bytes_written;
+
+    uint64_t fps_window_begin_ns;
+    uint64_t fps_window_frames;
+    double fps;
+} frame_stats = {0};
+
+/* NOTE: ncurses sets the terminal modes and writes through the file descriptor of its output stream, so
+ *       the stream can not be replaced with one that counts. Instead the bytes written by the main thread
+ *       are read from the kernel I/O accounting, and during doupdate all of them go to the terminal.
+ *       Returns 0 when the accounting is not available. */
+static uint64_t main_thread_written_bytes(void)
+{
+    static int fd = -2;
+    if (fd == -2) fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    char buf[256];
+    ssize_t n = pread(fd, buf, sizeof(buf)-1, 0);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    const char *wchar = strstr(buf, "wchar: ");
+    return wchar ? strtoull(wchar + strlen("wchar: "), NULL, 10) : 0;
 }
 
-void sort_multicursor(void)
+static size_t histogram_bucket(uint64_t value)
 {
-    da_clear(&editor.sorted_multicursor);
-    da_push(&editor.sorted_multicursor, &editor.cursor);
-    
-    da_foreach (editor.multicursor, Cursor, cursor)
-        if (editor.cursor.x != cursor->x || editor.cursor.y != cursor->y)
-            da_push(&editor.sorted_multicursor, cursor);
+    if (value < HISTOGRAM_SUBS) return value;
+    int exponent = 63 - __builtin_clzll(value);
+    return (exponent - HISTOGRAM_SUB_BITS + 1)*HISTOGRAM_SUBS + ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUBS-1));
+}
 
-    qsort(editor.sorted_multicursor.items, editor.sorted_multicursor.count, sizeof(Cursor*), compare_cursors_reverse);
+/* NOTE: middle of the range of values of the bucket */
+static uint64_t histogram_bucket_value(size_t bucket)
+{
+    if (bucket < HISTOGRAM_SUBS) return bucket;
+    int shift = bucket/HISTOGRAM_SUBS - 1;
+    uint64_t lowest = (uint64_t)(HISTOGRAM_SUBS + bucket%HISTOGRAM_SUBS) << shift;
+    return lowest + ((1ull << shift) >> 1);
 }
 
-void enable_multicursor(void)
+void histogram_add(Histogram *h, uint64_t value)
 {
-    if (editor.multicursor.is_enabled || editor.in_cmd) return;
+    h->counts[histogram_bucket(value)]++;
+    h->total++;
+    if (value > h->max) h->max = value;
+}
 
-    if (!da_is_empty(&editor.multicursor)) {
-        sort_multicursor();
-        editor.multicursor.is_enabled = true;
-        //write_message("Multicursor has been enabled");
-    } //else write_message("No marks to enable multicursor");
+uint64_t histogram_percentile(const Histogram *h, double percentile)
+{
+    if (h->total == 0) return 0;
+    uint64_t rank = ceil(percentile/100 * h->total);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
 }
 
-void disable_multicursor(void)
+void frame_stats_begin(void)
 {
-    if (!editor.multicursor.is_enabled || editor.in_cmd) return;
+    frame_stats.phase_begin_ns = monotonic_ns();
+    memset(frame_stats.phase_ns, 0, sizeof(frame_stats.phase_ns));
+    frame_stats.has_key = false;
+}
 
-    da_clear(&editor.multicursor);
-    editor.multicursor.is_enabled = false;
+/* NOTE: called by process_pressed_key when read_key returned a key */
+void frame_stats_key_read(void)
+{
+    frame_stats.has_key = true;
+    frame_stats.key_ns = monotonic_ns();
+    frame_stats.phase_ns[FRAME_READ_KEY] = frame_stats.key_ns - frame_stats.phase_begin_ns;
+    frame_stats.phase_begin_ns = frame_stats.key_ns;
+}
 
-    if (editor_is_expanding_snippet()) editor.expanding_snippet.snippet = NULL;
-    //else write_message("Multicursor has been disabled and all marks have been cleared");
+/* NOTE: the end of FRAME_UPDATE_WINDOWS is also where the rows doupdate is going to repaint are counted */
+void frame_stats_phase(FramePhase phase)
+{
+    uint64_t now = monotonic_ns();
+    frame_stats.phase_ns[phase] = now - frame_stats.phase_begin_ns;
+    frame_stats.phase_begin_ns = now;
+    if (phase == FRAME_UPDATE_WINDOWS) {
+        frame_stats.rows_touched = 0;
+        for (int y = 0; y < LINES; y++) frame_stats.rows_touched += is_linetouched(newscr, y);
+        frame_stats.bytes_before = main_thread_written_bytes();
+    }
 }
 
-/// END Cursors
+void frame_stats_end(void)
+{
+    frame_stats_phase(FRAME_DOUPDATE);
+    uint64_t now = frame_stats.phase_begin_ns;
+    uint64_t bytes = main_thread_written_bytes() - frame_stats.bytes_before;
+
+    if (bytes > 0) {
+        frame_stats.frames++;
+        frame_stats.fps_window_frames++;
+        frame_stats.rows_redrawn += frame_stats.rows_touched;
+        frame_stats.bytes_written += bytes;
+    }
+    if (frame_stats.has_key) {
+        histogram_add(&frame_stats.key_to_paint, now - frame_stats.key_ns);
+        frame_stats.keys++;
+        for (size_t i = 0; i < FRAME_PHASES_COUNT; i++) frame_stats.key_phases_ns[i] += frame_stats.phase_ns[i];
+    }
+    if (now - frame_stats.fps_window_begin_ns >= 1000000000) {
+        if (frame_stats.fps_window_begin_ns > 0)
+            frame_stats.fps = frame_stats.fps_window_frames*1e9 / (now - frame_stats.fps_window_begin_ns);
+        frame_stats.fps_window_begin_ns = now;
+        frame_stats.fps_window_frames = 0;
+    }
+}
+
+/* NOTE: only the totals, the current frame goes on being measured */
+void frame_stats_reset(void)
+{
+    memset(&frame_stats.key_to_paint, 0, sizeof(frame_stats.key_to_paint));
+    memset(frame_stats.key_phases_ns, 0, sizeof(frame_stats.key_phases_ns));
+    frame_stats.keys = 0;
+    frame_stats.frames = 0;
+    frame_stats.rows_redrawn = 0;
+    frame_stats.bytes_written = 0;
+}
+
+/// END Frame stats
 
 /// BEGIN Commands
 
@@ -432,6 +3009,11 @@ typedef enum
     BUILTIN_INSERT,
     BUILTIN_DATE,
     BUILTIN_GOTO_LINE,
+    BUILTIN_MOVE_LINES,
+    BUILTIN_REPLACE,
+    BUILTIN_REPLACE_REGEX,
+    BUILTIN_STATS,
+    BUILTIN_MEM,
     BUILTIN_CMDS_COUNT,
     UNKNOWN,
     ERROR,
@@ -439,7 +3021,7 @@ typedef enum
     USER_DEFINED,
 } CommandType;
 
-static_assert(BUILTIN_CMDS_COUNT == 14, "Associate a name to all builtin commands");
+static_assert(BUILTIN_CMDS_COUNT == 19, "Associate a name to all builtin commands");
 /* NOTE: name of the builtin commands */
 #define SAVE              "s"
 #define QUIT              "q"
@@ -455,6 +3037,11 @@ static_assert(BUILTIN_CMDS_COUNT == 14, "Associate a name to all builtin command
 #define INSERT            "ins"
 #define DATE              "date"
 #define GOTO_LINE         "goto"
+#define MOVE_LINES        "mvls"
+#define REPLACE           "rep"
+#define REPLACE_REGEX     "repx"
+#define STATS             "stats"
+#define MEM               "mem"
 
 typedef struct
 {
@@ -498,6 +3085,17 @@ void add_command_arg_uint(CommandArgs *args, char *name, size_t value)
     da_push(args, arg);
 }
 
+void add_command_arg_placeholder(CommandArgs *args, char *name, size_t index)
+{
+    CommandArg arg = {
+        .type = PISQUY_ARG_PLACEHOLDER,
+        .name = strdup(name),
+        .placeholder_index = index,
+        .index = args->count
+    };
+    da_push(args, arg);
+}
+
 void add_command_arg_string(CommandArgs *args, char *name, char *value)
 {
     CommandArg arg = {
@@ -536,6 +3134,25 @@ typedef struct
 
 typedef void (*CommandFn)(Command *cmd, CommandArgs *args);
 
+/* User defined commands are compiled once into a flat list of calls, run by vm_run */
+typedef struct
+{
+    CommandType type;
+    CommandFn execute;  // NOTE: resolved builtin, NULL if the call is to a user defined command
+    Command *cmd;       // NOTE: the subcommand, builtins take their name and multiplicity from it
+    size_t n;
+    CommandArg *args;   // NOTE: baked arguments, the $n placeholders are taken from the arguments of the caller
+    size_t args_count;
+    bool forwards_args; // NOTE: nothing baked, the arguments of the caller are passed as they are
+} Instruction;
+
+typedef struct
+{
+    Instruction *items;
+    size_t count;
+    size_t capacity;
+} Instructions;
+
 struct Command
 {
     char *name;
@@ -544,6 +3161,7 @@ struct Command
     Commands subcmds;
     size_t n;
     CommandFn execute;
+    Instructions code;
 };
 
 static Commands commands = {0}; // NOTE: all commands are stored in here
@@ -555,74 +3173,111 @@ bool is_command_type_user_defined(CommandType type)
     return type >= USER_DEFINED && type < USER_DEFINED + USER_CMDS_COUNT;
 }
 
-bool cs_is_empty(CyclableStrings cs) { return cs.count == 0; }
-
-char *cs_get_current(CyclableStrings cs)
+bool expect_n_arguments(Command *cmd, CommandArgs *args, size_t n)
 {
-    return cs_is_empty(cs) ? NULL : cs.items[cs.index];
+    if (args->count == n) return true;
+
+    write_message("ERROR: command `%s` expects %zu argument%s, but got %zu",
+            cmd->name, n, n == 1 ? "" : "s", args->count);
+    return false;
 }
 
-void cs_push(CyclableStrings *cs, char *s) { da_push(cs, strdup(s)); }
+/* Names are looked up in two hash tables: the builtins get a perfect hash, whose seed is
+ * searched once the builtins are registered, so a lookup is one hash and one comparison.
+ * User defined commands go in an open addressing table filled while parsing the config. */
 
-char *cs_previous(CyclableStrings *cs)
+#define BUILTIN_HASH_SLOTS 64
+static_assert(BUILTIN_CMDS_COUNT <= BUILTIN_HASH_SLOTS/2, "Grow BUILTIN_HASH_SLOTS");
+
+static struct {
+    uint32_t seed;
+    int slots[BUILTIN_HASH_SLOTS]; // NOTE: builtin command type + 1, 0 if empty
+} builtins_table = {0};
+
+typedef struct
 {
-    if (da_is_empty(cs)) return NULL;
-    if (cs->index > 0) cs->index--; 
-    //else cs->index = cs->count-1; // TODO: make it a config?
-    return cs->items[cs->index];
+    int *slots; // NOTE: index in commands + 1, 0 if empty
+    size_t count;
+    size_t capacity;
+} CommandsTable;
 
-    //size_t len = strlen(cmd);
-    //s_clear(&editor.cmd);
-    //s_push_str(&editor.cmd, cmd, len);
-    //editor.cmd_pos = len;
-}
+static CommandsTable user_commands_table = {0};
 
-char *cs_next(CyclableStrings *cs)
+static inline uint32_t command_name_hash(const char *name, uint32_t seed)
 {
-    if (da_is_empty(cs)) return NULL;
-    if (cs->index < cs->count-1) cs->index++;
-    //else cs->index = 0; // TODO: make it a config?
-    return cs->items[cs->index];
+    uint32_t hash = 2166136261u ^ seed; // NOTE: FNV-1a
+    for (; *name; name++) hash = (hash ^ (unsigned char)*name) * 16777619u;
+    /* NOTE: the tables use the low bits, which in FNV-1a only depend on the low bits of the seed and of the bytes */
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    return hash;
+}
 
-    //size_t len = strlen(cmd);
-    //s_clear(&editor.cmd);
-    //s_push_str(&editor.cmd, cmd, len);
-    //editor.cmd_pos = len;
+void builtins_table_build(void)
+{
+    for (uint32_t seed = 0;; seed++) {
+        memset(builtins_table.slots, 0, sizeof(builtins_table.slots));
+        bool is_perfect = true;
+        for (int type = 0; type < BUILTIN_CMDS_COUNT && is_perfect; type++) {
+            size_t slot = command_name_hash(commands.items[type].name, seed) % BUILTIN_HASH_SLOTS;
+            if (builtins_table.slots[slot]) is_perfect = false;
+            else builtins_table.slots[slot] = type+1;
+        }
+        if (is_perfect) {
+            builtins_table.seed = seed;
+            return;
+        }
+    }
 }
 
-bool expect_n_arguments(Command *cmd, CommandArgs *args, size_t n)
+static void user_commands_table_put(CommandsTable *table, const char *name, int index)
 {
-    if (args->count == n) return true;
+    size_t mask = table->capacity-1;
+    for (size_t slot = command_name_hash(name, 0) & mask;; slot = (slot+1) & mask) {
+        if (table->slots[slot] == 0) {
+            table->slots[slot] = index+1;
+            table->count++;
+            return;
+        }
+    }
+}
 
-    write_message("ERROR: command `%s` expects %zu argument%s, but got %zu",
-            cmd->name, n, n == 1 ? "" : "s", args->count);
-    return false;
+void user_commands_table_add(const char *name, int index)
+{
+    CommandsTable *table = &user_commands_table;
+    if (2*(table->count+1) > table->capacity) { // NOTE: load factor <= 0.5
+        int *old = table->slots;
+        size_t old_capacity = table->capacity;
+        table->capacity = old_capacity ? old_capacity*2 : 16;
+        table->slots = calloc(table->capacity, sizeof(int));
+        table->count = 0;
+        for (size_t i = 0; i < old_capacity; i++)
+            if (old[i]) user_commands_table_put(table, commands.items[old[i]-1].name, old[i]-1);
+        free(old);
+    }
+    user_commands_table_put(table, name, index);
+}
+
+void user_commands_table_clear(void)
+{
+    free(user_commands_table.slots);
+    user_commands_table = (CommandsTable){0};
 }
 
-static_assert(BUILTIN_CMDS_COUNT == 14, "Parse all commands in get_command_type_from_string");
 CommandType get_command_type_from_string(char *type)
 {
-    if      (streq(type, SAVE))              return BUILTIN_SAVE;
-    else if (streq(type, QUIT))              return BUILTIN_QUIT;
-    else if (streq(type, SAVE_AND_QUIT))     return BUILTIN_SAVE_AND_QUIT;
-    else if (streq(type, FORCE_QUIT))        return BUILTIN_FORCE_QUIT;
-    else if (streq(type, MOVE_CURSOR))       return BUILTIN_MOVE_CURSOR;
-    else if (streq(type, MOVE_CURSOR_UP))    return BUILTIN_MOVE_CURSOR_UP;
-    else if (streq(type, MOVE_CURSOR_DOWN))  return BUILTIN_MOVE_CURSOR_DOWN;
-    else if (streq(type, MOVE_CURSOR_LEFT))  return BUILTIN_MOVE_CURSOR_LEFT;
-    else if (streq(type, MOVE_CURSOR_RIGHT)) return BUILTIN_MOVE_CURSOR_RIGHT;
-    else if (streq(type, MOVE_LINE_UP))      return BUILTIN_MOVE_LINE_UP;
-    else if (streq(type, MOVE_LINE_DOWN))    return BUILTIN_MOVE_LINE_DOWN;
-    else if (streq(type, INSERT))            return BUILTIN_INSERT;
-    else if (streq(type, DATE))              return BUILTIN_DATE;
-    else if (streq(type, GOTO_LINE))         return BUILTIN_GOTO_LINE;
-    else {
-        for (size_t i = USER_DEFINED; i < commands.count; i++) {
-            if (streq(type, commands.items[i].name))
-                return i;
-        }
-        return UNKNOWN;
+    int builtin = builtins_table.slots[command_name_hash(type, builtins_table.seed) % BUILTIN_HASH_SLOTS];
+    if (builtin && streq(type, commands.items[builtin-1].name)) return builtin-1;
+
+    CommandsTable *table = &user_commands_table;
+    if (table->capacity == 0) return UNKNOWN;
+    size_t mask = table->capacity-1;
+    for (size_t slot = command_name_hash(type, 0) & mask; table->slots[slot]; slot = (slot+1) & mask) {
+        Command *command = &commands.items[table->slots[slot]-1];
+        if (streq(type, command->name)) return command->type;
     }
+    return UNKNOWN;
 }
 
 int get_command_index(CommandType type)
@@ -639,7 +3294,7 @@ Command *get_command(CommandType type)
     return &commands.items[index];
 }
 
-static_assert(BUILTIN_CMDS_COUNT == 14, "get_command_type_as_cstr");
+static_assert(BUILTIN_CMDS_COUNT == 19, "get_command_type_as_cstr");
 char *get_command_type_as_cstr(CommandType type)
 {
     switch (type)
@@ -658,6 +3313,11 @@ char *get_command_type_as_cstr(CommandType type)
         case BUILTIN_INSERT:            return INSERT;
         case BUILTIN_DATE:              return DATE;
         case BUILTIN_GOTO_LINE:         return GOTO_LINE;
+        case BUILTIN_MOVE_LINES:        return MOVE_LINES;
+        case BUILTIN_REPLACE:           return REPLACE;
+        case BUILTIN_REPLACE_REGEX:     return REPLACE_REGEX;
+        case BUILTIN_STATS:             return STATS;
+        case BUILTIN_MEM:               return MEM;
         case UNKNOWN:                   return "unknown";
 
         case BUILTIN_CMDS_COUNT:
@@ -680,10 +3340,35 @@ void add_builtin_command(char *name, CommandType type, CommandFn execute, Comman
     da_push(&commands, cmd);
 }
 
+void compile_command(Command *cmd, Instructions *code)
+{
+    da_foreach (cmd->subcmds, Command, subcmd) {
+        Instruction instruction = {
+            .type = subcmd->type,
+            .cmd = subcmd,
+            .n = subcmd->n,
+            .args = subcmd->baked_args.items,
+            .args_count = subcmd->baked_args.count,
+        };
+        if (is_command_type_builtin(subcmd->type)) {
+            Command *builtin = &commands.items[subcmd->type];
+            instruction.execute = builtin->execute;
+            if (instruction.args_count == 0) {
+                instruction.args = builtin->baked_args.items;
+                instruction.args_count = builtin->baked_args.count;
+            }
+        }
+        instruction.forwards_args = instruction.args_count == 0;
+        da_push(code, instruction);
+    }
+}
+
 void add_user_defined_command(Command cmd)
 {
     cmd.type = USER_DEFINED + commands.count - BUILTIN_CMDS_COUNT;
+    compile_command(&cmd, &cmd.code);
     da_push(&commands, cmd);
+    user_commands_table_add(cmd.name, commands.count-1);
 }
 
 void free_command_arg(CommandArg *arg)
@@ -708,6 +3393,7 @@ void free_command(Command *cmd)
         free_command_args(&cmd->baked_args);
     if (cmd->subcmds.count > 0)
         free_commands(&cmd->subcmds);
+    da_free(&cmd->code);
 }
 
 void free_commands(Commands *cmds)
@@ -755,6 +3441,67 @@ void trim(char **str)
     ARG_LIST -> ARG ARG_LIST | epsilon
 */
 
+/* Bump allocator made of chunks that are kept when it is reset */
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk
+{
+    ArenaChunk *next;
+    size_t count;
+    size_t capacity;
+    char data[];
+};
+
+typedef struct
+{
+    ArenaChunk *first;
+    ArenaChunk *current;
+} Arena;
+
+#define ARENA_CHUNK_SIZE (16*1024)
+
+char *arena_alloc(Arena *arena, size_t n)
+{
+    ArenaChunk *chunk = arena->current;
+    while (chunk && chunk->count + n > chunk->capacity) chunk = chunk->next;
+    if (!chunk) {
+        size_t capacity = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(ArenaChunk) + capacity);
+        chunk->count = 0;
+        chunk->capacity = capacity;
+        chunk->next = arena->first;
+        arena->first = chunk;
+    }
+    arena->current = chunk;
+    char *result = chunk->data + chunk->count;
+    chunk->count += n;
+    return result;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t n)
+{
+    char *result = arena_alloc(arena, n+1);
+    memcpy(result, s, n);
+    result[n] = '\0';
+    return result;
+}
+
+void arena_reset(Arena *arena)
+{
+    for (ArenaChunk *chunk = arena->first; chunk; chunk = chunk->next) chunk->count = 0;
+    arena->current = arena->first;
+}
+
+void arena_free(Arena *arena)
+{
+    ArenaChunk *chunk = arena->first;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    *arena = (Arena){0};
+}
+
 char *read_file(char *path)
 {
     FILE *f = fopen(path, "rb");
@@ -794,8 +3541,10 @@ typedef struct
     TokenType type;
     union {
         int number_value;
-        char *string_value;
+        char *string_value; // NOTE: interned identifier or string in the arena of the tokens, never freed alone
     };
+    size_t offset; // NOTE: the token is source[offset, offset+len)
+    size_t len;
     Location loc;
 } Token;
 
@@ -859,7 +3608,7 @@ char *token_type_and_value_as_string(Token token)
             case TOKEN_NUMBER: sprintf(result, "%s `%d`", type, token.number_value); break;
             case TOKEN_STRING: {
                 snprintf(result, n-1, "%s \"%s\"", type, token.string_value);
-                result[n] = '\0';
+                result[n-1] = '\0';
             } break;
 
             case TOKEN_TRUE:
@@ -882,7 +3631,7 @@ char *token_type_and_value_as_string(Token token)
 void token_log(Token token)
 {
     char *string = token_type_and_value_as_string(token);
-    log_this(LOC_FMT" %s", LOC_ARG(token.loc), string);
+    log_debug(LOC_FMT" %s", LOC_ARG(token.loc), string);
     free(string);
 }
 
@@ -939,11 +3688,24 @@ bool expect_token_to_be_of_types_extra_newline(Token t, TokenType *types, size_t
     return false;
 }
 
+typedef struct
+{
+    char **slots; // NOTE: strings in the arena, NULL if empty
+    size_t count;
+    size_t capacity;
+} Interner;
+
 typedef struct
 {
     Token *items;
     size_t count;
     size_t capacity;
+
+    char *source;     // NOTE: the tokens are views into it
+    bool owns_source;
+    char *path;       // NOTE: the path in the location of every token
+    Arena arena;      // NOTE: the identifiers, interned, and the strings
+    Interner identifiers;
 } Tokens;
 
 typedef struct
@@ -951,23 +3713,51 @@ typedef struct
     char *str;
     Location loc;
     Token token;
+    Tokens *tokens;
 } Lexer;
 
-Lexer lexer_create_from_path(char *path)
+static inline uint32_t intern_hash(const char *s, size_t n)
 {
-    Lexer l = {0};
-    l.loc.path = path;
-    l.str = read_file(path);
-    return l;
+    uint32_t hash = 2166136261u; // NOTE: FNV-1a
+    for (size_t i = 0; i < n; i++) hash = (hash ^ (unsigned char)s[i]) * 16777619u;
+    return hash;
 }
 
-Lexer lexer_create_from_string(char *string)
+static void interner_put(Interner *interner, char *interned, uint32_t hash)
 {
-    Lexer l = {0};
-    l.str = string;
-    return l;
+    size_t mask = interner->capacity-1;
+    size_t slot = hash & mask;
+    while (interner->slots[slot]) slot = (slot+1) & mask;
+    interner->slots[slot] = interned;
+    interner->count++;
 }
 
+/* The same identifier is always the same pointer */
+char *intern(Tokens *tokens, const char *s, size_t n)
+{
+    Interner *interner = &tokens->identifiers;
+    uint32_t hash = intern_hash(s, n);
+    if (interner->capacity > 0) {
+        size_t mask = interner->capacity-1;
+        for (size_t slot = hash & mask; interner->slots[slot]; slot = (slot+1) & mask) {
+            char *it = interner->slots[slot];
+            if (strncmp(it, s, n) == 0 && it[n] == '\0') return it;
+        }
+    }
+    if (2*(interner->count+1) > interner->capacity) { // NOTE: load factor <= 0.5
+        char **old = interner->slots;
+        size_t old_capacity = interner->capacity;
+        interner->capacity = old_capacity ? old_capacity*2 : 64;
+        interner->slots = calloc(interner->capacity, sizeof(char *));
+        interner->count = 0;
+        for (size_t i = 0; i < old_capacity; i++)
+            if (old[i]) interner_put(interner, old[i], intern_hash(old[i], strlen(old[i])));
+        free(old);
+    }
+    char *interned = arena_strndup(&tokens->arena, s, n);
+    interner_put(interner, interned, hash);
+    return interned;
+}
 
 void lexer_trim_left(Lexer *l)
 {
@@ -995,9 +3785,12 @@ bool lexer_get_string(Lexer *l)
     char *end = strchr(begin, '"');
     if (end == NULL) return false;
     ptrdiff_t len = end - begin;
-    l->token.string_value = malloc(sizeof(char)*len + 1);
-    strncpy(l->token.string_value, begin, len);
-    l->token.string_value[len] = '\0';
+    /* NOTE: copied, the values are used as C strings and the source can not get a '\0' at the closing
+     *       quote, it is hashed as a whole for the config cache after lexing. Not interned, strings are
+     *       rarely repeated and the snippet bodies would only bloat the table. */
+    l->token.string_value = arena_strndup(&l->tokens->arena, begin, len);
+    l->token.offset = begin - l->tokens->source;
+    l->token.len = len;
     l->str = end+1;
     l->loc.col += len;
     return true;
@@ -1014,6 +3807,8 @@ bool lexer_next(Lexer *l)
     if (c == '\0') return false;
 
     l->token.loc = l->loc;
+    l->token.offset = l->str - l->tokens->source;
+    l->token.len = 1;
 
     if (c == '\n') {
         l->token.type = TOKEN_NEWLINE;
@@ -1041,6 +3836,7 @@ bool lexer_next(Lexer *l)
             c = *l->str;
         }
         l->loc.col += len;
+        l->token.len = len;
         if      (strneq(begin, TOKEN_SET_STRING,     len)) l->token.type = TOKEN_SET;
         else if (strneq(begin, TOKEN_VAR_STRING,     len)) l->token.type = TOKEN_VAR;
         else if (strneq(begin, TOKEN_DEF_STRING,     len)) l->token.type = TOKEN_DEF;
@@ -1049,14 +3845,13 @@ bool lexer_next(Lexer *l)
         else if (strneq(begin, TOKEN_FALSE_STRING,   len)) l->token.type = TOKEN_FALSE;
         else {
             l->token.type = TOKEN_IDENT;
-            l->token.string_value = malloc(sizeof(char)*len + 1);
-            strncpy(l->token.string_value, begin, len);
-            l->token.string_value[len] = '\0';
+            l->token.string_value = intern(l->tokens, begin, len);
         }
     } else if (isdigit(c) || c == '-') {
         char *end;
         long n = strtol(l->str, &end, 10);
         l->token.number_value = n;
+        l->token.len = end - l->str;
         l->loc.col += end - l->str;
         l->str = end;
         l->token.type = TOKEN_NUMBER;
@@ -1064,97 +3859,62 @@ bool lexer_next(Lexer *l)
         lexer_get_string(l);
     } else {
         l->token.type = c;
-        l->str++;
-        l->loc.col++;
-    }
-    return true;
-}
-
-static_assert(ACTUAL_TOKENS_COUNT == 11, "lexer_get_current_token");
-Token lexer_get_current_token(Lexer *l)
-{
-    Token token = l->token;
-    if (l->loc.path) token.loc.path = strdup(l->loc.path);
-
-    if (token.type >= 0 && token.type <= 255) return token;
-
-    switch (token.type)
-    {
-    case TOKEN_NUMBER:
-    case TOKEN_TRUE:
-    case TOKEN_FALSE:
-    case TOKEN_SET:
-    case TOKEN_VAR:
-    case TOKEN_DEF:
-    case TOKEN_SNIPPET:
-    case TOKEN_NEWLINE:
-    case TOKEN_EOF:
-        break;
-
-    case TOKEN_IDENT:
-    case TOKEN_STRING:
-        token.string_value = strdup(l->token.string_value);
-        break;
-
-    default: print_error_and_exit("Unreachable token type %u in lexer_get_current_token", token.type);
+        l->str++;
+        l->loc.col++;
     }
-
-    return token;
+    return true;
 }
 
-static_assert(ACTUAL_TOKENS_COUNT == 11, "free_token");
-void free_token(Token *token)
+/* NOTE: the memory of the tokens is kept to be reused by the next lex_into */
+void tokens_reset(Tokens *tokens)
 {
-    if (token->loc.path) free(token->loc.path);
-    switch (token->type)
-    {
-    case TOKEN_IDENT:
-    case TOKEN_STRING:
-        free(token->string_value);
-        break;
-
-    default: {}
-    }
+    da_clear(tokens);
+    arena_reset(&tokens->arena);
+    if (tokens->identifiers.capacity > 0)
+        memset(tokens->identifiers.slots, 0, tokens->identifiers.capacity*sizeof(char *));
+    tokens->identifiers.count = 0;
 }
 
 void free_tokens(Tokens *tokens)
 {
-    da_foreach (*tokens, Token, token) {
-        free_token(token);
-    }
     da_free(tokens);
+    arena_free(&tokens->arena);
+    free(tokens->identifiers.slots);
+    if (tokens->owns_source) free(tokens->source);
+    free(tokens->path);
+    *tokens = (Tokens){0};
 }
 
-void lexer_free_current_token(Lexer *l)
-{
-    l->token.loc.path = NULL;
-    free_token(&l->token);
-}
-
-Tokens lex(Lexer *l)
+void lex_into(Tokens *tokens)
 {
-    Tokens tokens = {0};
-    while (lexer_next(l)) {
-        Token token = lexer_get_current_token(l);
-        da_push(&tokens, token);
-        //token_log(token);
-        lexer_free_current_token(l);
-    }
-    Token eof = { .type = TOKEN_EOF };
-    da_push(&tokens, eof);
-    return tokens;
+    mem_scope(MEM_TOKENS);
+    Lexer lexer = {
+        .str = tokens->source,
+        .loc = { .path = tokens->path },
+        .tokens = tokens,
+    };
+    while (lexer_next(&lexer)) da_push(tokens, lexer.token);
+    Token eof = { .type = TOKEN_EOF, .offset = lexer.str ? (size_t)(lexer.str - tokens->source) : 0, .loc = lexer.loc };
+    da_push(tokens, eof);
 }
 
 Tokens lex_file(char *path)
 {
-    Lexer lexer = lexer_create_from_path(path); 
-    return lex(&lexer);
+    Tokens tokens = {
+        .source = read_file(path),
+        .owns_source = true,
+        .path = strdup(path),
+    };
+    lex_into(&tokens);
+    return tokens;
 }
 
-Tokens lex_string(char *string)
+/* NOTE: the string must outlive the tokens, they point into it */
+void lex_string_into(Tokens *tokens, char *string)
 {
-    Lexer lexer = lexer_create_from_string(string); 
-    return lex(&lexer);
+    tokens_reset(tokens);
+    tokens->source = string;
+    lex_into(tokens);
 }
 
 /// END Commands
@@ -1293,6 +4053,7 @@ void save(void)
     close(fd);
     s_free(&save_buf);
     editor.dirty = 0;
+    editor.auto_snippet.dirty = -1; // NOTE: dirty starts counting again, the automaton state cannot be trusted
     write_message("%zu bytes written on disk", len);
     return;
 
@@ -1319,11 +4080,13 @@ void ncurses_end(void)
     clear();
     refresh();
     endwin();
-    log_this("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+    log_info("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~");
 }
 
+_Noreturn void headless_finish(void);
 _Noreturn void quit()
 {
+    if (headless.is_enabled) headless_finish();
     ncurses_end();
     exit(0);
 }
@@ -1359,150 +4122,402 @@ void builtin_force_quit(Command *cmd, CommandArgs *args)
     quit();
 }
 
-void move_cursor_up_internal(void)
+/* NOTE: motions take a count and apply it in one step, clamping to the buffer bounds */
+typedef void (*MotionFn)(size_t n);
+
+void move_cursor_up_internal(size_t n)
+{
+    editor.cursor.y = editor.cursor.y > n ? editor.cursor.y-n : 0;
+}
+
+void move_cursor_down_internal(size_t n)
+{ 
+    size_t last = last_cursor_row();
+    editor.cursor.y = last-editor.cursor.y > n ? editor.cursor.y+n : last;
+}
+
+void move_cursor_left_internal(size_t n)
 {
-    if (editor.cursor.y == 0 && editor.page != 0) {
-        editor.offset--;
-        // TODO: deve cambiare anche la pagina, ma come?
+    if (editor.in_cmd) editor.cmd_pos = editor.cmd_pos > n ? editor.cmd_pos-n : 0;
+    else editor.cursor.x = editor.cursor.x > n ? editor.cursor.x-n : 0;
+}
+
+void move_cursor_right_internal(size_t n)
+{
+    if (editor.in_cmd) {
+        editor.cmd_pos = editor.cmd.count-editor.cmd_pos > n ? editor.cmd_pos+n : editor.cmd.count;
+    } else {
+        size_t last = win_main.width > 0 ? win_main.width-1 : 0;
+        editor.cursor.x = last-editor.cursor.x > n ? editor.cursor.x+n : last;
     }
-    if (editor.cursor.y - 1 > 0) editor.cursor.y--;
-    else editor.cursor.y = 0;
 }
 
-void move_cursor_up(void)
+/* Applies the motion to the main cursor and to every multicursor mark, then updates the view once */
+void apply_motion(MotionFn motion, size_t n)
 {
-    move_cursor_up_internal();
+    motion(n);
+    if (editor.in_cmd) return;
     if (editor.multicursor.is_enabled) {
         Cursor saved = editor.cursor;
         da_foreach (editor.multicursor, Cursor, cursor) {
             editor.cursor = *cursor;
-            move_cursor_up_internal();
+            motion(n);
             *cursor = editor.cursor;
         }
         editor.cursor = saved;
     }
+    viewport_follow_cursor();
 }
 
-void move_cursor_down_internal(void)
-{ 
-    //if ((editor.offset+N_OR_DEFAULT(1) / N_PAGES) > editor.page) editor.page += (editor.offset+N_OR_DEFAULT(1)) / N_PAGES; // TODO: No, non funziona cosi' devo modificare l'offset in questo caso
-    if (editor.cursor.y == win_main.height-1 && editor.page != N_PAGES-1) {
-        editor.offset++;
-        // TODO: deve cambiare anche la pagina, ma come?
+static inline void move_cursor_up(size_t n)    { apply_motion(move_cursor_up_internal, n); }
+static inline void move_cursor_down(size_t n)  { apply_motion(move_cursor_down_internal, n); }
+static inline void move_cursor_left(size_t n)  { apply_motion(move_cursor_left_internal, n); }
+static inline void move_cursor_right(size_t n) { apply_motion(move_cursor_right_internal, n); }
+
+long command_arg_as_int(CommandArg *arg)
+{
+    switch (arg->type)
+    {
+        case PISQUY_INT:  return arg->int_value;
+        case PISQUY_UINT: return (long)arg->uint_value;
+        default:          return 0;
     }
-    if (editor.cursor.y + 1 < win_main.height-1) editor.cursor.y++;
-    else editor.cursor.y = win_main.height-1;
-    //if (editor.offset < editor.rows.count-N_OR_DEFAULT(0)-1) editor.offset += N_OR_DEFAULT(1); 
-    //else editor.offset = editor.rows.count-1;
 }
 
-void move_cursor_down(void)
+void builtin_move_cursor(Command *cmd, CommandArgs *args) 
 {
-    move_cursor_down_internal();
-    if (editor.multicursor.is_enabled) {
-        Cursor saved = editor.cursor;
-        da_foreach (editor.multicursor, Cursor, cursor) {
-            editor.cursor = *cursor;
-            move_cursor_down_internal();
-            *cursor = editor.cursor;
-        }
-        editor.cursor = saved;
+    if (!expect_n_arguments(cmd, args, 2)) return;
+
+    long x = command_arg_as_int(&args->items[0]) * (long)cmd->n;
+    long y = command_arg_as_int(&args->items[1]) * (long)cmd->n;
+
+    if (x > 0)      move_cursor_right(x);
+    else if (x < 0) move_cursor_left(-x);
+
+    if (y > 0)      move_cursor_down(y);
+    else if (y < 0) move_cursor_up(-y);
+}
+
+/* Swaps the rows [begin, middle) with [middle, end). Only the smaller side goes
+ * through a temporary buffer, the other one is shifted with a single memmove. */
+void rows_rotate(size_t begin, size_t middle, size_t end)
+{
+    size_t left = middle-begin;
+    size_t right = end-middle;
+    if (left == 0 || right == 0) return;
+
+    Row *items = editor.rows.items;
+    if (left <= right) {
+        Row *tmp = malloc(sizeof(Row)*left);
+        memcpy(tmp, items+begin, sizeof(Row)*left);
+        memmove(items+begin, items+middle, sizeof(Row)*right);
+        memcpy(items+begin+right, tmp, sizeof(Row)*left);
+        free(tmp);
+    } else {
+        Row *tmp = malloc(sizeof(Row)*right);
+        memcpy(tmp, items+middle, sizeof(Row)*right);
+        memmove(items+begin+right, items+begin, sizeof(Row)*left);
+        memcpy(items+begin, tmp, sizeof(Row)*right);
+        free(tmp);
     }
 }
 
-void move_cursor_left_internal(void)
+static inline void remap_row_after_rotation(size_t *y, size_t begin, size_t middle, size_t end)
 {
-    if (editor.in_cmd) {
-        if (editor.cmd_pos > 0) editor.cmd_pos--;
-        else editor.cmd_pos = 0;
+    if (*y < begin || *y >= end) return;
+    if (*y < middle) *y += end-middle;
+    else *y -= middle-begin;
+}
+
+/* Moves the rows [first, first+count) so that the first one ends up at dest.
+ * Cursors, multicursor marks, the selection and the anchors follow their rows. */
+void move_lines(size_t first, size_t count, size_t dest)
+{
+    if (count == 0 || dest == first) return;
+    assert(first+count <= editor.rows.count && dest+count <= editor.rows.count);
+    buffer_before_edit(dest < first ? dest : first);
+
+    size_t begin, middle, end;
+    if (dest < first) {
+        begin = dest;
+        middle = first;
+        end = first+count;
     } else {
-        if (editor.cursor.x > 0) editor.cursor.x--;
-        else editor.cursor.x = 0;
+        begin = first;
+        middle = first+count;
+        end = dest+count;
     }
+    rows_rotate(begin, middle, end);
+    match_index_rows_changed(begin, end-begin);
+    anchors_rotate_rows(&editor.anchors, begin, middle, end);
+
+    remap_row_after_rotation(&editor.cursor.y, begin, middle, end);
+    da_foreach (editor.multicursor, Cursor, cursor)
+        remap_row_after_rotation(&cursor->y, begin, middle, end);
+    if (editor.selection.is_active)
+        remap_row_after_rotation(&editor.selection.anchor.y, begin, middle, end);
+
+    viewport_follow_cursor();
+    editor.dirty++;
 }
 
-void move_cursor_left(void)
+/* NOTE: the lines moved by mvlu and mvld are the selected ones, or just the current line */
+bool get_lines_to_move(size_t *first, size_t *count)
 {
-    move_cursor_left_internal();
-    if (editor.multicursor.is_enabled) {
-        Cursor saved = editor.cursor;
-        da_foreach (editor.multicursor, Cursor, cursor) {
-            editor.cursor = *cursor;
-            move_cursor_left_internal();
-            *cursor = editor.cursor;
-        }
-        editor.cursor = saved;
+    Cursor begin, end;
+    if (selection_get_range(&begin, &end)) {
+        *first = begin.y;
+        *count = (end.x == 0 && end.y > begin.y ? end.y : end.y+1) - begin.y;
+        return true;
     }
+    if (CURRENT_Y_POS >= editor.rows.count) return false;
+    *first = CURRENT_Y_POS;
+    *count = 1;
+    return true;
 }
 
+void builtin_move_line_up(Command *cmd, CommandArgs *args)
+{
+    (void)args;
+    size_t first, count;
+    if (!get_lines_to_move(&first, &count)) return;
+    move_lines(first, count, first > cmd->n ? first-cmd->n : 0);
+}
 
-void move_cursor_right_internal(void)
+void builtin_move_line_down(Command *cmd, CommandArgs *args)
 {
-    if (editor.in_cmd) {
-        if (editor.cmd_pos < editor.cmd.count-1) editor.cmd_pos++;
-        else editor.cmd_pos = editor.cmd.count;
-    } else {
-        if (editor.cursor.x < win_main.width-1) editor.cursor.x++;
-        else editor.cursor.x = win_main.width-1;
-    }
+    (void)args;
+    size_t first, count;
+    if (!get_lines_to_move(&first, &count)) return;
+    size_t last_dest = editor.rows.count-count;
+    move_lines(first, count, last_dest-first > cmd->n ? first+cmd->n : last_dest);
 }
 
-void move_cursor_right(void)
+/* mvls(first, last, dest): lines are 1-based, dest is where the first moved line ends up */
+void builtin_move_lines(Command *cmd, CommandArgs *args)
 {
-    move_cursor_right_internal();
-    if (editor.multicursor.is_enabled) {
-        Cursor saved = editor.cursor;
-        da_foreach (editor.multicursor, Cursor, cursor) {
-            editor.cursor = *cursor;
-            move_cursor_right_internal();
-            *cursor = editor.cursor;
-        }
-        editor.cursor = saved;
+    if (!expect_n_arguments(cmd, args, 3)) return;
+    long first = command_arg_as_int(&args->items[0]);
+    long last  = command_arg_as_int(&args->items[1]);
+    long dest  = command_arg_as_int(&args->items[2]);
+    long rows  = editor.rows.count;
+    if (first < 1 || last < first || last > rows) {
+        write_message("ERROR: invalid range of lines %ld-%ld (the buffer has %ld lines)", first, last, rows);
+        return;
+    }
+    long count = last-first+1;
+    if (dest < 1 || dest+count-1 > rows) {
+        write_message("ERROR: cannot move %ld line%s to line %ld", count, count == 1 ? "" : "s", dest);
+        return;
     }
+    move_lines(first-1, count, dest-1);
 }
 
+/// BEGIN Replace
 
-void builtin_move_cursor(Command *cmd, CommandArgs *args) 
+#define REPLACE_MAX_WORKERS 16
+#define REPLACE_ROWS_PER_WORKER 4096 // NOTE: below this a thread costs more than it saves
+
+typedef struct
 {
-    (void)cmd;
+    size_t row;
+    String content;
+    RowMatches matches; // NOTE: in the old content, for the anchors
+} ReplacedRow;
+
+typedef struct
+{
+    ReplacedRow *items;
+    size_t count;
+    size_t capacity;
+} ReplacedRows;
+
+typedef struct
+{
+    pthread_t thread;
+    bool is_running;
+    size_t begin;
+    size_t end;
+
+    const char *pattern;
+    size_t pattern_len;
+    bool ignore_case;
+    const Regex *regex; // NOTE: NULL for literal patterns
+    const char *replacement;
+    size_t replacement_len;
+
+    size_t matches;
+    ReplacedRows rows;
+} ReplaceWorker;
+
+static bool replace_find(ReplaceWorker *w, RegexMatcher *matcher, String *line, size_t from, size_t *col, size_t *len)
+{
+    if (w->regex) return regex_find(matcher, line->items, line->count, from, col, len);
+    size_t at = find_substring(line->items+from, line->count-from, w->pattern, w->pattern_len, w->ignore_case);
+    if (at == SEARCH_NOT_FOUND) return false;
+    *col = from+at;
+    *len = w->pattern_len;
+    return true;
+}
+
+/* Builds the new contents of the rows in [begin, end) that have matches, the buffer is only read */
+void *replace_worker(void *arg)
+{
+    mem_scope(MEM_ROWS);
+    ReplaceWorker *w = arg;
+    RegexMatcher matcher;
+    if (w->regex) regex_matcher_init(&matcher, w->regex);
+
+    for (size_t y = w->begin; y < w->end; y++) {
+        String *line = &editor.rows.items[y].content;
+        String result = {0};
+        RowMatches matches = {0};
+        size_t from = 0, col, len;
+        while (from <= line->count && replace_find(w, &matcher, line, from, &col, &len)) {
+            RowMatch match = { .col = col, .len = len };
+            da_push(&matches, match);
+            w->matches++;
+            if (col > from) s_push_str(&result, line->items+from, col-from);
+            if (w->replacement_len > 0) s_push_str(&result, w->replacement, w->replacement_len);
+            if (len == 0) { // NOTE: an empty match would be found again at the same column
+                if (col < line->count) s_push(&result, line->items[col]);
+                from = col+1;
+            } else from = col+len;
+        }
+        if (matches.count == 0) continue;
+
+        if (from < line->count) s_push_str(&result, line->items+from, line->count-from);
+        ReplacedRow replaced = { .row = y, .content = result, .matches = matches };
+        da_push(&w->rows, replaced);
+    }
+
+    if (w->regex) regex_matcher_free(&matcher);
+    return NULL;
+}
 
-    if (args->count != 2) {
-        write_message("COMMAND ERROR: command %s takes 2 arguments, but got %zu", args->count);
+/* Rows are split in ranges scanned in parallel, the new contents are swapped in only
+ * after every worker is done, so the buffer changes in one step. */
+void replace_all(const char *pattern, const char *replacement, bool is_regex)
+{
+    uint64_t start_ns = monotonic_ns();
+    size_t pattern_len = strlen(pattern);
+    if (pattern_len == 0) {
+        write_message("ERROR: cannot replace an empty pattern");
         return;
     }
 
-    size_t x = args->items[0].int_value;
-    size_t y = args->items[1].int_value;
+    bool ignore_case = pattern_ignores_case(pattern, pattern_len, is_regex);
+    Regex regex;
+    if (is_regex) {
+        String error = {0};
+        bool ok = regex_compile(&regex, pattern, pattern_len, ignore_case, &error);
+        if (!ok) write_message("ERROR: invalid pattern: "S_FMT, S_ARG(error));
+        s_free(&error);
+        if (!ok) return;
+    }
+
+    size_t workers_count = editor.rows.count/REPLACE_ROWS_PER_WORKER + 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && workers_count > (size_t)cpus) workers_count = cpus;
+    if (workers_count > REPLACE_MAX_WORKERS) workers_count = REPLACE_MAX_WORKERS;
+
+    ReplaceWorker workers[REPLACE_MAX_WORKERS] = {0};
+    size_t chunk = (editor.rows.count + workers_count-1)/workers_count;
+    for (size_t i = 0; i < workers_count; i++) {
+        ReplaceWorker *w = &workers[i];
+        w->begin = i*chunk < editor.rows.count ? i*chunk : editor.rows.count;
+        w->end = w->begin+chunk < editor.rows.count ? w->begin+chunk : editor.rows.count;
+        w->pattern = pattern;
+        w->pattern_len = pattern_len;
+        w->ignore_case = ignore_case;
+        w->regex = is_regex ? &regex : NULL;
+        w->replacement = replacement;
+        w->replacement_len = strlen(replacement);
+    }
+
+    // NOTE: the first range is scanned by this thread, and so is any range whose thread could not start
+    for (size_t i = 1; i < workers_count; i++)
+        workers[i].is_running = pthread_create(&workers[i].thread, NULL, replace_worker, &workers[i]) == 0;
+    replace_worker(&workers[0]);
+    for (size_t i = 1; i < workers_count; i++) {
+        if (workers[i].is_running) pthread_join(workers[i].thread, NULL);
+        else replace_worker(&workers[i]);
+    }
+
+    size_t matches = 0, rows_changed = 0, first_changed = 0;
+    for (size_t i = 0; i < workers_count; i++) {
+        matches += workers[i].matches;
+        if (rows_changed == 0 && workers[i].rows.count > 0) first_changed = workers[i].rows.items[0].row;
+        rows_changed += workers[i].rows.count;
+    }
+    if (rows_changed > 0) buffer_before_edit(first_changed);
+
+    // NOTE: the cursors follow the replacements like the anchors do, they are anchored meanwhile
+    AnchorIds cursors = {0};
+    if (rows_changed > 0) {
+        da_push(&cursors, anchor_add(&editor.anchors, editor.cursor));
+        if (editor.selection.is_active) da_push(&cursors, anchor_add(&editor.anchors, editor.selection.anchor));
+        da_foreach (editor.multicursor, Cursor, mark) da_push(&cursors, anchor_add(&editor.anchors, *mark));
+    }
+    for (size_t i = 0; i < workers_count; i++) {
+        da_foreach (workers[i].rows, ReplacedRow, replaced) {
+            Row *row = ROW(replaced->row);
+            s_free(&row->content);
+            row->content = replaced->content;
+            match_index_rows_changed(replaced->row, 1);
+            // NOTE: right to left, so the columns of the matches still to splice are the old ones
+            for (size_t m = replaced->matches.count; m > 0; m--) {
+                RowMatch *match = &replaced->matches.items[m-1];
+                Cursor begin = { .x = match->col, .y = replaced->row };
+                Cursor end = { .x = match->col + match->len, .y = replaced->row };
+                Cursor new_end = { .x = match->col + workers[i].replacement_len, .y = replaced->row };
+                anchors_splice(&editor.anchors, begin, end, new_end);
+            }
+            da_free(&replaced->matches);
+        }
+        da_free(&workers[i].rows);
+    }
+    if (cursors.count > 0) {
+        size_t next = 0;
+        editor.cursor = anchor_get(&editor.anchors, cursors.items[next++]);
+        if (editor.selection.is_active) editor.selection.anchor = anchor_get(&editor.anchors, cursors.items[next++]);
+        da_foreach (editor.multicursor, Cursor, mark) *mark = anchor_get(&editor.anchors, cursors.items[next++]);
+        anchors_remove_all(&editor.anchors, &cursors);
+        da_free(&cursors);
+    }
+    if (is_regex) regex_free(&regex);
+    if (rows_changed > 0) editor.dirty++;
 
-    if (x > 0) for (size_t i = 0; i < x; i++) move_cursor_right();
-    else       for (int i = x; i >= 0; i++) move_cursor_left();
+    double elapsed_ms = (monotonic_ns()-start_ns)/1e6;
+    write_message("Replaced %zu match%s in %zu line%s (%.1fms, %zu thread%s)",
+            matches, matches == 1 ? "" : "es", rows_changed, rows_changed == 1 ? "" : "s",
+            elapsed_ms, workers_count, workers_count == 1 ? "" : "s");
+}
 
-    if (y > 0) for (size_t i = 0; i < y; i++) move_cursor_down();
-    else       for (int i = y; i >= 0; i++) move_cursor_up();
+static bool expect_replace_arguments(Command *cmd, CommandArgs *args)
+{
+    if (!expect_n_arguments(cmd, args, 2)) return false;
+    if (args->items[0].type == PISQUY_STRING && args->items[1].type == PISQUY_STRING) return true;
+    write_message("ERROR: command `%s` expects a pattern and a replacement string", cmd->name);
+    return false;
 }
 
-void builtin_move_line_up()
+/* rep(pattern, replacement) */
+void builtin_replace(Command *cmd, CommandArgs *args)
 {
-    size_t y = CURRENT_Y_POS;
-    if (y == 0) return;
-    Row tmp = editor.rows.items[y];
-    editor.rows.items[y] = editor.rows.items[y-1];
-    editor.rows.items[y-1] = tmp;
-    move_cursor_up();
-    editor.dirty++;
+    if (!expect_replace_arguments(cmd, args)) return;
+    replace_all(args->items[0].string_value, args->items[1].string_value, false);
 }
 
-void builtin_move_line_down()
+/* repx(regex, replacement) */
+void builtin_replace_regex(Command *cmd, CommandArgs *args)
 {
-    size_t y = CURRENT_Y_POS;
-    if (y == win_main.height-1) return;
-    Row tmp = editor.rows.items[y];
-    editor.rows.items[y] = editor.rows.items[y+1];
-    editor.rows.items[y+1] = tmp;
-    move_cursor_down();
-    editor.dirty++;
+    if (!expect_replace_arguments(cmd, args)) return;
+    replace_all(args->items[0].string_value, args->items[1].string_value, true);
 }
 
+/// END Replace
+
 void insert_char_at(Row *row, size_t at, int c)
 {
     if (at > row->content.count) {
@@ -1515,17 +4530,20 @@ void insert_char_at(Row *row, size_t at, int c)
     }
 }
 
+static inline bool commands_list_continues(Tokens tokens, size_t i, Token tok)
+{
+    return i < tokens.count && tok.type != TOKEN_EOF && tok.type != TOKEN_NEWLINE;
+}
+
 #define WITH_LOCATION true
 Command parse_commands_list(Tokens tokens, size_t *index, String *log, bool with_location)
 {
-    //log_this("Parsing commands list");
+    //log_debug("Parsing commands list");
     Command cmd = {0};
     size_t i = *index;
     Token tok_it = tokens.items[i];
 
-    bool can_continue(void) { return i < tokens.count && tok_it.type != TOKEN_EOF && tok_it.type != TOKEN_NEWLINE; }
-
-    while (can_continue()) {
+    while (commands_list_continues(tokens, i, tok_it)) {
         size_t n = 1;
         if (tok_it.type == TOKEN_NUMBER) {
             if (tok_it.number_value <= 0) {
@@ -1535,7 +4553,7 @@ Command parse_commands_list(Tokens tokens, size_t *index, String *log, bool with
                                 LOC_ARG(tok_it.loc), tok_it.number_value);
                     } else s_push_fstr(log, "ERROR: multiplicity number should be > 0 (got %d)\n", tok_it.number_value);
                 }
-                while (can_continue()) {
+                while (commands_list_continues(tokens, i, tok_it)) {
                     i++;
                     tok_it = tokens.items[i];
                 }
@@ -1547,7 +4565,7 @@ Command parse_commands_list(Tokens tokens, size_t *index, String *log, bool with
             tok_it = tokens.items[i];
         }
         if (!expect_token_to_be_of_type_extra_newline(tok_it, TOKEN_IDENT, log)) {
-            while (can_continue()) {
+            while (commands_list_continues(tokens, i, tok_it)) {
                 i++;
                 tok_it = tokens.items[i];
             }
@@ -1556,9 +4574,9 @@ Command parse_commands_list(Tokens tokens, size_t *index, String *log, bool with
         }
 
         char *subcmd_name = tok_it.string_value;
-        //log_this("subcommand name: %s", subcmd_name);
+        //log_debug("subcommand name: %s", subcmd_name);
         CommandType subcmd_type = get_command_type_from_string(subcmd_name);
-        //log_this("subcommand type: %s", get_command_type_as_cstr(subcmd_type));
+        //log_debug("subcommand type: %s", get_command_type_as_cstr(subcmd_type));
         if (subcmd_type == UNKNOWN) {
             if (log) {
                 if (with_location) {
@@ -1566,7 +4584,7 @@ Command parse_commands_list(Tokens tokens, size_t *index, String *log, bool with
                             LOC_ARG(tok_it.loc), subcmd_name);
                 } else s_push_fstr(log, "ERROR: unknown command `%s`\n", subcmd_name);
             }
-            while (can_continue()) {
+            while (commands_list_continues(tokens, i, tok_it)) {
                 i++;
                 tok_it = tokens.items[i];
             }
@@ -1583,16 +4601,62 @@ Command parse_commands_list(Tokens tokens, size_t *index, String *log, bool with
         tok_it = tokens.items[i];
 
         if (tok_it.type == '(') {
-            //log_this("TODO: parse arguments list for command `%s`", subcmd_name);
             i++;
             tok_it = tokens.items[i];
-            while (can_continue() && tok_it.type != ')') {
-                // TODO
+            bool args_error = false;
+            while (commands_list_continues(tokens, i, tok_it) && tok_it.type != ')') {
+                char *arg_name = "";
+                if (tok_it.type == TOKEN_IDENT && i+1 < tokens.count && tokens.items[i+1].type == '=') {
+                    arg_name = tok_it.string_value;
+                    i += 2;
+                    tok_it = tokens.items[i];
+                }
+                if (tok_it.type == '$' && i+1 < tokens.count && tokens.items[i+1].type == TOKEN_NUMBER
+                                       && tokens.items[i+1].number_value >= 0) {
+                    i++;
+                    tok_it = tokens.items[i];
+                    add_command_arg_placeholder(&subcmd.baked_args, arg_name, tok_it.number_value);
+                } else if (tok_it.type == TOKEN_NUMBER) {
+                    if (tok_it.number_value >= 0) add_command_arg_uint(&subcmd.baked_args, arg_name, tok_it.number_value);
+                    else add_command_arg_int(&subcmd.baked_args, arg_name, tok_it.number_value);
+                } else if (tok_it.type == TOKEN_STRING || tok_it.type == TOKEN_IDENT) {
+                    add_command_arg_string(&subcmd.baked_args, arg_name, tok_it.string_value);
+                } else {
+                    if (log) {
+                        char *tokstrval = token_type_and_value_as_string(tok_it);
+                        if (with_location) {
+                            s_push_fstr(log, LOC_FMT"\n- ERROR: unexpected %s in arguments of `%s`\n\n",
+                                    LOC_ARG(tok_it.loc), tokstrval, subcmd_name);
+                        } else s_push_fstr(log, "ERROR: unexpected %s in arguments of `%s`\n", tokstrval, subcmd_name);
+                        free(tokstrval);
+                    }
+                    args_error = true;
+                    break;
+                }
                 i++;
                 tok_it = tokens.items[i];
+                if (tok_it.type == ',') {
+                    i++;
+                    tok_it = tokens.items[i];
+                }
             } 
-            if (tok_it.type != ')') {
-                // TODO: error
+            if (!args_error && tok_it.type != ')') {
+                if (log) {
+                    if (with_location) {
+                        s_push_fstr(log, LOC_FMT"\n- ERROR: missing `)` after arguments of `%s`\n\n",
+                                LOC_ARG(tok_it.loc), subcmd_name);
+                    } else s_push_fstr(log, "ERROR: missing `)` after arguments of `%s`\n", subcmd_name);
+                }
+                args_error = true;
+            }
+            if (args_error) {
+                free_command_args(&subcmd.baked_args);
+                while (commands_list_continues(tokens, i, tok_it)) {
+                    i++;
+                    tok_it = tokens.items[i];
+                }
+                cmd.type = ERROR;
+                break;
             }
             i++;
             tok_it = tokens.items[i];
@@ -1602,7 +4666,7 @@ Command parse_commands_list(Tokens tokens, size_t *index, String *log, bool with
         da_push(&cmd.subcmds, subcmd);
     }
     *index = i;
-    //log_this("Done parsing command list");
+    //log_debug("Done parsing command list");
     return cmd;
 }
 
@@ -1610,23 +4674,22 @@ void execute_command(Command *cmd, CommandArgs *args);
 void insert_char_internal(char c)
 {
     if (editor.in_cmd) {
-        if (c == '\n') {
+        if (c == '\n' && editor.prompt == PROMPT_SEARCH) {
+            search_accept();
+        } else if (c == '\n' && editor.prompt == PROMPT_HISTORY) {
+            history_search_accept();
+        } else if (c == '\n') {
+            history_push(editor.cmd.items, editor.cmd.count);
             s_push_null(&editor.cmd);
             char *cmd_str = editor.cmd.items;
-            cs_push(&editor.commands_history, cmd_str);
             editor.in_cmd = false;
             s_clear(&editor.cmd);
             editor.cmd_pos = 0;
 
-            //log_this("Lexing command line `%s`", cmd_str);
+            //log_debug("Lexing command line `%s`", cmd_str);
             CommandArgs runtime_args = {0};
-            Tokens tokens = lex_string(cmd_str);
-            //log_this("Lexed command line:");
-            da_foreach (tokens, Token, tok) {
-                char *tokstrval = token_type_and_value_as_string(*tok);
-                //log_this(" - %s", tokstrval);
-                free(tokstrval);
-            }
+            static Tokens tokens = {0}; // NOTE: reused by every command line
+            lex_string_into(&tokens, cmd_str);
 
             size_t index = 0;
             String parse_log = {0};
@@ -1639,9 +4702,9 @@ void insert_char_internal(char c)
             if (parse_log.items) s_free(&parse_log);
             if (error) return;
 
-            //log_this("Ready to execute command from line -> type %u", cmd_from_line.type);
+            //log_debug("Ready to execute command from line -> type %u", cmd_from_line.type);
             for (size_t i = 0; i < cmd_from_line.subcmds.count; i++) {
-                //log_this("- %s", cmd_from_line.subcmds.items[i].name);
+                //log_debug("- %s", cmd_from_line.subcmds.items[i].name);
             }
 
             cmd_from_line.name = "command from line";
@@ -1651,46 +4714,57 @@ void insert_char_internal(char c)
             free_command(&cmd_from_line);
             free_command_args(&runtime_args);
         } else {
+            mem_scope(MEM_HISTORY);
             da_push(&editor.cmd, c);
             editor.cmd_pos++;
         }
         return;
     }
 
+    mem_scope(MEM_ROWS);
     size_t y = CURRENT_Y_POS;
     size_t x = CURRENT_X_POS;
+    buffer_before_edit(y);
 
     if (c == '\n') {
         if (y == editor.rows.count) {
             Row newrow = {0};
             da_push(&editor.rows, newrow);
+            match_index_rows_inserted(y, 1);
         } else {
             Row *row = CURRENT_ROW;
             if (x >= row->content.count) x = row->content.count;
             if (x == 0) {
                 Row newrow = {0};
                 da_insert(&editor.rows, newrow, y);
+                match_index_rows_inserted(y, 1);
             } else {
                 /* We are in the middle of a line. Split it between two rows. */
                 Row newrow = {0};
-                s_push_str(&newrow.content, row->content.items+x, row->content.count-x);
+                if (row->content.count > x) s_push_str(&newrow.content, row->content.items+x, row->content.count-x);
+                row->content.count = x; // NOTE: before da_insert, that can move the rows
                 da_insert(&editor.rows, newrow, y+1);
-                row->content.count = x;
+                match_index_rows_changed(y, 1);
+                match_index_rows_inserted(y+1, 1);
             }
         }
-        if (editor.cursor.y == win_main.height-1) editor.offset++;
-        else editor.cursor.y++;
+        editor.cursor.y++;
         editor.cursor.x = 0;
     } else {
         if (y >= editor.rows.count) {
+            size_t count = editor.rows.count;
             while (editor.rows.count <= y) {
                 Row newrow = {0};
                 da_push(&editor.rows, newrow);
             }
+            match_index_rows_inserted(count, editor.rows.count-count);
         }
         insert_char_at(CURRENT_ROW, x, c);
+        match_index_rows_changed(y, 1);
         editor.cursor.x++;
     }
+    Cursor at = { .x = x, .y = y };
+    anchors_splice(&editor.anchors, at, at, editor.cursor);
     editor.dirty++;
 }
 
@@ -1698,71 +4772,163 @@ void insert_char(char c)
 {
     if (!editor.multicursor.is_enabled || editor.in_cmd) {
         insert_char_internal(c);
+        if (!editor.in_cmd) viewport_follow_cursor();
         return;
     }
 
-    Cursor saved_main = editor.cursor;
-
-    for (size_t i = 0; i < editor.sorted_multicursor.count; i++) {
-        Cursor *current = editor.sorted_multicursor.items[i];
-        editor.cursor = (current == &editor.cursor) ? saved_main : *current;
+    AnchorIds anchors = multicursor_anchor();
+    da_foreach (anchors, AnchorId, id) {
+        editor.cursor = anchor_get(&editor.anchors, *id);
         insert_char_internal(c);
-        if (current == &editor.cursor) saved_main = editor.cursor;
-        else {
-            *current = editor.cursor;
-            editor.cursor = saved_main;
-        }
+    }
+    multicursor_release(&anchors);
+    viewport_follow_cursor();
+}
 
-        for (size_t j = 0; j < i; j++) {
-            Cursor *processed = editor.sorted_multicursor.items[j];
-            
-            if (c == '\n') {
-                // If we inserted a newline, shift rows below down
-                if (processed->y > current->y) {
-                    processed->y++; 
-                    // Note: You might want to reset x to 0 or keep relative, 
-                    // strictly editor.cursor.x resets on newline in insert_internal
-                } 
-                // If the processed cursor was on the same line (to the right),
-                // it essentially got moved to the new line.
-                else if (processed->y == current->y - 1) { // -1 because current->y incremented
-                     // Complex case: intra-line split.
-                     // For simplicity in this snippet, we assume standard behavior.
-                     processed->y++;
-                     processed->x -= current->x; // Shift X relative to split
-                }
-            } else {
-                // Standard char: shift X if on same row
-                // current->y matches processed->y because we sorted reverse.
-                // If they are on the same line, processed MUST be to the right.
-                if (processed->y == current->y) {
-                    processed->x++;
-                }
-            }
-            if (processed == &editor.cursor) saved_main = *processed;
-        }
+void string_insert_str(String *s, size_t at, const char *str, size_t n)
+{
+    size_t tail = s->count - at;
+    s_push_str(s, str, n); // NOTE: just to make room for n more chars
+    memmove(s->items+at+n, s->items+at, tail);
+    memcpy(s->items+at, str, n);
+}
+
+void rows_insert_empty(size_t at, size_t n)
+{
+    mem_scope(MEM_ROWS);
+    size_t tail = editor.rows.count - at;
+    for (size_t i = 0; i < n; i++) {
+        Row newrow = {0};
+        da_push(&editor.rows, newrow);
+    }
+    memmove(&editor.rows.items[at+n], &editor.rows.items[at], tail*sizeof(Row));
+    memset(&editor.rows.items[at], 0, n*sizeof(Row));
+    match_index_rows_inserted(at, n);
+}
+
+void rows_remove(size_t at, size_t n)
+{
+    for (size_t i = at; i < at+n; i++) s_free(&editor.rows.items[i].content);
+    memmove(&editor.rows.items[at], &editor.rows.items[at+n], (editor.rows.count-at-n)*sizeof(Row));
+    editor.rows.count -= n;
+    match_index_rows_removed(at, n);
+}
+
+/* Bulk counterpart of insert_char_internal: the text is spliced in the
+ * buffer at once, new lines are inserted with a single shift of the rows. */
+void insert_text_internal(const char *text, size_t len)
+{
+    mem_scope(MEM_ROWS);
+    if (len == 0) return;
+
+    size_t y = CURRENT_Y_POS;
+    size_t x = CURRENT_X_POS;
+    buffer_before_edit(y);
+    size_t count = editor.rows.count;
+    while (editor.rows.count <= y) {
+        Row newrow = {0};
+        da_push(&editor.rows, newrow);
     }
-    editor.cursor = saved_main;
+    match_index_rows_inserted(count, editor.rows.count-count);
+    Row *row = ROW(y);
+    while (row->content.count < x) s_push(&row->content, ' ');
+    match_index_rows_changed(y, 1);
+
+    const char *end = text+len;
+    const char *newline = memchr(text, '\n', len);
+    Cursor at = { .x = x, .y = y };
+    if (!newline) {
+        string_insert_str(&row->content, x, text, len);
+        editor.cursor.x = x+len;
+        anchors_splice(&editor.anchors, at, at, editor.cursor);
+        editor.dirty++;
+        return;
+    }
+
+    size_t n_lines = 0;
+    for (const char *it = newline; it; it = memchr(it+1, '\n', end-it-1)) n_lines++;
+
+    String tail = {0};
+    s_push_str(&tail, row->content.items+x, row->content.count-x);
+    row->content.count = x;
+    s_push_str(&row->content, text, newline-text);
+
+    rows_insert_empty(y+1, n_lines);
+    const char *it = newline+1;
+    for (size_t i = 1; i <= n_lines; i++) {
+        const char *next = it < end ? memchr(it, '\n', end-it) : NULL;
+        size_t seg_len = next ? (size_t)(next-it) : (size_t)(end-it);
+        s_push_str(&ROW(y+i)->content, it, seg_len);
+        it = next ? next+1 : end;
+    }
+    Row *last = ROW(y+n_lines);
+    size_t last_x = last->content.count;
+    s_push_str(&last->content, tail.items, tail.count);
+    s_free(&tail);
+
+    editor.cursor.y = y+n_lines;
+    editor.cursor.x = last_x;
+    anchors_splice(&editor.anchors, at, at, editor.cursor);
+    editor.dirty++;
+}
+
+void insert_text(const char *text, size_t len)
+{
+    if (editor.in_cmd) {
+        for (size_t i = 0; i < len; i++) insert_char_internal(text[i]);
+        return;
+    }
+    if (!editor.multicursor.is_enabled) {
+        insert_text_internal(text, len);
+        viewport_follow_cursor();
+        return;
+    }
+
+    AnchorIds anchors = multicursor_anchor();
+    da_foreach (anchors, AnchorId, id) {
+        editor.cursor = anchor_get(&editor.anchors, *id);
+        insert_text_internal(text, len);
+    }
+    multicursor_release(&anchors);
+    viewport_follow_cursor();
 }
 
 void insert_cstr(char *string)
 {
-    const size_t len = strlen(string);
-    for (size_t i = 0; i < len; i++) {
-        insert_char(string[i]);
+    insert_text(string, strlen(string));
+}
+
+/* Inserts n copies of the text with a single bulk insertion */
+void insert_text_n_times(const char *text, size_t len, size_t n)
+{
+    if (n == 1) {
+        insert_text(text, len);
+        return;
+    }
+    String repeated = {0};
+    for (size_t i = 0; i < n; i++) s_push_str(&repeated, text, len);
+    insert_text(repeated.items, repeated.count);
+    s_free(&repeated);
+}
+
+void insert_char_n_times(char c, size_t n)
+{
+    if (n == 1 || editor.in_cmd) {
+        for (size_t i = 0; i < n; i++) insert_char(c);
+        return;
     }
+    insert_text_n_times(&c, 1, n);
 }
 
 void builtin_insert(Command *cmd, CommandArgs *args)
 {
     if (!expect_n_arguments(cmd, args, 1)) return;
     char *string = args->items[0].string_value;
-    insert_cstr(string);
+    insert_text_n_times(string, strlen(string), cmd->n);
 }
 
 void builtin_date(Command *cmd, CommandArgs *args)
 {
-    (void)cmd;
     (void)args;
 
     time_t t = time(NULL);
@@ -1772,16 +4938,203 @@ void builtin_date(Command *cmd, CommandArgs *args)
         write_message("Could not get date");
         return;
     }
-    for (size_t i = 0; i < strlen(date); i++) {
-        insert_char(date[i]);
+    insert_text_n_times(date, strlen(date), cmd->n);
+}
+
+/* Jumps to a 1-based line. The view is placed directly around it, so the cost
+ * does not depend on how far the line is from the current one. */
+void goto_line(size_t line)
+{
+    if (editor.rows.count == 0) return;
+    if (line == 0) line = 1;
+    if (line > editor.rows.count) line = editor.rows.count;
+    size_t y = line-1;
+    if (!viewport_contains(y)) viewport_center_on(y);
+    editor.cursor.y = y;
+    editor.cursor.x = 0;
+}
+
+/* NOTE: the line can be given as argument, `goto(42)`, or as multiplicity, `42 goto` */
+void builtin_goto_line(Command *cmd, CommandArgs *args)
+{
+    if (args->count == 0) {
+        goto_line(cmd->n);
+        return;
+    }
+    if (!expect_n_arguments(cmd, args, 1)) return;
+    CommandArg arg = args->items[0];
+    if (arg.type == PISQUY_UINT) goto_line(arg.uint_value);
+    else if (arg.type == PISQUY_INT) goto_line(arg.int_value < 0 ? 0 : arg.int_value);
+    else write_message("ERROR: command `%s` expects a line number", cmd->name);
+}
+
+void builtin_stats(Command *cmd, CommandArgs *args)
+{
+    if (args->count > 0) {
+        CommandArg arg = args->items[0];
+        if (args->count == 1 && arg.type == PISQUY_STRING && streq(arg.string_value, "reset")) {
+            frame_stats_reset();
+            write_message("Stats have been reset");
+        } else write_message("ERROR: command `%s` expects no arguments or `reset`", cmd->name);
+        return;
+    }
+
+    double keys = frame_stats.keys ? frame_stats.keys : 1;
+    double frames = frame_stats.frames ? frame_stats.frames : 1;
+    write_message("Average per key (%"PRIu64" keys): read_key %.3fms, process %.3fms, update_windows %.3fms, doupdate %.3fms",
+            frame_stats.keys,
+            frame_stats.key_phases_ns[FRAME_READ_KEY]/keys/1e6,
+            frame_stats.key_phases_ns[FRAME_PROCESS_KEY]/keys/1e6,
+            frame_stats.key_phases_ns[FRAME_UPDATE_WINDOWS]/keys/1e6,
+            frame_stats.key_phases_ns[FRAME_DOUPDATE]/keys/1e6);
+    write_message("Key to paint p50 %.3fms p99 %.3fms max %.3fms | %.0f fps | %.1f rows, %.0f bytes per frame | %"PRIu64" bytes written",
+            histogram_percentile(&frame_stats.key_to_paint, 50)/1e6,
+            histogram_percentile(&frame_stats.key_to_paint, 99)/1e6,
+            frame_stats.key_to_paint.max/1e6,
+            frame_stats.fps,
+            frame_stats.rows_redrawn/frames,
+            frame_stats.bytes_written/frames,
+            frame_stats.bytes_written);
+}
+
+/* NOTE: handles are stored reversed, so the longest handle ending at the cursor is
+ *       found with a single walk backwards from it, whatever the number of snippets.
+ *       Children are looked up in a hash table keyed by parent node and byte. */
+
+#define SNIPPET_TRIE_NO_EDGE UINT64_MAX
+
+static inline uint64_t snippet_trie_edge_key(int node, unsigned char c) { return ((uint64_t)node << 8) | c; }
+
+static inline size_t snippet_trie_edge_slot(uint64_t key, size_t capacity)
+{
+    return (key * 11400714819323198485ull) >> 32 & (capacity-1);
+}
+
+int snippet_trie_child(SnippetTrie *trie, int node, unsigned char c)
+{
+    if (trie->edges_capacity == 0) return -1;
+    uint64_t key = snippet_trie_edge_key(node, c);
+    for (size_t i = snippet_trie_edge_slot(key, trie->edges_capacity);; i = (i+1) & (trie->edges_capacity-1)) {
+        if (trie->edges[i].key == key) return trie->edges[i].child;
+        if (trie->edges[i].key == SNIPPET_TRIE_NO_EDGE) return -1;
+    }
+}
+
+static void snippet_trie_put_edge(SnippetTrie *trie, uint64_t key, int child)
+{
+    size_t i = snippet_trie_edge_slot(key, trie->edges_capacity);
+    while (trie->edges[i].key != SNIPPET_TRIE_NO_EDGE) i = (i+1) & (trie->edges_capacity-1);
+    trie->edges[i] = (SnippetTrieEdge){ .key = key, .child = child };
+    trie->edges_count++;
+}
+
+static void snippet_trie_grow_edges(SnippetTrie *trie)
+{
+    SnippetTrieEdge *old = trie->edges;
+    size_t old_capacity = trie->edges_capacity;
+    trie->edges_capacity = old_capacity ? old_capacity*2 : 64;
+    trie->edges = malloc(trie->edges_capacity*sizeof(SnippetTrieEdge));
+    for (size_t i = 0; i < trie->edges_capacity; i++) trie->edges[i].key = SNIPPET_TRIE_NO_EDGE;
+    trie->edges_count = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old[i].key != SNIPPET_TRIE_NO_EDGE) snippet_trie_put_edge(trie, old[i].key, old[i].child);
+    free(old);
+}
+
+static int snippet_trie_add_node(SnippetTrie *trie)
+{
+    SnippetTrieNode node = { .snippet = -1, .inline_snippet = -1, .fail = 0, .output = -1 };
+    da_push(trie, node);
+    return trie->count-1;
+}
+
+void snippet_trie_insert(SnippetTrie *trie, const char *handle, size_t len, int snippet, bool is_inline, bool reversed)
+{
+    if (trie->count == 0) snippet_trie_add_node(trie);
+    if (len > trie->max_depth) trie->max_depth = len;
+    int node = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = reversed ? handle[len-1-i] : handle[i];
+        int child = snippet_trie_child(trie, node, c);
+        if (child < 0) {
+            if (2*(trie->edges_count+1) > trie->edges_capacity) snippet_trie_grow_edges(trie); // NOTE: load factor <= 0.5
+            child = snippet_trie_add_node(trie);
+            snippet_trie_put_edge(trie, snippet_trie_edge_key(node, c), child);
+        }
+        node = child;
+    }
+    // NOTE: if a handle is defined twice the first definition wins
+    if (trie->items[node].snippet < 0) trie->items[node].snippet = snippet;
+    if (is_inline && trie->items[node].inline_snippet < 0) trie->items[node].inline_snippet = snippet;
+}
+
+void snippet_trie_free(SnippetTrie *trie)
+{
+    da_free(trie);
+    free(trie->edges);
+    *trie = (SnippetTrie){0};
+}
+
+/* Aho-Corasick failure links. Nodes are visited level by level, following
+ * every handle one more byte at each level, so the fail node is always ready */
+static void snippet_automaton_link(SnippetTrie *trie)
+{
+    if (trie->count == 0) return;
+    int *nodes = calloc(editor.snippets.count, sizeof(int)); // NOTE: all handles start from the root
+    for (size_t depth = 0; depth < trie->max_depth; depth++) {
+        da_enumerate (editor.snippets, Snippet, i, snippet) {
+            if (snippet->handle_len <= depth) continue;
+            unsigned char c = snippet->handle[depth];
+            int parent = nodes[i];
+            int node = snippet_trie_child(trie, parent, c);
+            nodes[i] = node;
+            SnippetTrieNode *n = &trie->items[node];
+            if (parent != 0) {
+                int fail = trie->items[parent].fail;
+                while (fail != 0 && snippet_trie_child(trie, fail, c) < 0) fail = trie->items[fail].fail;
+                int child = snippet_trie_child(trie, fail, c);
+                n->fail = child >= 0 ? child : 0;
+            }
+            n->output = n->snippet >= 0 ? node : trie->items[n->fail].output;
+        }
+    }
+    free(nodes);
+}
+
+void snippet_trie_build(void)
+{
+    mem_scope(MEM_SNIPPETS);
+    snippet_trie_free(&editor.snippet_trie);
+    snippet_trie_free(&editor.snippet_automaton);
+    da_enumerate (editor.snippets, Snippet, i, snippet) {
+        snippet_trie_insert(&editor.snippet_trie, snippet->handle, snippet->handle_len, i, snippet->is_inline, true);
+        snippet_trie_insert(&editor.snippet_automaton, snippet->handle, snippet->handle_len, i, snippet->is_inline, false);
     }
+    snippet_automaton_link(&editor.snippet_automaton);
+    editor.auto_snippet.dirty = -1;
+}
+
+/* One step of the automaton, amortized O(1) */
+int snippet_automaton_next(SnippetTrie *trie, int state, unsigned char c)
+{
+    if (trie->count == 0) return 0;
+    int child;
+    while ((child = snippet_trie_child(trie, state, c)) < 0 && state != 0) state = trie->items[state].fail;
+    return child >= 0 ? child : 0;
 }
 
-void builtin_goto_line(Command *cmd, CommandArgs *args)
+/* Longest handle ending at column x of text, NULL if none */
+Snippet *snippet_trie_find(SnippetTrie *trie, const char *text, size_t x, bool only_inline)
 {
-    if (!expect_n_arguments(cmd, args, 1)) return;
-    size_t line = args->items[0].uint_value;
-    write_message("TODO: goto line %zu", line);
+    Snippet *found = NULL;
+    int node = 0;
+    for (size_t i = x; i > 0 && trie->count > 0; i--) {
+        node = snippet_trie_child(trie, node, text[i-1]);
+        if (node < 0) break;
+        int snippet = only_inline ? trie->items[node].inline_snippet : trie->items[node].snippet;
+        if (snippet >= 0) found = &editor.snippets.items[snippet];
+    }
+    return found;
 }
 
 #define SNIPPET_BODY_INDENTATION 4
@@ -1801,16 +5154,16 @@ bool parse_snippet_body(Token token_body, Snippet *snippet, String *log)
                     LOC_ARG(token_body.loc));
             return false;
         }
-        body[len-1] = '\0';
+        const char *closing = body+len-1; // NOTE: bounded by len, the lexed string is not written into
         body++;
-        while (*body && isblank(*body)) body++;
+        while (body < closing && isblank(*body)) body++;
         if (*body != '\n') {
             s_push_fstr(log, LOC_FMT"\n- ERROR: newline needed after '{' in multiline snippet definition\n\n",
                     LOC_ARG(token_body.loc));
             return false;
         }
         body++;
-        len = strlen(body);
+        len = closing - body;
         if (len == 0) {
             s_push_fstr(log, LOC_FMT"\n- WARNING: empty snippet body\n\n", LOC_ARG(token_body.loc));
             return false;
@@ -1832,7 +5185,7 @@ bool parse_snippet_body(Token token_body, Snippet *snippet, String *log)
             if (body[i] == '\n') {
                 // NOTE: empty line cannot have indentation
             } else if (body[i] == '\t') {
-                body++;
+                i++;
                 loc.col++;
             } else {
                 // TODO: maybe just calculate the indentation of the first non empty line and use it afterwards
@@ -1853,7 +5206,7 @@ bool parse_snippet_body(Token token_body, Snippet *snippet, String *log)
                 i++;
                 loc.col++;
             } else if (body[i] == '$') {
-                //log_this("Parsing snippet mark at "LOC_FMT, LOC_ARG(loc));
+                //log_debug("Parsing snippet mark at "LOC_FMT, LOC_ARG(loc));
                 SnippetMark mark = {
                     .name = NULL,
                     .cursor = cursor,
@@ -1863,22 +5216,21 @@ bool parse_snippet_body(Token token_body, Snippet *snippet, String *log)
                 loc.col++;
                 if (i >= len || body[i] != '{') {
                     da_push(&marks_da, mark);
-                    //log_this("snippet mark without name at (%zu, %zu)", mark.cursor.x, mark.cursor.y);
+                    //log_debug("snippet mark without name at (%zu, %zu)", mark.cursor.x, mark.cursor.y);
                     continue;
                 }
                 i++;
                 loc.col++;
                 char *name = body+i;
-                while (i < len-1 && body[i] != '\n' && body[i] != '}') {
+                while (i < len && body[i] != '\n' && body[i] != '}') {
                     i++;
                     loc.col++;
                 }
-                if (i >= len-1 || body[i] == '\n') {
+                if (i >= len || body[i] == '\n') {
                     s_push_fstr(log, LOC_FMT"\n- ERROR: unclosed named mark bracket\n\n", LOC_ARG(loc));
                     return false;
                 }
-                body[i] = '\0';
-                mark.name = strdup(name);
+                mark.name = strndup(name, body+i-name);
                 da_foreach (marks_da, SnippetMark, m) {
                     if (streq(m->name, mark.name)) {
                         mark.is_primary = false;
@@ -1886,8 +5238,10 @@ bool parse_snippet_body(Token token_body, Snippet *snippet, String *log)
                     }
                 }
                 da_push(&marks_da, mark);
-                //log_this("snippet mark `%s` at (%zu, %zu)", mark.name, mark.cursor.x, mark.cursor.y);
+                //log_debug("snippet mark `%s` at (%zu, %zu)", mark.name, mark.cursor.x, mark.cursor.y);
                 i++;
+                loc.col++;
+                continue;
             }
             s_push(&parsed_body, body[i]);
             i++;
@@ -1912,11 +5266,26 @@ bool parse_snippet_body(Token token_body, Snippet *snippet, String *log)
             cursor.x++;
         }
     }
-    if (parsed_body.items[parsed_body.count-1] == '\n')
+    if (parsed_body.count > 0 && parsed_body.items[parsed_body.count-1] == '\n')
         s_pop(&parsed_body);
     s_push_null(&parsed_body);
-    body = strdup(parsed_body.items);
-    s_free(&parsed_body);
+    snippet->body = parsed_body.items;
+    snippet->body_len = parsed_body.count;
+
+    SnippetLines lines = {0};
+    size_t offset = 0;
+    while (true) {
+        char *newline = memchr(snippet->body+offset, '\n', snippet->body_len-offset);
+        size_t end = newline ? (size_t)(newline-snippet->body) : snippet->body_len;
+        SnippetLine line = { .offset = offset, .len = end-offset, .is_indented = end > offset };
+        da_foreach (marks_da, SnippetMark, mark)
+            if (mark->cursor.y == lines.count) line.is_indented = true;
+        da_push(&lines, line);
+        if (!newline) break;
+        offset = end+1;
+    }
+    snippet->lines = lines.items;
+    snippet->lines_count = lines.count;
 
     snippet->marks_count = marks_da.count;
     snippet->marks = malloc(sizeof(SnippetMark)*marks_da.count);
@@ -1924,22 +5293,467 @@ bool parse_snippet_body(Token token_body, Snippet *snippet, String *log)
         snippet->marks[m] = marks_da.items[m];
 
     da_free(&marks_da);
-    snippet->body = body;
     return true;
 }
 
+/// BEGIN Config cache
+
+/* The resolved config (fields, variables, user commands and snippets) is written next to the config file
+ * after a full parse and mmapped on the next start, as long as the config file did not change.
+ * Strings and snippet line tables are used in place, straight from the mapping. */
+
+#define CONFIG_CACHE_MAGIC   "PSQCACHE"
+#define CONFIG_CACHE_VERSION 1 // NOTE: bump whenever the layout or the meaning of the cached data changes
+#define CONFIG_CACHE_SUFFIX  ".cache"
+
+typedef struct
+{
+    char magic[8];
+    uint64_t version;
+    uint64_t layout;      // NOTE: counts and sizes the payload depends on, see config_cache_layout
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t source_hash;
+    uint64_t payload_size;
+    uint64_t payload_hash;
+} ConfigCacheHeader;
+
+typedef struct
+{
+    const char *data;
+    size_t count;
+    size_t pos;
+    bool ok;
+} ConfigCacheReader;
+
+typedef struct
+{
+    void *addr;
+    size_t len;
+} ConfigCacheMapping;
+
+static ConfigCacheMapping config_cache_mapping = {0}; // NOTE: the loaded snippets point in here, so it lives as long as they do
+
+static uint64_t config_cache_layout(void)
+{
+    return (uint64_t)BUILTIN_CMDS_COUNT << 48 | (uint64_t)CONFIG_FIELDS_COUNT << 32 | sizeof(SnippetLine);
+}
+
+static void config_cache_write_u64(String *out, uint64_t value) { s_push_str(out, (char *)&value, sizeof(value)); }
+
+static void config_cache_align(String *out) { while (out->count % sizeof(uint64_t)) s_push(out, '\0'); }
+
+static void config_cache_write_str(String *out, const char *str, size_t len)
+{
+    if (str == NULL) {
+        config_cache_write_u64(out, UINT64_MAX);
+        return;
+    }
+    config_cache_write_u64(out, len);
+    s_push_str(out, str, len);
+    s_push(out, '\0');
+    config_cache_align(out);
+}
+
+static void config_cache_write_cstr(String *out, const char *str)
+{
+    config_cache_write_str(out, str, str ? strlen(str) : 0);
+}
+
+static uint64_t config_cache_read_u64(ConfigCacheReader *r)
+{
+    if (!r->ok || r->count - r->pos < sizeof(uint64_t)) {
+        r->ok = false;
+        return 0;
+    }
+    uint64_t value;
+    memcpy(&value, r->data + r->pos, sizeof(value));
+    r->pos += sizeof(value);
+    return value;
+}
+
+/* NOTE: the returned bytes are in the mapping, NULL on error */
+static const char *config_cache_read_bytes(ConfigCacheReader *r, size_t n)
+{
+    if (!r->ok || r->count - r->pos < n) {
+        r->ok = false;
+        return NULL;
+    }
+    const char *bytes = r->data + r->pos;
+    r->pos += n;
+    while (r->pos % sizeof(uint64_t) && r->pos < r->count) r->pos++;
+    return bytes;
+}
+
+/* NOTE: null terminated and in the mapping, NULL if the written string was NULL or on error */
+static const char *config_cache_read_str(ConfigCacheReader *r, size_t *len)
+{
+    uint64_t n = config_cache_read_u64(r);
+    if (n == UINT64_MAX || !r->ok) {
+        if (len) *len = 0;
+        return NULL;
+    }
+    const char *str = config_cache_read_bytes(r, n+1);
+    if (str && str[n] != '\0') r->ok = false;
+    if (len) *len = n;
+    return r->ok ? str : NULL;
+}
+
+static void config_cache_path(char *cache_path, size_t size, const char *config_path)
+{
+    snprintf(cache_path, size, "%s"CONFIG_CACHE_SUFFIX, config_path);
+}
+
+void config_cache_save(const char *config_path, uint64_t source_hash, const char *log, size_t log_len)
+{
+    struct stat source;
+    if (stat(config_path, &source) != 0) return;
+
+    String payload = {0};
+    static_assert(CONFIG_FIELDS_COUNT == 8, "Write all config fields in the config cache");
+    config_cache_write_u64(&payload, editor.config.quit_times);
+    config_cache_write_u64(&payload, editor.config.line_numbers);
+    config_cache_write_u64(&payload, editor.config.tab_to_spaces);
+    config_cache_write_u64(&payload, editor.config.tab_spaces_number);
+    config_cache_write_u64(&payload, editor.config.configlog_level);
+    config_cache_write_u64(&payload, editor.config.auto_snippets);
+    config_cache_write_u64(&payload, editor.config.log_level);
+    config_cache_write_u64(&payload, editor.config.msg_lifetime);
+
+    config_cache_write_u64(&payload, editor.config.vars.count);
+    da_foreach(editor.config.vars, Var, var) {
+        config_cache_write_cstr(&payload, var->name);
+        config_cache_write_u64(&payload, var->type);
+        if (var->type == PISQUY_STRING) config_cache_write_cstr(&payload, var->string_value);
+        else if (var->type == PISQUY_INT) config_cache_write_u64(&payload, (int64_t)var->int_value);
+        else if (var->type == PISQUY_BOOL) config_cache_write_u64(&payload, var->bool_value);
+        else config_cache_write_u64(&payload, var->uint_value);
+    }
+
+    config_cache_write_u64(&payload, USER_CMDS_COUNT);
+    for (size_t i = BUILTIN_CMDS_COUNT; i < commands.count; i++) {
+        Command *cmd = &commands.items[i];
+        config_cache_write_cstr(&payload, cmd->name);
+        config_cache_write_u64(&payload, cmd->subcmds.count);
+        da_foreach(cmd->subcmds, Command, subcmd) {
+            config_cache_write_cstr(&payload, subcmd->name);
+            config_cache_write_u64(&payload, subcmd->type);
+            config_cache_write_u64(&payload, subcmd->n);
+            config_cache_write_u64(&payload, subcmd->baked_args.count);
+            da_foreach(subcmd->baked_args, CommandArg, arg) {
+                config_cache_write_cstr(&payload, arg->name);
+                config_cache_write_u64(&payload, arg->type);
+                if (arg->type == PISQUY_STRING) config_cache_write_cstr(&payload, arg->string_value);
+                else if (arg->type == PISQUY_INT) config_cache_write_u64(&payload, (int64_t)arg->int_value);
+                else if (arg->type == PISQUY_ARG_PLACEHOLDER) config_cache_write_u64(&payload, arg->placeholder_index);
+                else config_cache_write_u64(&payload, arg->uint_value);
+            }
+        }
+    }
+
+    config_cache_write_u64(&payload, editor.snippets.count);
+    da_foreach(editor.snippets, Snippet, snippet) {
+        config_cache_write_str(&payload, snippet->handle, snippet->handle_len);
+        config_cache_write_str(&payload, snippet->body, snippet->body_len);
+        config_cache_write_u64(&payload, snippet->is_inline);
+        config_cache_write_u64(&payload, snippet->lines_count);
+        s_push_str(&payload, (char *)snippet->lines, sizeof(SnippetLine)*snippet->lines_count);
+        config_cache_align(&payload);
+        config_cache_write_u64(&payload, snippet->marks_count);
+        for (size_t m = 0; m < snippet->marks_count; m++) {
+            SnippetMark *mark = &snippet->marks[m];
+            config_cache_write_cstr(&payload, mark->name);
+            config_cache_write_u64(&payload, mark->cursor.x);
+            config_cache_write_u64(&payload, mark->cursor.y);
+            config_cache_write_u64(&payload, mark->is_primary);
+        }
+    }
+
+    /* NOTE: replayed on load, so a cached config complains exactly like a parsed one */
+    config_cache_write_str(&payload, log, log_len);
+
+    ConfigCacheHeader header = {
+        .magic = CONFIG_CACHE_MAGIC,
+        .version = CONFIG_CACHE_VERSION,
+        .layout = config_cache_layout(),
+        .source_size = source.st_size,
+        .source_mtime_sec = source.st_mtim.tv_sec,
+        .source_mtime_nsec = source.st_mtim.tv_nsec,
+        .source_hash = source_hash,
+        .payload_size = payload.count,
+        .payload_hash = hash_bytes(payload.items, payload.count),
+    };
+
+    char cache_path[PATH_MAX], tmp_path[PATH_MAX+8];
+    config_cache_path(cache_path, sizeof(cache_path), config_path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+
+    /* NOTE: written aside and renamed over, so an editor starting in the meantime never maps half a cache */
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        log_warning("Could not write config cache %s: %s", tmp_path, strerror(errno));
+        s_free(&payload);
+        return;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, f) == 1
+                && (payload.count == 0 || fwrite(payload.items, payload.count, 1, f) == 1);
+    written = fclose(f) == 0 && written;
+    if (!written || rename(tmp_path, cache_path) != 0) {
+        log_warning("Could not write config cache %s: %s", cache_path, strerror(errno));
+        unlink(tmp_path);
+    }
+    s_free(&payload);
+}
+
+/* NOTE: called with only the builtins registered, on failure nothing is left behind and the config must be parsed */
+bool config_cache_load(const char *config_path, String *config_log)
+{
+    mem_scope(MEM_CONFIG);
+    struct stat source;
+    if (stat(config_path, &source) != 0) return false;
+
+    char cache_path[PATH_MAX];
+    config_cache_path(cache_path, sizeof(cache_path), config_path);
+    int fd = open(cache_path, O_RDONLY);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ConfigCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+
+    const ConfigCacheHeader *header = addr;
+    const char *payload = (const char *)addr + sizeof(ConfigCacheHeader);
+    bool is_valid = memcmp(header->magic, CONFIG_CACHE_MAGIC, sizeof(header->magic)) == 0
+                 && header->version == CONFIG_CACHE_VERSION
+                 && header->layout == config_cache_layout()
+                 && header->source_size == (uint64_t)source.st_size
+                 && header->source_mtime_sec == source.st_mtim.tv_sec
+                 && header->source_mtime_nsec == source.st_mtim.tv_nsec
+                 && header->payload_size == st.st_size - sizeof(ConfigCacheHeader)
+                 && header->payload_hash == hash_bytes(payload, header->payload_size);
+    if (is_valid) {
+        /* NOTE: mtime has a coarse granularity on some filesystems, the content is what really matters */
+        char *content = read_file((char *)config_path);
+        is_valid = content != NULL && hash_bytes(content, strlen(content)) == header->source_hash;
+        free(content);
+    }
+    if (!is_valid) {
+        munmap(addr, st.st_size);
+        return false;
+    }
+
+    ConfigCacheReader r = { .data = payload, .count = header->payload_size, .ok = true };
+    Config config = editor.config;
+    Vars vars = {0};
+    Snippets snippets = {0};
+
+    static_assert(CONFIG_FIELDS_COUNT == 8, "Read all config fields from the config cache");
+    config.quit_times = config_cache_read_u64(&r);
+    config.line_numbers = config_cache_read_u64(&r);
+    config.tab_to_spaces = config_cache_read_u64(&r);
+    config.tab_spaces_number = config_cache_read_u64(&r);
+    config.configlog_level = config_cache_read_u64(&r);
+    config.auto_snippets = config_cache_read_u64(&r);
+    config.log_level = config_cache_read_u64(&r);
+    config.msg_lifetime = config_cache_read_u64(&r);
+
+    uint64_t vars_count = config_cache_read_u64(&r);
+    for (uint64_t i = 0; r.ok && i < vars_count; i++) {
+        Var var = {0};
+        const char *name = config_cache_read_str(&r, NULL);
+        var.type = config_cache_read_u64(&r);
+        if (var.type == PISQUY_STRING) {
+            const char *value = config_cache_read_str(&r, NULL);
+            var.string_value = value ? strdup(value) : NULL;
+        }
+        else if (var.type == PISQUY_INT) var.int_value = (int64_t)config_cache_read_u64(&r);
+        else if (var.type == PISQUY_BOOL) var.bool_value = config_cache_read_u64(&r);
+        else var.uint_value = config_cache_read_u64(&r);
+        var.name = name ? strdup(name) : NULL;
+        da_push(&vars, var);
+    }
+
+    uint64_t user_cmds_count = config_cache_read_u64(&r);
+    for (uint64_t i = 0; r.ok && i < user_cmds_count; i++) {
+        Command cmd = {0};
+        const char *name = config_cache_read_str(&r, NULL);
+        uint64_t subcmds_count = config_cache_read_u64(&r);
+        for (uint64_t j = 0; r.ok && j < subcmds_count; j++) {
+            Command subcmd = {0};
+            const char *subcmd_name = config_cache_read_str(&r, NULL);
+            subcmd.type = config_cache_read_u64(&r);
+            subcmd.n = config_cache_read_u64(&r);
+            uint64_t args_count = config_cache_read_u64(&r);
+            for (uint64_t k = 0; r.ok && k < args_count; k++) {
+                const char *arg_name = config_cache_read_str(&r, NULL);
+                if (arg_name == NULL) arg_name = "";
+                PisquyType type = config_cache_read_u64(&r);
+                if (type == PISQUY_STRING) {
+                    const char *value = config_cache_read_str(&r, NULL);
+                    add_command_arg_string(&subcmd.baked_args, (char *)arg_name, value ? (char *)value : "");
+                }
+                else if (type == PISQUY_INT) add_command_arg_int(&subcmd.baked_args, (char *)arg_name, (int64_t)config_cache_read_u64(&r));
+                else if (type == PISQUY_ARG_PLACEHOLDER) add_command_arg_placeholder(&subcmd.baked_args, (char *)arg_name, config_cache_read_u64(&r));
+                else add_command_arg_uint(&subcmd.baked_args, (char *)arg_name, config_cache_read_u64(&r));
+            }
+            /* NOTE: a subcommand can only call what was defined before it */
+            bool is_known = is_command_type_builtin(subcmd.type)
+                         || (subcmd.type >= USER_DEFINED && subcmd.type < USER_DEFINED + USER_CMDS_COUNT);
+            if (!is_known) r.ok = false;
+            subcmd.name = strdup(subcmd_name ? subcmd_name : "");
+            da_push(&cmd.subcmds, subcmd);
+        }
+        cmd.name = strdup(name ? name : "");
+        if (!r.ok) {
+            cmd.type = USER_DEFINED + USER_CMDS_COUNT; // NOTE: so that free_command frees the name
+            free_command(&cmd);
+            break;
+        }
+        add_user_defined_command(cmd);
+    }
+
+    uint64_t snippets_count = config_cache_read_u64(&r);
+    for (uint64_t i = 0; r.ok && i < snippets_count; i++) {
+        mem_scope(MEM_SNIPPETS);
+        Snippet snippet = {0};
+        snippet.handle = (char *)config_cache_read_str(&r, &snippet.handle_len);
+        snippet.body = (char *)config_cache_read_str(&r, &snippet.body_len);
+        snippet.is_inline = config_cache_read_u64(&r);
+        snippet.lines_count = config_cache_read_u64(&r);
+        if (snippet.lines_count > r.count/sizeof(SnippetLine)) r.ok = false;
+        else snippet.lines = (SnippetLine *)config_cache_read_bytes(&r, sizeof(SnippetLine)*snippet.lines_count);
+        snippet.marks_count = config_cache_read_u64(&r);
+        if (snippet.marks_count > r.count) r.ok = false;
+        if (!r.ok || snippet.handle == NULL || snippet.body == NULL) {
+            r.ok = false;
+            break;
+        }
+        snippet.marks = malloc(sizeof(SnippetMark)*snippet.marks_count);
+        for (size_t m = 0; m < snippet.marks_count; m++) {
+            SnippetMark *mark = &snippet.marks[m];
+            mark->name = (char *)config_cache_read_str(&r, NULL);
+            mark->cursor.x = config_cache_read_u64(&r);
+            mark->cursor.y = config_cache_read_u64(&r);
+            mark->is_primary = config_cache_read_u64(&r);
+        }
+        da_push(&snippets, snippet);
+    }
+
+    size_t log_len;
+    const char *log = config_cache_read_str(&r, &log_len);
+
+    if (!r.ok || log == NULL) {
+        log_warning("Config cache %s is corrupted, parsing the config", cache_path);
+        da_foreach(vars, Var, var) {
+            free(var->name);
+            if (var->type == PISQUY_STRING) free(var->string_value);
+        }
+        da_free(&vars);
+        da_foreach(snippets, Snippet, snippet) free(snippet->marks);
+        da_free(&snippets);
+        for (size_t i = BUILTIN_CMDS_COUNT; i < commands.count; i++) free_command(&commands.items[i]);
+        commands.count = BUILTIN_CMDS_COUNT;
+        user_commands_table_clear();
+        munmap(addr, st.st_size);
+        return false;
+    }
+
+    editor.config = config;
+    if (vars.count > 0) da_push_many(&editor.config.vars, vars.items, vars.count);
+    if (snippets.count > 0) da_push_many(&editor.snippets, snippets.items, snippets.count);
+    da_free(&vars);
+    da_free(&snippets);
+    if (log_len > 0) s_push_str(config_log, log, log_len);
+
+    // NOTE: the previous config has been dropped by now, nothing points in the old mapping anymore
+    if (config_cache_mapping.addr) munmap(config_cache_mapping.addr, config_cache_mapping.len);
+    config_cache_mapping.addr = addr;
+    config_cache_mapping.len = st.st_size;
+    return true;
+}
+
+/// END Config cache
+
+static const char *human_bytes(size_t bytes, char *buf)
+{
+    if      (bytes >= 1<<30) sprintf(buf, "%.1fGB", bytes/(double)(1<<30));
+    else if (bytes >= 1<<20) sprintf(buf, "%.1fMB", bytes/(double)(1<<20));
+    else if (bytes >= 1<<10) sprintf(buf, "%.1fKB", bytes/(double)(1<<10));
+    else                     sprintf(buf, "%zuB", bytes);
+    return buf;
+}
+
+/* NOTE: what the wrappers in Memory accounted, and how much of the rows capacity is unused */
+void builtin_mem(Command *cmd, CommandArgs *args)
+{
+    if (args->count > 0) {
+        write_message("ERROR: command `%s` expects no arguments", cmd->name);
+        return;
+    }
+
+#ifdef MEM_STATS
+    char current[16], peak[16];
+    size_t total = 0;
+    String line = {0};
+    s_push_fstr(&line, "Memory now/peak (live blocks):");
+    for (size_t tag = 0; tag < MEM_TAGS_COUNT; tag++) {
+        if (__atomic_load_n(&mem_stats.allocs[tag], __ATOMIC_RELAXED) == 0) continue;
+        size_t bytes = __atomic_load_n(&mem_stats.current[tag], __ATOMIC_RELAXED);
+        total += bytes;
+        s_push_fstr(&line, " %s %s/%s (%zu),", mem_tag_names[tag], human_bytes(bytes, current),
+                human_bytes(__atomic_load_n(&mem_stats.peak[tag], __ATOMIC_RELAXED), peak),
+                __atomic_load_n(&mem_stats.live[tag], __ATOMIC_RELAXED));
+    }
+    s_push_fstr(&line, " total %s", human_bytes(total, current));
+    write_message(S_FMT, S_ARG(line));
+    s_free(&line);
+#else
+    write_message("Allocations are not accounted in this build (it needs -DMEM_STATS)");
+#endif
+
+    size_t used = 0, capacity = 0;
+    da_foreach (editor.rows, Row, row) {
+        used += row->content.count;
+        capacity += row->content.capacity;
+    }
+    char rows_slack[16], rows_capacity[16], content_slack[16], content_capacity[16], mapping[16];
+    write_message("Config cache mapped %s | slack: rows array %s of %s, row contents %s of %s (%.0f%%)",
+            human_bytes(config_cache_mapping.len, mapping),
+            human_bytes((editor.rows.capacity - editor.rows.count)*sizeof(Row), rows_slack),
+            human_bytes(editor.rows.capacity*sizeof(Row), rows_capacity),
+            human_bytes(capacity - used, content_slack), human_bytes(capacity, content_capacity),
+            capacity ? 100.0*(capacity - used)/capacity : 0.0);
+}
+
+static char full_config_path[PATH_MAX] = {0};
+static bool config_cache_is_enabled = true; // NOTE: off in headless runs, they leave the config directory alone
+
+/* NOTE: at startup the config is taken from the cache or lexed here, and its log is shown with less (exiting on errors).
+ *       On reload the tokens come from the config watcher. If log_out is given, the log goes there instead of less
+ *       (on reload and in headless mode) and the result is false on errors. */
 int read_key(); // Forward declaration
-void load_config()
+static uint64_t config_generation = 0; // NOTE: bumped every time the commands, vars or snippets are replaced
+
+bool load_config(Tokens *reloaded, String *log_out)
 {
+    mem_scope(MEM_CONFIG);
+    config_generation++;
     char *home = getenv("HOME");
-    if (home == NULL) {
+    if (home == NULL && !headless.is_enabled) {
         print_error_and_exit("Env variable HOME not set\n");
     }
 
-    static_assert(CONFIG_FIELDS_COUNT == 5, "Set defaults and valid values for all config fields");
+    static_assert(CONFIG_FIELDS_COUNT == 8, "Set defaults and valid values for all config fields");
     const size_t default_quit_times = 3;
     const bool default_tab_to_spaces = true;
     const size_t default_tab_spaces_number = 4;
+    const bool default_auto_snippets = false;
+    const size_t default_msg_lifetime = 5;
 
     const ConfigLineNumbers default_line_numbers = LN_REL;
     Strings valid_values_line_numbers = {0};
@@ -1955,13 +5769,32 @@ void load_config()
         da_push_many(&valid_values_configlog_level, values, 3);
     }
 
+    const LogLevel default_log_level = DEBUG ? LOG_DEBUG : LOG_WARNING;
+    Strings valid_values_log_level = {0};
+    {
+        static_assert(LOG_LEVELS_COUNT == 5, "Add all log levels to the valid values of log_level");
+        char *values[] = {"debug", "info", "warning", "error", "off"};
+        da_push_many(&valid_values_log_level, values, 5);
+    }
+
     String config_log = {0};
 
+    // NOTE: a headless run only reads the config given with --config, so that it does not depend on the user one
+    bool uses_defaults = headless.is_enabled && headless.config_path == NULL;
     const char *config_path = ".config/editor/config.pisquy";
-    char full_config_path[256] = {0};
-    sprintf(full_config_path, "%s/%s", home, config_path);
-    FILE *config_file = fopen(full_config_path, "r");
-    if (config_file == NULL) {
+    if (headless.is_enabled) snprintf(full_config_path, sizeof(full_config_path), "%s", uses_defaults ? "" : headless.config_path);
+    else snprintf(full_config_path, sizeof(full_config_path), "%s/%s", home, config_path);
+    FILE *config_file = reloaded || uses_defaults ? NULL : fopen(full_config_path, "r");
+    if (reloaded) {
+        if (reloaded->source == NULL) {
+            s_push_fstr(&config_log, "ERROR: could not read config file %s\n\n", full_config_path);
+            free_tokens(reloaded);
+            goto fail;
+        }
+    } else if (config_file == NULL && headless.is_enabled && !uses_defaults) {
+        s_push_fstr(&config_log, "ERROR: could not read config file %s\n\n", full_config_path);
+        goto fail;
+    } else if (config_file == NULL && !uses_defaults) {
         s_push_fstr(&config_log, "WARNING: config file not found at %s\n\n", full_config_path);
         config_file = fopen(full_config_path, "w+");
         if (config_file == NULL) {
@@ -1969,7 +5802,7 @@ void load_config()
             goto fail;
         }
 
-        static_assert(CONFIG_FIELDS_COUNT == 5, "Write defaults and descriptions for all config fields in fresh config file");
+        static_assert(CONFIG_FIELDS_COUNT == 8, "Write defaults and descriptions for all config fields in fresh config file");
         // TODO: make the descriptions macro/const
         fprintf(config_file, "set quit_times = %zu\t// times you need to press CTRL-q before exiting without saving\n",
                 default_quit_times);
@@ -1983,18 +5816,31 @@ void load_config()
         fprintf(config_file,
                 "set configlog_level = %s\t// log level of config (all, warning, error)\n",
                 valid_values_configlog_level.items[default_configlog_level]);
+        fprintf(config_file,
+                "set auto_snippets = %s\t// snippets expand as soon as their handle is typed, without SHIFT-TAB\n",
+                BOOL_AS_CSTR(default_auto_snippets));
+        fprintf(config_file,
+                "set log_level = %s\t// messages written to log.txt (debug, info, warning, error or off)\n",
+                valid_values_log_level.items[default_log_level]);
+        fprintf(config_file,
+                "set msg_lifetime = %zu\t// seconds a message stays on screen (ALT-m shows it again)\n",
+                default_msg_lifetime);
 
         s_push_fstr(&config_log, "NOTE: default config file has been created\n\n");
-        rewind(config_file);
     }
+    if (config_file) fclose(config_file);
+    size_t cached_log_begin = config_log.count; // NOTE: what is above is about this run only, not about the config
 
-    static_assert(CONFIG_FIELDS_COUNT == 5, "Add all config fields to remaining_fields");
+    static_assert(CONFIG_FIELDS_COUNT == 8, "Add all config fields to remaining_fields");
     ConfigFields remaining_fields = {0};
     da_push(&remaining_fields, macro_make_config_field_uint(quit_times));
     da_push(&remaining_fields, macro_make_config_field_limited_string(line_numbers));
     da_push(&remaining_fields, macro_make_config_field_bool(tab_to_spaces));
     da_push(&remaining_fields, macro_make_config_field_uint(tab_spaces_number));
     da_push(&remaining_fields, macro_make_config_field_limited_string(configlog_level));
+    da_push(&remaining_fields, macro_make_config_field_bool(auto_snippets));
+    da_push(&remaining_fields, macro_make_config_field_limited_string(log_level));
+    da_push(&remaining_fields, macro_make_config_field_uint(msg_lifetime));
     
     //if (DEBUG) {
     //    for (size_t i = 0; i < remaining_fields.count; i++) {
@@ -2006,11 +5852,12 @@ void load_config()
     //}
 
     commands = (Commands){0};
-    static_assert(BUILTIN_CMDS_COUNT == 14, "Add all builtin commands in commands");
+    static_assert(BUILTIN_CMDS_COUNT == 19, "Add all builtin commands in commands");
     add_builtin_command(SAVE,              BUILTIN_SAVE,              builtin_save,              NULL);
     add_builtin_command(QUIT,              BUILTIN_QUIT,              builtin_quit,              NULL);
     add_builtin_command(SAVE_AND_QUIT,     BUILTIN_SAVE_AND_QUIT,     builtin_save_and_quit,     NULL);
     add_builtin_command(FORCE_QUIT,        BUILTIN_FORCE_QUIT,        builtin_force_quit,        NULL);
+    add_builtin_command(MOVE_CURSOR,       BUILTIN_MOVE_CURSOR,       builtin_move_cursor,       NULL);
 
     CommandArgs baked_args = {0};
     add_command_arg_int(&baked_args, "x", 0);
@@ -2037,10 +5884,27 @@ void load_config()
     add_builtin_command(INSERT,            BUILTIN_INSERT,            builtin_insert,            NULL);
     add_builtin_command(DATE,              BUILTIN_DATE,              builtin_date,              NULL);
     add_builtin_command(GOTO_LINE,         BUILTIN_GOTO_LINE,         builtin_goto_line,         NULL);
+    add_builtin_command(MOVE_LINES,        BUILTIN_MOVE_LINES,        builtin_move_lines,        NULL);
+    add_builtin_command(REPLACE,           BUILTIN_REPLACE,           builtin_replace,           NULL);
+    add_builtin_command(REPLACE_REGEX,     BUILTIN_REPLACE_REGEX,     builtin_replace_regex,     NULL);
+    add_builtin_command(STATS,             BUILTIN_STATS,             builtin_stats,             NULL);
+    add_builtin_command(MEM,               BUILTIN_MEM,               builtin_mem,               NULL);
 
     free_command_args(&baked_args);
+    builtins_table_build();
+    user_commands_table_clear();
 
-    Tokens tokens = lex_file(full_config_path);
+    if (!reloaded && !uses_defaults && config_cache_is_enabled && config_cache_load(full_config_path, &config_log)) {
+        da_free(&remaining_fields);
+        snippet_trie_build();
+        goto show_log;
+    }
+
+    static char no_config[] = "";
+    Tokens tokens = {0};
+    if (reloaded) tokens = *reloaded;
+    else if (uses_defaults) lex_string_into(&tokens, no_config);
+    else tokens = lex_file(full_config_path);
     ConfigFields inserted_fields = {0};
 
     for (size_t i = 0; i < tokens.count; i++) {
@@ -2095,7 +5959,7 @@ void load_config()
 
                         case FIELD_STRING: {
                             char *value;
-                            if (!expect_token_to_be_of_type(token_field_value, TOKEN_STRING, &config_log) || strlen(value) == 0) {
+                            if (!expect_token_to_be_of_type(token_field_value, TOKEN_STRING, &config_log) || strlen(token_field_value.string_value) == 0) {
                                 s_push_cstr(&config_log, "- NOTE: value must be a non empty string\n");
                                 s_push_fstr(&config_log, "- NOTE: defaulted to \"%s\"\n\n",
                                         removed_field.string_default);
@@ -2237,17 +6101,13 @@ void load_config()
             Token token_command_name = tokens.items[i];
             if (!expect_token_to_be_of_type_extra_newline(token_command_name, TOKEN_IDENT, &config_log)) continue;
             char *command_name = token_command_name.string_value;
-            bool already_defined = false;
-            da_enumerate(commands, Command, i, command) {
-                if (streq(command_name, command->name)) {
-                    s_push_fstr(&config_log, LOC_FMT"\n- ERROR: redeclaration of %s command `%s`\n\n",
-                            LOC_ARG(token_command_name.loc), i < BUILTIN_CMDS_COUNT ? "builtin" : "user defined",
-                            command_name); 
-                    already_defined = true;
-                    break;
-                }
+            CommandType already_defined = get_command_type_from_string(command_name);
+            if (already_defined != UNKNOWN) {
+                s_push_fstr(&config_log, LOC_FMT"\n- ERROR: redeclaration of %s command `%s`\n\n",
+                        LOC_ARG(token_command_name.loc), is_command_type_builtin(already_defined) ? "builtin" : "user defined",
+                        command_name);
+                continue;
             }
-            if (already_defined) continue;
             i++;
             if (!expect_token_to_be_of_type_extra_newline(tokens.items[i], '=', &config_log)) continue;
             i++;
@@ -2299,7 +6159,7 @@ void load_config()
             //    i++;
             //    tok_it = tokens.items[i];
             //    if (tok_it.type == '(') {
-            //        log_this("TODO: parse arguments list for command `%s`", subcmd_name);
+            //        log_debug("TODO: parse arguments list for command `%s`", subcmd_name);
             //        i++;
             //        tok_it = tokens.items[i];
             //        while (tok_it.type != ')') {
@@ -2318,6 +6178,7 @@ void load_config()
         } break;
 
         case TOKEN_SNIPPET: {
+            mem_scope(MEM_SNIPPETS);
             i++;
             Token token_snippet_handle = tokens.items[i];
             TokenType SNIPPET_HANDLE_TOKENS[2] = {TOKEN_IDENT, TOKEN_STRING};
@@ -2332,7 +6193,6 @@ void load_config()
             if (!parse_snippet_body(token_snippet_body, &snippet, &config_log)) continue;
             snippet.handle = strdup(token_snippet_handle.string_value);
             snippet.handle_len = strlen(token_snippet_handle.string_value);
-            snippet.handle_is_prefix = strneq(snippet.handle, snippet.body, snippet.handle_len);
             //if (DEBUG) {
             //    if (snippet.is_inline)
             //        s_push_fstr(&config_log, "\nParsed snippet `%s` = \"%s\"\n", snippet.handle, snippet.body);
@@ -2354,7 +6214,9 @@ void load_config()
         }
     }
 
+    uint64_t source_hash = tokens.source ? hash_bytes(tokens.source, strlen(tokens.source)) : 0;
     free_tokens(&tokens);
+    snippet_trie_build();
 
     if (remaining_fields.count > 0) {
         s_push_cstr(&config_log, "WARNING: the following fields have not been set:\n");
@@ -2386,6 +6248,7 @@ void load_config()
         }
         s_push(&config_log, '\n');
     }
+    if (uses_defaults) s_clear(&config_log); // NOTE: the fields were left unset on purpose
 
     //if (DEBUG) {
     //    s_push_fstr(&config_log, "\nDefined commands:\n");
@@ -2394,7 +6257,15 @@ void load_config()
     //    }
     //}
 
-    if (s_is_empty(config_log)) return;
+    if (config_cache_is_enabled && !uses_defaults) {
+        // NOTE: an empty log is not a missing one
+        if (config_log.count > cached_log_begin)
+            config_cache_save(full_config_path, source_hash, config_log.items+cached_log_begin, config_log.count-cached_log_begin);
+        else config_cache_save(full_config_path, source_hash, "", 0);
+    }
+
+show_log:
+    if (s_is_empty(config_log)) return true;
 
 fail:
 
@@ -2403,6 +6274,13 @@ fail:
     bool config_has_errors = strstr(config_log.items, "ERROR") != NULL;
     bool config_has_warnings = strstr(config_log.items, "WARNING") != NULL;
 
+    if (log_out) {
+        s_push_str(log_out, config_log.items, config_log.count);
+        s_push_null(log_out); // NOTE: callers look for ERROR and WARNING in it like above
+        s_free(&config_log);
+        return !config_has_errors;
+    }
+
     bool suppress_logs = !config_has_errors   && (editor.config.configlog_level >= CONFIGLOG_ERROR
                      || (!config_has_warnings &&  editor.config.configlog_level >= CONFIGLOG_WARNING));
 
@@ -2435,10 +6313,390 @@ fail:
 
     s_free(&config_log);
     if (config_has_errors) exit(1);
+    return true;
 }
 
 /// END Config 
 
+/// BEGIN Config reload
+
+/* The watcher thread waits for changes of the config file with inotify and lexes it. The tokens are picked up
+ * by the main loop between two frames, where the config is rebuilt aside and swapped in only if it has no errors. */
+
+#define CONFIG_RELOAD_SETTLE_MS 10 // NOTE: editors save with several writes or a rename, wait for the burst to end
+
+typedef struct
+{
+    Config config;
+    Commands commands;
+    CommandsTable user_commands_table;
+    Snippets snippets;
+    SnippetTrie snippet_trie;
+    SnippetTrie snippet_automaton;
+    ConfigCacheMapping cache_mapping;
+} ConfigState;
+
+typedef struct
+{
+    Tokens tokens;
+    uint64_t changed_ns; // NOTE: when the first event of the change was read
+    uint64_t lexed_ns;
+} ConfigReload;
+
+static struct
+{
+    pthread_t thread;
+    int inotify_fd;
+    ConfigReload *pending; // NOTE: swapped atomically, the watcher puts the latest lexed config, the main loop takes it
+} config_watcher = { .inotify_fd = -1 };
+
+/* NOTE: moves the live config out, leaving everything empty for load_config */
+ConfigState config_state_take(void)
+{
+    ConfigState state = {
+        .config = editor.config,
+        .commands = commands,
+        .user_commands_table = user_commands_table,
+        .snippets = editor.snippets,
+        .snippet_trie = editor.snippet_trie,
+        .snippet_automaton = editor.snippet_automaton,
+        .cache_mapping = config_cache_mapping,
+    };
+    editor.config = (Config){0};
+    commands = (Commands){0};
+    user_commands_table = (CommandsTable){0};
+    editor.snippets = (Snippets){0};
+    editor.snippet_trie = (SnippetTrie){0};
+    editor.snippet_automaton = (SnippetTrie){0};
+    config_cache_mapping = (ConfigCacheMapping){0};
+    return state;
+}
+
+void config_state_put(ConfigState *state)
+{
+    config_generation++;
+    editor.config = state->config;
+    commands = state->commands;
+    user_commands_table = state->user_commands_table;
+    editor.snippets = state->snippets;
+    editor.snippet_trie = state->snippet_trie;
+    editor.snippet_automaton = state->snippet_automaton;
+    config_cache_mapping = state->cache_mapping;
+}
+
+void config_state_free(ConfigState *state)
+{
+    da_foreach(state->config.vars, Var, var) {
+        free(var->name);
+        if (var->type == PISQUY_STRING) free(var->string_value);
+    }
+    da_free(&state->config.vars);
+
+    /* NOTE: not free_command, which tells user defined commands apart by looking at the live ones */
+    da_enumerate(state->commands, Command, i, cmd) {
+        if (i >= BUILTIN_CMDS_COUNT) free(cmd->name);
+        da_foreach(cmd->subcmds, Command, subcmd) {
+            free(subcmd->name);
+            free_command_args(&subcmd->baked_args);
+        }
+        da_free(&cmd->subcmds);
+        free_command_args(&cmd->baked_args);
+        da_free(&cmd->code);
+    }
+    da_free(&state->commands);
+    free(state->user_commands_table.slots);
+
+    /* NOTE: snippets loaded from the cache point in the mapping, only their marks are allocated */
+    bool is_mapped = state->cache_mapping.addr != NULL;
+    da_foreach(state->snippets, Snippet, snippet) {
+        if (!is_mapped) {
+            free(snippet->handle);
+            free(snippet->body);
+            free(snippet->lines);
+            for (size_t m = 0; m < snippet->marks_count; m++) free(snippet->marks[m].name);
+        }
+        free(snippet->marks);
+    }
+    da_free(&state->snippets);
+    snippet_trie_free(&state->snippet_trie);
+    snippet_trie_free(&state->snippet_automaton);
+    if (is_mapped) munmap(state->cache_mapping.addr, state->cache_mapping.len);
+}
+
+void config_reload_free(ConfigReload *reload)
+{
+    free_tokens(&reload->tokens);
+    free(reload);
+}
+
+void *config_watcher_run(void *arg)
+{
+    (void)arg;
+    const char *config_name = strrchr(full_config_path, '/') + 1;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t len = read(config_watcher.inotify_fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+
+        bool is_config_changed = false;
+        for (char *it = buf; it < buf + len; ) {
+            struct inotify_event *event = (struct inotify_event *)it;
+            if (event->len > 0 && streq(event->name, config_name)) is_config_changed = true;
+            it += sizeof(struct inotify_event) + event->len;
+        }
+        if (!is_config_changed) continue;
+
+        ConfigReload *reload = malloc(sizeof(ConfigReload));
+        reload->changed_ns = monotonic_ns();
+        struct pollfd pfd = { .fd = config_watcher.inotify_fd, .events = POLLIN };
+        while (poll(&pfd, 1, CONFIG_RELOAD_SETTLE_MS) > 0 && read(config_watcher.inotify_fd, buf, sizeof(buf)) > 0);
+
+        reload->tokens = lex_file(full_config_path);
+        reload->lexed_ns = monotonic_ns();
+
+        ConfigReload *stale = __atomic_exchange_n(&config_watcher.pending, reload, __ATOMIC_ACQ_REL);
+        if (stale) config_reload_free(stale);
+    }
+    log_warning("Config watcher stopped: %s", strerror(errno));
+    return NULL;
+}
+
+void config_watcher_start(void)
+{
+    char config_dir[PATH_MAX];
+    snprintf(config_dir, sizeof(config_dir), "%s", full_config_path);
+    *strrchr(config_dir, '/') = '\0';
+
+    /* NOTE: the directory is watched, so that the file can be replaced by a rename */
+    config_watcher.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (config_watcher.inotify_fd == -1
+        || inotify_add_watch(config_watcher.inotify_fd, config_dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1
+        || pthread_create(&config_watcher.thread, NULL, config_watcher_run, NULL) != 0) {
+        log_warning("Could not watch config directory %s: %s", config_dir, strerror(errno));
+        if (config_watcher.inotify_fd != -1) close(config_watcher.inotify_fd);
+        config_watcher.inotify_fd = -1;
+        return;
+    }
+    pthread_detach(config_watcher.thread);
+}
+
+/* NOTE: one message per entry of the log, they are separated by an empty line */
+void write_config_log_messages(String *log)
+{
+    size_t begin = 0;
+    while (begin < log->count) {
+        String message = {0};
+        size_t end = begin;
+        while (end < log->count && !(log->items[end] == '\n' && end+1 < log->count && log->items[end+1] == '\n')) {
+            char c = log->items[end++];
+            if (c != '\n') s_push(&message, c);
+            else if (message.count > 0 && message.items[message.count-1] != ' ') s_push(&message, ' ');
+        }
+        while (message.count > 0 && message.items[message.count-1] == ' ') s_pop(&message);
+        if (message.count > 0) write_message(S_FMT, S_ARG(message));
+        s_free(&message);
+        begin = end + 2;
+    }
+}
+
+/* Called by the main loop between two frames */
+void config_reload_apply(void)
+{
+    if (__atomic_load_n(&config_watcher.pending, __ATOMIC_ACQUIRE) == NULL) return;
+    ConfigReload *reload = __atomic_exchange_n(&config_watcher.pending, NULL, __ATOMIC_ACQ_REL);
+    if (reload == NULL) return;
+
+    uint64_t apply_ns = monotonic_ns();
+    ConfigState previous = config_state_take();
+    String log = {0};
+    bool ok = load_config(&reload->tokens, &log); // NOTE: the tokens are freed by load_config
+    ConfigLogLevel configlog_level = editor.config.configlog_level;
+
+    if (ok) {
+        if (editor_is_expanding_snippet()) expanding_snippet_stop();
+        config_state_free(&previous);
+    } else {
+        ConfigState failed = config_state_take();
+        config_state_free(&failed);
+        config_state_put(&previous);
+    }
+    editor.auto_snippet.dirty = -1;
+    editor.current_quit_times = editor.config.quit_times;
+
+    uint64_t done_ns = monotonic_ns();
+    bool has_warnings = strstr(log.items ? log.items : "", "WARNING") != NULL;
+    bool suppress_logs = ok && (configlog_level >= CONFIGLOG_ERROR
+                     || (!has_warnings && configlog_level >= CONFIGLOG_WARNING));
+    if (!suppress_logs) write_config_log_messages(&log);
+    s_free(&log);
+
+    if (ok) {
+        write_message("Config reloaded in %.1fms (read and lex %.1fms, rebuild %.1fms)",
+                (done_ns - reload->changed_ns)/1e6, (reload->lexed_ns - reload->changed_ns)/1e6, (done_ns - apply_ns)/1e6);
+    } else write_message("ERROR: config has errors, the previous one is kept (%.1fms, ALT-p to see them)",
+            (done_ns - reload->changed_ns)/1e6);
+    free(reload);
+}
+
+/// END Config reload
+
+/// BEGIN Completion
+
+/* NOTE: TAB in the command line completes the word before the cursor with the names the config knows about.
+ *       They are kept in one sorted array, so the candidates for a prefix are a range found by binary search.
+ *       The names point into the config, the array is rebuilt by the first TAB after the config changed. */
+
+typedef enum {
+    COMPLETION_BUILTIN,
+    COMPLETION_USER_DEFINED,
+    COMPLETION_CONFIG_FIELD,
+    COMPLETION_VAR,
+    COMPLETION_SNIPPET,
+    COMPLETION_KINDS_COUNT,
+} CompletionKind;
+
+static const char *completion_kind_names[] = {"builtin", "command", "config field", "var", "snippet"};
+static_assert(sizeof(completion_kind_names)/sizeof(completion_kind_names[0]) == COMPLETION_KINDS_COUNT,
+              "Name all the completion kinds");
+
+static_assert(CONFIG_FIELDS_COUNT == 8, "Complete all config fields");
+static const char *completion_config_fields[] = {
+    "quit_times", "line_numbers", "tab_to_spaces", "tab_spaces_number", "configlog_level", "auto_snippets",
+    "log_level", "msg_lifetime",
+};
+
+typedef struct
+{
+    const char *name;
+    size_t len;
+    CompletionKind kind;
+} Completion;
+
+typedef struct
+{
+    Completion *items;
+    size_t count;
+    size_t capacity;
+} Completions;
+
+static struct {
+    Completions sorted;
+    uint64_t config_generation; // NOTE: of the config the names point into
+    bool is_cycling;            // NOTE: TAB again inserts the next candidate, any other key stops it
+    size_t begin;               // NOTE: of the word being completed
+    size_t lo, hi;              // NOTE: range of the candidates
+    size_t next;
+} completion;
+
+int completion_compare(const void *a, const void *b)
+{
+    const Completion *x = a, *y = b;
+    int cmp = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+    if (cmp != 0) return cmp;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+static void completion_push(const char *name, size_t len, CompletionKind kind)
+{
+    if (name == NULL || len == 0) return;
+    Completion c = { .name = name, .len = len, .kind = kind };
+    da_push(&completion.sorted, c);
+}
+
+void completion_rebuild(void)
+{
+    mem_scope(MEM_CONFIG);
+    da_clear(&completion.sorted);
+    da_enumerate (commands, Command, i, cmd)
+        completion_push(cmd->name, cmd->name ? strlen(cmd->name) : 0, i < BUILTIN_CMDS_COUNT ? COMPLETION_BUILTIN : COMPLETION_USER_DEFINED);
+    for (size_t i = 0; i < CONFIG_FIELDS_COUNT; i++)
+        completion_push(completion_config_fields[i], strlen(completion_config_fields[i]), COMPLETION_CONFIG_FIELD);
+    da_foreach (editor.config.vars, Var, var) completion_push(var->name, var->name ? strlen(var->name) : 0, COMPLETION_VAR);
+    da_foreach (editor.snippets, Snippet, snippet) completion_push(snippet->handle, snippet->handle_len, COMPLETION_SNIPPET);
+
+    qsort(completion.sorted.items, completion.sorted.count, sizeof(Completion), completion_compare);
+    size_t unique = 0;
+    da_foreach (completion.sorted, Completion, c) { // NOTE: the same name with more kinds is completed once
+        if (unique > 0 && completion_compare(&completion.sorted.items[unique-1], c) == 0) continue;
+        completion.sorted.items[unique++] = *c;
+    }
+    completion.sorted.count = unique;
+    completion.config_generation = config_generation;
+}
+
+/* First candidate that is not below prefix, with above the first one that does not start with it */
+static size_t completion_bound(const char *prefix, size_t len, bool above)
+{
+    size_t lo = 0, hi = completion.sorted.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi-lo)/2;
+        Completion *c = &completion.sorted.items[mid];
+        int cmp = memcmp(c->name, prefix, c->len < len ? c->len : len);
+        if (cmp == 0 && c->len < len) cmp = -1;
+        if (cmp < 0 || (above && cmp == 0)) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static inline bool completion_is_word_char(char c)
+{
+    return !isspace((unsigned char)c) && !strchr("(),=\"", c);
+}
+
+/* NOTE: replaces the word that starts at begin and ends at the cursor */
+static void completion_insert(size_t begin, const char *name, size_t len)
+{
+    memmove(editor.cmd.items+begin, editor.cmd.items+editor.cmd_pos, editor.cmd.count-editor.cmd_pos);
+    editor.cmd.count -= editor.cmd_pos-begin;
+    string_insert_str(&editor.cmd, begin, name, len);
+    editor.cmd_pos = begin+len;
+}
+
+void complete_command_line(void)
+{
+    if (editor.prompt != PROMPT_COMMAND) return;
+    if (completion.config_generation != config_generation) {
+        completion_rebuild();
+        completion.is_cycling = false;
+    }
+
+    if (completion.is_cycling) {
+        Completion *c = &completion.sorted.items[completion.next];
+        completion_insert(completion.begin, c->name, c->len);
+        completion.next = completion.next+1 < completion.hi ? completion.next+1 : completion.lo;
+        return;
+    }
+
+    size_t begin = editor.cmd_pos;
+    while (begin > 0 && completion_is_word_char(editor.cmd.items[begin-1])) begin--;
+    const char *prefix = editor.cmd.items+begin;
+    size_t len = editor.cmd_pos-begin;
+    size_t lo = completion_bound(prefix, len, false);
+    size_t hi = completion_bound(prefix, len, true);
+    if (lo == hi) return;
+
+    // NOTE: the array is sorted, the prefix shared by all the candidates is the one of the first and the last
+    Completion *first = &completion.sorted.items[lo], *last = &completion.sorted.items[hi-1];
+    size_t common = len;
+    while (common < first->len && common < last->len && first->name[common] == last->name[common]) common++;
+    if (lo+1 == hi || common > len) {
+        completion_insert(begin, first->name, lo+1 == hi ? first->len : common);
+        return;
+    }
+
+    completion.is_cycling = true;
+    completion.begin = begin;
+    completion.lo = lo;
+    completion.hi = hi;
+    completion.next = lo;
+    complete_command_line();
+}
+
+/// END Completion
+
 /* Pairs */
 typedef enum
 {
@@ -2485,7 +6743,7 @@ void destroy_windows(void)
 
 void cleanup_on_terminating_signal(int sig)
 {
-    log_this("Program received signal %d", sig);
+    log_error("Program received signal %d", sig);
     ncurses_end();
     exit(1);
 }
@@ -2495,7 +6753,14 @@ void cleanup_on_terminating_signal(int sig)
 
 void ncurses_init(void)
 {
-    initscr();
+    if (headless.is_enabled) {
+        /* NOTE: a screen drawn on /dev/null, so windows and their sizes work as usual without a terminal */
+        FILE *null = fopen("/dev/null", "r+");
+        if (null == NULL || newterm("xterm", null, null) == NULL) {
+            fprintf(stderr, "ERROR: could not create the headless screen\n");
+            exit(1);
+        }
+    } else initscr();
 
     raw();
     noecho();
@@ -2531,18 +6796,19 @@ void initialize_colors(void)
     }
 }
 
+int headless_next_key(void); // Forward declaration
 int read_key()
 {
-    int c = getch();
+    int c = headless.is_enabled ? headless_next_key() : getch();
     if (c != ESC) return c;
 
-    int first = getch();
+    int first = headless.is_enabled ? headless_next_key() : getch();
     if (first == ERR) return ESC;
 
     if (first == '[') { // ESC-[-X sequence
-        int second = getch();
+        int second = headless.is_enabled ? headless_next_key() : getch();
         if (second == ERR) return ESC;
-        log_this("Read ESC-[-%c sequence", first);
+        log_debug("Read ESC-[-%c sequence", first);
 
         return ESC; // TODO: togli
 
@@ -2561,6 +6827,8 @@ int read_key()
         case '8'          : return ALT_8;
         case '9'          : return ALT_9;
 
+        case 'g'          : return ALT_g;
+        case 'G'          : return ALT_G;
         case 'c'          : return ALT_c;
         case 'C'          : return ALT_C;
         case 'k'          : return ALT_k;
@@ -2574,8 +6842,15 @@ int read_key()
         case 'm'          : return ALT_m;
         case 'n'          : return ALT_n;
         case 'p'          : return ALT_p;
+        case 'P'          : return ALT_P;
+        case 'v'          : return ALT_v;
+        case 'y'          : return ALT_y;
+        case 'x'          : return ALT_x;
+        case '"'          : return ALT_QUOTE;
         case KEY_BACKSPACE: return ALT_BACKSPACE;
         case ':'          : return ALT_COLON;
+        case '/'          : return ALT_SLASH;
+        case '?'          : return ALT_QUESTION_MARK;
 
         case CTRL('C'): return CTRL_ALT_C;
         case CTRL('K'): return CTRL_ALT_K;
@@ -2592,8 +6867,8 @@ int read_key()
 void show_ghost_cursor(Cursor cursor, bool hide_main)
 {
     if (hide_main && editor.cursor.x == cursor.x && editor.cursor.y == cursor.y) return;
+    if (!viewport_contains(cursor.y)) return;
     size_t screen_y = cursor.y - editor.offset;
-    if (screen_y >= win_main.height) return;
 
     wmove(win_main.win, screen_y, cursor.x);
     wattrset(win_main.win, A_REVERSE); {
@@ -2613,6 +6888,25 @@ void update_window_main(void)
         }
         wprintw(win_main.win, S_FMT"\n", S_ARG(ROW(i)->content));
     }
+    Cursor begin, end;
+    MatchIndex *index = &editor.search.index;
+    for (size_t y = editor.offset; index->is_enabled && y < editor.offset+win_main.height && y < index->count; y++) {
+        if (!match_index_row_is_valid(y)) continue;
+        da_foreach (index->items[y], RowMatch, match)
+            mvwchgat(win_main.win, y-editor.offset, match->col, match->len, A_UNDERLINE, DEFAULT_EDITOR_PAIR, NULL);
+    }
+    if (editor.search.has_match && viewport_contains(editor.search.match.y)) {
+        Cursor match = editor.search.match;
+        mvwchgat(win_main.win, match.y-editor.offset, match.x, editor.search.match_len, A_UNDERLINE | A_BOLD, DEFAULT_EDITOR_PAIR, NULL);
+    }
+    if (selection_get_range(&begin, &end)) {
+        size_t first = begin.y > editor.offset ? begin.y : editor.offset;
+        for (size_t y = first; y <= end.y && y < editor.offset+win_main.height; y++) {
+            size_t from = y == begin.y ? begin.x : 0;
+            size_t to   = y == end.y   ? end.x   : ROW(y)->content.count+1; // NOTE: the newline is one cell
+            if (to > from) mvwchgat(win_main.win, y-editor.offset, from, to-from, A_REVERSE, DEFAULT_EDITOR_PAIR, NULL);
+        }
+    }
     if (editor.in_cmd) {
         show_ghost_cursor(editor.cursor, !HIDE_MAIN);
         if (editor.multicursor.is_enabled)
@@ -2638,13 +6932,26 @@ void update_window_line_numbers(void)
 
 void update_window_message(void)
 {
-    waddstr(win_message.win, cs_get_current(editor.messages));
+    if (messages_is_empty()) return;
+    Message *message = messages_get(editor.messages.age);
+    waddstr(win_message.win, message->text);
+    if (message->repeats > 1) wprintw(win_message.win, " (x%zu)", message->repeats);
+    if (editor.messages.age > 0) wprintw(win_message.win, " [%zu/%zu]", editor.messages.age+1, messages_stored());
 }
 
 void update_window_command(void)
 {
-    waddstr(win_command.win, "Command: ");
+    waddstr(win_command.win, prompt_label());
     wprintw(win_command.win, S_FMT, S_ARG(editor.cmd));
+    if (editor.prompt == PROMPT_HISTORY) {
+        const HistoryEntry *found = history_found();
+        if (found) wprintw(win_command.win, "  -> %.*s", (int)found->len, found->text);
+        else if (editor.cmd.count > 0) waddstr(win_command.win, "  (no match)");
+    } else if (completion.is_cycling) {
+        size_t shown = completion.next > completion.lo ? completion.next-1 : completion.hi-1;
+        wprintw(win_command.win, "  [%zu/%zu %s]", shown-completion.lo+1, completion.hi-completion.lo,
+                completion_kind_names[completion.sorted.items[shown].kind]);
+    }
 }
 
 void update_window_status(void)
@@ -2667,13 +6974,36 @@ void update_window_status(void)
     waddch(win_status.win, ' ');
     wprintw(win_status.win, "(%s)", perc_buf);
     wprintw(win_status.win, " | ");
-    wprintw(win_status.win, "page %zu/%zu", editor.page+1, N_PAGES);
-    wprintw(win_status.win, " | ");
-    wprintw(win_status.win, "page %zu/%zu", editor.page+1, N_PAGES);
+    wprintw(win_status.win, "page %zu/%zu", viewport_page()+1, viewport_pages_count());
     if (editor_is_expanding_snippet()) {
         wprintw(win_status.win, " | ");
         wprintw(win_status.win, "expanding snippet `%s`", editor.expanding_snippet.snippet->handle);
     }
+    if (editor.search.is_scanning) {
+        wprintw(win_status.win, " | ");
+        wprintw(win_status.win, "searching...");
+    } else if (editor.search.index.is_enabled) {
+        size_t total = editor.search.index.total;
+        size_t position = match_index_position();
+        wprintw(win_status.win, " | ");
+        if (!match_index_is_complete()) wprintw(win_status.win, "%zu+ matches", total);
+        else if (position > 0) wprintw(win_status.win, "match %zu of %zu", position, total);
+        else wprintw(win_status.win, "%zu match%s", total, total == 1 ? "" : "es");
+    } else if (editor.in_cmd && editor.prompt == PROMPT_SEARCH && editor.search.is_invalid) {
+        wprintw(win_status.win, " | ");
+        wprintw(win_status.win, "invalid pattern");
+    } else if (editor.in_cmd && editor.prompt == PROMPT_SEARCH && editor.search.pattern.count > 0 && !editor.search.has_match) {
+        wprintw(win_status.win, " | ");
+        wprintw(win_status.win, "no match");
+    }
+    if (editor.selection.is_active) {
+        wprintw(win_status.win, " | ");
+        wprintw(win_status.win, "SELECT");
+    }
+    if (editor.is_choosing_register || editor.current_register != UNNAMED_REGISTER) {
+        wprintw(win_status.win, " | ");
+        wprintw(win_status.win, "\"%c", editor.is_choosing_register ? '?' : register_name(editor.current_register));
+    }
     if (editor.N != N_DEFAULT) {
         wprintw(win_status.win, " | ");
         wprintw(win_status.win, "%d", editor.N);
@@ -2861,13 +7191,13 @@ void update_windows(void)
 
 void update_cursor(void)
 {
-    size_t cy = editor.cursor.y;
+    size_t cy = editor.cursor.y - editor.offset;
     size_t cx = editor.cursor.x;
     WINDOW *win = win_main.win;
 
     if (editor.in_cmd) {
         cy = win_command.start_y;
-        cx = strlen("Command: ") + editor.cmd_pos;
+        cx = strlen(prompt_label()) + editor.cmd_pos;
         win = win_command.win;
     }
 
@@ -2882,7 +7212,7 @@ void handle_sigwinch(int signo)
     destroy_windows();
     create_windows();
     
-    if (editor.cursor.y >= win_main.height) editor.cursor.y = win_main.height - 1;
+    viewport_follow_cursor();
     if (editor.cursor.x >= win_main.width) editor.cursor.x = win_main.width - 1;
 }
 
@@ -2891,15 +7221,20 @@ void editor_init()
     get_screen_size();
     editor.current_quit_times = editor.config.quit_times;
     editor.N = N_DEFAULT;
+    editor.current_register = UNNAMED_REGISTER;
 
     signal(SIGWINCH, handle_sigwinch);
 }
 
 bool open_file(char *filepath)
 {
+    mem_scope(MEM_ROWS);
     if (editor.filepath) free(editor.filepath);
     if (editor.filename) free(editor.filename);
+    buffer_before_edit(0);
     da_clear(&editor.rows);
+    match_index_reset();
+    anchors_collapse(&editor.anchors);
 
     if (filepath == NULL) {
         editor.filepath = NULL;
@@ -2924,61 +7259,45 @@ bool open_file(char *filepath)
         s_push_str(&row.content, line, res-1);
         da_push(&editor.rows, row);
     }
-    free(line);
+    (free)(line); // NOTE: allocated by getline, see Memory
+    match_index_reset();
     if (errno) return false;
 
-    // TODO: set cursor (0,0)
-    editor.cursor.x = 0;
+    editor.cursor = (Cursor){0};
+    editor.offset = 0;
 
     return true;
 }
 
-void scroll_up() // TODO: cy va oltre
-{ 
-    if (editor.offset > 0) {
-        editor.offset--;
-        move_cursor_down();
-    } else editor.offset = 0;
-}
+void scroll_up(size_t n) { viewport_scroll(-(long)n); }
 
-void scroll_down() // TODO: cy fa cose strane
-{
-    if (editor.offset < editor.rows.count - 1) {
-        editor.offset++;
-        move_cursor_up();
-    } else editor.offset = editor.rows.count-1;
-}
+void scroll_down(size_t n) { viewport_scroll(n); }
 
-void move_page_up() // TODO: non funziona benissimo
+/* The cursor keeps its row on screen, unless the view reaches the end of the buffer */
+void move_page_up(size_t n)
 {
-    if (editor.page > 0) editor.page--;
-    else editor.page = 0;
-    editor.offset = editor.page*win_main.height + editor.cursor.y;
+    size_t rows = n*viewport_height();
+    size_t screen_y = editor.cursor.y - editor.offset;
+    viewport_set_offset(editor.offset > rows ? editor.offset-rows : 0);
+    move_cursor_to(editor.offset+screen_y, editor.cursor.x);
 }             
 
-void move_page_down() // TODO: non funziona benissimo
+void move_page_down(size_t n)
 {
-    if (editor.page < N_PAGES-2) editor.page++;
-    else editor.page = N_PAGES-1;
-    editor.offset = editor.page*win_main.height + editor.cursor.y;
+    size_t screen_y = editor.cursor.y - editor.offset;
+    viewport_set_offset(editor.offset + n*viewport_height());
+    move_cursor_to(editor.offset+screen_y, editor.cursor.x);
 }           
 
-static inline void move_cursor_begin_of_screen() { editor.cursor.y = 0; }
+static inline void move_cursor_begin_of_screen() { move_cursor_to(editor.offset, editor.cursor.x); }
 
-static inline void move_cursor_end_of_screen() { editor.cursor.y = win_main.height-1; }
+static inline void move_cursor_end_of_screen() { move_cursor_to(viewport_last_row(), editor.cursor.x); }
 
-void move_cursor_begin_of_file()
-{
-    editor.page = 0;
-    editor.offset = 0;
-    editor.cursor.y = 0;
-}     
+static inline void move_cursor_begin_of_file() { move_cursor_to(0, editor.cursor.x); }
 
-void move_cursor_end_of_file() 
+static inline void move_cursor_end_of_file()
 {
-    editor.page = N_PAGES-1;
-    editor.offset = editor.rows.count-win_main.height;
-    editor.cursor.y = win_main.height-1;
+    move_cursor_to(editor.rows.count > 0 ? editor.rows.count-1 : 0, editor.cursor.x);
 }
 
 static inline void move_cursor_begin_of_line() { editor.cursor.x = 0; }
@@ -3023,37 +7342,70 @@ void itoa(int n, char *buf)
     for (int i = 0; i < len; i++) buf[i] = tmp[len-i-1];
 }
 
-void execute_command(Command *cmd, CommandArgs *runtime_args)
+/* NOTE: the arguments of every call live on this stack, so running a command allocates nothing */
+#define VM_STACK_SIZE 1024
+static CommandArg vm_stack[VM_STACK_SIZE];
+static size_t vm_stack_count = 0;
+
+bool vm_run(Instructions *code, CommandArg *frame, size_t frame_count)
 {
-    log_this("Executing command `%s`", cmd->name);
-    da_foreach (cmd->subcmds, Command, subcmd) {
-        log_this(" - %s", subcmd->name);
-    }
+    da_foreach (*code, Instruction, instruction) {
+        size_t saved_count = vm_stack_count;
+        CommandArg *args = frame;
+        size_t args_count = frame_count;
+        if (!instruction->forwards_args) {
+            if (vm_stack_count + instruction->args_count > VM_STACK_SIZE) {
+                write_message("ERROR: too many nested arguments running `%s`", instruction->cmd->name);
+                return false;
+            }
+            args = vm_stack + vm_stack_count;
+            args_count = instruction->args_count;
+            for (size_t i = 0; i < args_count; i++) {
+                CommandArg *arg = &instruction->args[i];
+                if (arg->type == PISQUY_ARG_PLACEHOLDER) {
+                    if (arg->placeholder_index >= frame_count) {
+                        write_message("ERROR: missing argument $%zu for `%s`", arg->placeholder_index, instruction->cmd->name);
+                        vm_stack_count = saved_count;
+                        return false;
+                    }
+                    vm_stack[vm_stack_count++] = frame[arg->placeholder_index];
+                } else vm_stack[vm_stack_count++] = *arg;
+            }
+        }
 
-    if (is_command_type_builtin(cmd->type)) {
-        CommandArgs final_args = {0}; // TODO: maybe it can be just an array
-        for (size_t i = 0; i < cmd->baked_args.count; i++) {
-            log_this("baked argument %zu", i);
-            CommandArg arg = cmd->baked_args.items[i];
-            if (arg.type == PISQUY_ARG_PLACEHOLDER) {
-                if (runtime_args && arg.placeholder_index < runtime_args->count) {
-                    da_push(&final_args, runtime_args->items[arg.placeholder_index]);
-                } else {
-                    write_message("ERROR: Missing argument $%zu for %s", arg.index, cmd->name);
-                    log_this("ERROR: Missing argument $%zu for %s", arg.index, cmd->name);
-                    return; 
-                }
-            } else da_push(&final_args, arg);
+        bool ok = true;
+        if (instruction->execute) {
+            CommandArgs view = { .items = args, .count = args_count, .capacity = args_count };
+            instruction->execute(instruction->cmd, &view); // NOTE: builtins apply cmd->n by themselves
+        } else {
+            Command *definition = get_command(instruction->type);
+            for (size_t i = 0; i < instruction->n && ok; i++) ok = vm_run(&definition->code, args, args_count);
         }
-        if (cmd->baked_args.count == 0 && runtime_args)
-            da_push_many(&final_args, cmd->baked_args.items, cmd->baked_args.count);
-        assert(cmd->execute);
+        vm_stack_count = saved_count;
+        if (!ok) return false;
+    }
+    return true;
+}
+
+void execute_command(Command *cmd, CommandArgs *runtime_args)
+{
+    CommandArg *frame = runtime_args ? runtime_args->items : NULL;
+    size_t frame_count = runtime_args ? runtime_args->count : 0;
+
+    if (cmd->type == COMMAND_FROM_LINE) {
+        Instructions code = {0};
+        compile_command(cmd, &code);
+        vm_run(&code, frame, frame_count);
+        da_free(&code);
+    } else if (is_command_type_user_defined(cmd->type)) {
+        Command *definition = get_command(cmd->type);
         for (size_t i = 0; i < cmd->n; i++)
-            cmd->execute(cmd, &final_args);
-        if (final_args.count > 0) free(final_args.items);
-    } else if (cmd->type == COMMAND_FROM_LINE || is_command_type_user_defined(cmd->type)) {
-        da_foreach(cmd->subcmds, Command, subcmd)
-            execute_command(subcmd, runtime_args);
+            if (!vm_run(&definition->code, frame, frame_count)) break;
+    } else if (is_command_type_builtin(cmd->type)) {
+        Command *builtin = get_command(cmd->type);
+        CommandArgs no_args = {0};
+        assert(builtin->execute);
+        builtin->execute(cmd, runtime_args ? runtime_args : &no_args);
     } else if (cmd->type == UNKNOWN) {
         write_message("Unknown command `%s`", cmd->name);
     } else {
@@ -3087,6 +7439,8 @@ void delete_char_internal()
     size_t x = CURRENT_X_POS;
     Row *row = (y >= editor.rows.count) ? NULL : CURRENT_ROW;
     if (!row || (x == 0 && y == 0)) return;
+    buffer_before_edit(x == 0 ? y-1 : y);
+    mem_scope(MEM_ROWS);
     if (x == 0) {
         /* Handle the case of column 0, we need to move the current line
          * on the right of the previous one. */
@@ -3094,8 +7448,10 @@ void delete_char_internal()
         x = prev->content.count;
         s_push_str(&prev->content, row->content.items, row->content.count);
         da_remove(&editor.rows, y);
-        if (editor.cursor.y == 0) editor.offset--;
-        else editor.cursor.y--;
+        match_index_rows_changed(y-1, 1);
+        match_index_rows_removed(y, 1);
+        anchors_splice(&editor.anchors, (Cursor){ .x = x, .y = y-1 }, (Cursor){ .x = 0, .y = y }, (Cursor){ .x = x, .y = y-1 });
+        editor.cursor.y--;
         editor.cursor.x = x;
         if (editor.cursor.x >= win_main.width) {
             int shift = (win_main.width-editor.cursor.x)+1;
@@ -3103,6 +7459,8 @@ void delete_char_internal()
         }
     } else {
         delete_char_at(row, x-1);
+        match_index_rows_changed(y, 1);
+        anchors_splice(&editor.anchors, (Cursor){ .x = x-1, .y = y }, (Cursor){ .x = x, .y = y }, (Cursor){ .x = x-1, .y = y });
         if (editor.cursor.x > 0) editor.cursor.x--;
     }
     editor.dirty++;
@@ -3112,40 +7470,21 @@ void delete_char(void)
 {
     if (!editor.multicursor.is_enabled || editor.in_cmd) {
         delete_char_internal();
+        if (!editor.in_cmd) viewport_follow_cursor();
         return;
     }
 
-    Cursor saved_main = editor.cursor;
-
-    for (size_t i = 0; i < editor.sorted_multicursor.count; i++) {
-        Cursor *current = editor.sorted_multicursor.items[i];
-        editor.cursor = (current == &editor.cursor) ? saved_main : *current;
+    AnchorIds anchors = multicursor_anchor();
+    da_foreach (anchors, AnchorId, id) {
+        editor.cursor = anchor_get(&editor.anchors, *id);
         delete_char_internal();
-        if (current == &editor.cursor) saved_main = editor.cursor;
-        else {
-            *current = editor.cursor;
-            editor.cursor = saved_main;
-        }
-
-        // Shift Adjustment for Deletion
-        for (size_t j = 0; j < i; j++) {
-            Cursor *processed = editor.sorted_multicursor.items[j];
-            // If we are on same line, shift left
-            if (processed->y == current->y && processed->x > 0) {
-                processed->x--;
-            }
-            // If we merged lines (deleted newline), shift rows up
-            // (Detection of line merge requires checking if row count changed, 
-            // which is tricky here without return values. 
-            // Basic implementation: Shift X left.)
-            if (processed == &editor.cursor) saved_main = *processed;
-        }
     }
-    editor.cursor = saved_main;
+    multicursor_release(&anchors);
+    viewport_follow_cursor();
 }
 
 // TODO: non funziona
-void delete_word()
+void delete_word_internal()
 {
     if (editor.in_cmd) {
         if (isspace(editor.cmd.items[editor.cmd_pos])) {
@@ -3166,6 +7505,8 @@ void delete_word()
     if (y >= editor.rows.count) return;
     size_t x = CURRENT_X_POS;
     if (x == 0 && y == 0) return;
+    buffer_before_edit(y);
+    match_index_rows_changed(y, 1);
     Row *row = CURRENT_ROW;
     if (isspace(CHAR(CURRENT_Y_POS, x))) {
         while (x > 0 && isspace(CHAR(CURRENT_Y_POS, x))) {
@@ -3178,10 +7519,106 @@ void delete_word()
             x--;
         }
     }
+    Cursor begin = { .x = x, .y = y };
+    anchors_splice(&editor.anchors, begin, editor.cursor, begin);
     editor.cursor.x = x;
     editor.dirty++;
 }
 
+void delete_word(size_t n)
+{
+    for (size_t i = 0; i < n; i++) delete_word_internal();
+}
+
+/* Deletes the text between begin (included) and end (excluded) with a single
+ * splice of the first and last row. Both positions must be already clamped. */
+void delete_range(Cursor begin, Cursor end)
+{
+    mem_scope(MEM_ROWS);
+    if (!position_is_before(begin, end)) return;
+    buffer_before_edit(begin.y);
+    match_index_rows_changed(begin.y, 1);
+
+    Row *first = ROW(begin.y);
+    if (begin.y == end.y) {
+        memmove(first->content.items+begin.x, first->content.items+end.x, first->content.count-end.x);
+        first->content.count -= end.x-begin.x;
+    } else {
+        Row *last = ROW(end.y);
+        first->content.count = begin.x;
+        s_push_str(&first->content, last->content.items+end.x, last->content.count-end.x);
+        rows_remove(begin.y+1, end.y-begin.y);
+    }
+    anchors_splice(&editor.anchors, begin, end, begin);
+    move_cursor_to(begin.y, begin.x);
+    editor.dirty++;
+}
+
+/* Deletes the n characters before the cursor (newlines count as one) with a single delete_range */
+void delete_chars(size_t n)
+{
+    size_t y = CURRENT_Y_POS;
+    bool is_bulk = n > 1 && !editor.in_cmd && !editor.multicursor.is_enabled
+                && y < editor.rows.count && CURRENT_X_POS <= ROW(y)->content.count;
+    if (!is_bulk) {
+        // NOTE: multicursor deletions still go through the per char path to keep the marks in place
+        for (size_t i = 0; i < n; i++) delete_char();
+        return;
+    }
+
+    Cursor end = { .x = CURRENT_X_POS, .y = y };
+    Cursor begin = end;
+    while (n > 0 && (begin.x > 0 || begin.y > 0)) {
+        if (begin.x >= n) {
+            begin.x -= n;
+            n = 0;
+        } else {
+            n -= begin.x + 1;
+            begin.y--;
+            begin.x = ROW(begin.y)->content.count;
+        }
+    }
+    delete_range(begin, end);
+}
+
+void selection_yank(bool cut)
+{
+    Cursor begin, end;
+    if (!selection_get_range(&begin, &end)) {
+        write_message("Nothing is selected");
+        return;
+    }
+
+    int index = editor.current_register;
+    register_set_reference(&editor.registers[index], begin, end);
+    if (cut) delete_range(begin, end);
+    selection_stop();
+    editor.current_register = UNNAMED_REGISTER;
+
+    size_t lines = end.y - begin.y + 1;
+    write_message("%s %zu line%s into register `%c`", cut ? "Cut" : "Yanked",
+            lines, lines == 1 ? "" : "s", register_name(index));
+}
+
+void paste_register(void)
+{
+    int index = editor.current_register;
+    editor.current_register = UNNAMED_REGISTER;
+    Register *reg = &editor.registers[index];
+    if (register_is_empty(reg)) {
+        write_message("Register `%c` is empty", register_name(index));
+        return;
+    }
+
+    register_materialize(reg);
+    if (editor.selection.is_active) {
+        Cursor begin, end;
+        if (selection_get_range(&begin, &end)) delete_range(begin, end);
+        selection_stop();
+    }
+    insert_text(reg->text.items, reg->text.count);
+}
+
 bool set_N(int key)
 {
     int digit = key - ALT_0;
@@ -3195,6 +7632,18 @@ bool set_N(int key)
     return true;
 }
 
+static inline Cursor snippet_mark_position(Cursor base, SnippetMark *mark)
+{
+    return (Cursor){ .x = base.x + mark->cursor.x, .y = base.y + mark->cursor.y };
+}
+
+/* NOTE: the marks are anchored, so they are where they belong whatever has been typed before them */
+static inline Cursor expanding_snippet_mark(size_t expansion, size_t mark_index)
+{
+    size_t marks_count = editor.expanding_snippet.snippet->marks_count;
+    return anchor_get(&editor.anchors, editor.expanding_snippet.marks.items[expansion*marks_count + mark_index]);
+}
+
 void expanding_snippet_next_mark(void)
 {
     if (!editor_is_expanding_snippet()) return;
@@ -3204,128 +7653,201 @@ void expanding_snippet_next_mark(void)
 
     Snippet *snippet = editor.expanding_snippet.snippet;
     size_t mark_index = editor.expanding_snippet.mark_index + 1;
-    log_this("expanding_snippet_next_mark: %zu", mark_index);
     while (mark_index < snippet->marks_count && !snippet->marks[mark_index].is_primary)
         mark_index++;
-    log_this("skipped secondary marks");
     if (mark_index >= snippet->marks_count) {
-        log_this("finished expanding snippet");
-        editor.expanding_snippet.snippet = NULL;
-        editor.expanding_snippet.mark_index = -1;
+        log_debug("finished expanding snippet");
+        expanding_snippet_stop();
         disable_multicursor();
         return;
     }
 
-    SnippetMark mark = snippet->marks[mark_index];
-    log_this("Setting mark `%s` - %s - (%zu, %zu)", mark.name ? mark.name : "unnamed",
-            mark.is_primary ? "primary" : "secondary", mark.cursor.x, mark.cursor.y);
+    SnippetMark *mark = &snippet->marks[mark_index];
+    size_t expansions = editor.expanding_snippet.marks.count / snippet->marks_count;
     editor.expanding_snippet.mark_index = mark_index;
-    size_t indentation = editor.expanding_snippet.base_cursor.x;
-
-    Cursor absolute_cursor_from(Cursor relative_cursor)
-    {
-        return (Cursor){
-            .x = ((relative_cursor.y == 0) ? editor.expanding_snippet.base_cursor.x : indentation) + relative_cursor.x,
-            .y = editor.expanding_snippet.base_cursor.y + relative_cursor.y
-        };
-    }
-    editor.cursor = absolute_cursor_from(mark.cursor);
-    log_this("Set primary mark at (%zu, %zu)", editor.cursor.x, editor.cursor.y);
-
-    if (mark.name) {
+    editor.cursor = expanding_snippet_mark(0, mark_index);
+    viewport_follow_cursor();
+
+    /* NOTE: the other expansions get a cursor at the same mark, and
+     *       every expansion gets one at the marks with the same name */
+    for (size_t e = 1; e < expansions; e++)
+        da_push(&editor.multicursor, expanding_snippet_mark(e, mark_index));
+    if (mark->name) {
         for (size_t i = mark_index+1; i < snippet->marks_count; i++) {
             SnippetMark *candidate = &snippet->marks[i];
-            if (candidate->name && streq(candidate->name, mark.name)) {
-                Cursor candidate_absolute_cursor = absolute_cursor_from(candidate->cursor);
-                log_this("Set secondary mark at (%zu, %zu)", candidate_absolute_cursor.x, candidate_absolute_cursor.y);
-                da_push(&editor.multicursor, candidate_absolute_cursor);
-            }
+            if (!candidate->name || !streq(candidate->name, mark->name)) continue;
+            for (size_t e = 0; e < expansions; e++)
+                da_push(&editor.multicursor, expanding_snippet_mark(e, i));
         }
     }
 
     if (!da_is_empty(&editor.multicursor)) enable_multicursor();
 }
 
+/* Text of the snippet expanded at column indentation */
+void snippet_render(Snippet *snippet, size_t indentation, String *out)
+{
+    static const char spaces[64] = "                                                                ";
+    for (size_t l = 0; l < snippet->lines_count; l++) {
+        SnippetLine *line = &snippet->lines[l];
+        if (l > 0) s_push(out, '\n');
+        for (size_t n = l > 0 && line->is_indented ? indentation : 0; n > 0;) {
+            size_t chunk = n < sizeof(spaces) ? n : sizeof(spaces);
+            s_push_str(out, spaces, chunk);
+            n -= chunk;
+        }
+        if (line->len > 0) s_push_str(out, snippet->body+line->offset, line->len);
+    }
+}
+
+static Snippet *snippet_before(Cursor pos)
+{
+    if (pos.y >= editor.rows.count || pos.x > ROW(pos.y)->content.count) return NULL;
+    return snippet_trie_find(&editor.snippet_trie, LINE(pos.y), pos.x, false);
+}
+
+static bool snippet_handle_ends_at(Snippet *snippet, Cursor pos)
+{
+    if (pos.y >= editor.rows.count || pos.x > ROW(pos.y)->content.count || pos.x < snippet->handle_len) return false;
+    return memcmp(LINE(pos.y)+pos.x-snippet->handle_len, snippet->handle, snippet->handle_len) == 0;
+}
+
+void expand_snippet(Snippet *snippet_to_expand);
+/* NOTE: the handle before the cursor is replaced with the whole snippet at once, and so
+ *       at the other cursors where the same handle was typed. Then the first mark is set. */
 void try_to_expand_snippet(void)
 {
-    Snippet *snippet_to_expand = NULL;
-    da_foreach (editor.snippets, Snippet, snippet) {
-        if (editor.in_cmd && !snippet->is_inline) continue; // NOTE: cannot expand non inline snippets in command line
-        if (CURRENT_X_POS < snippet->handle_len) continue;
-        assert(snippet->handle);
-        size_t i = 0;
-        bool matches = true;
-        while (i < snippet->handle_len) {
-            char snippet_char = snippet->handle[snippet->handle_len-i-1];
-            char current_char = CHAR(CURRENT_Y_POS, CURRENT_X_POS-i-1);
-            if (snippet_char != current_char) {
-                matches = false;
-                break;
-            }
-            i++;
+    if (editor.in_cmd) { // NOTE: only inline snippets in the command line, and marks are not followed
+        Snippet *snippet = snippet_trie_find(&editor.snippet_trie, editor.cmd.items, editor.cmd_pos, true);
+        if (!snippet) {
+            write_message("ERROR: no snippet handle found");
+            return;
         }
-        if (matches && (!snippet_to_expand || snippet->handle_len > snippet_to_expand->handle_len))
-            snippet_to_expand = snippet;
+        size_t at = editor.cmd_pos - snippet->handle_len;
+        memmove(editor.cmd.items+at, editor.cmd.items+editor.cmd_pos, editor.cmd.count-editor.cmd_pos);
+        editor.cmd.count -= snippet->handle_len;
+        string_insert_str(&editor.cmd, at, snippet->body, snippet->body_len);
+        editor.cmd_pos = at + snippet->body_len;
+        return;
     }
+
+    Snippet *snippet_to_expand = snippet_before(editor.cursor);
     if (!snippet_to_expand) {
         write_message("ERROR: no snippet handle found");
         return;
     }
+    expand_snippet(snippet_to_expand);
+}
 
-    log_this("Expanding snippet: '%s' (%zu - %s) -> '%s'", snippet_to_expand->handle, snippet_to_expand->handle_len,
-            BOOL_AS_CSTR(snippet_to_expand->is_inline), snippet_to_expand->body);
-
-    char *body = snippet_to_expand->body;
-    if (snippet_to_expand->handle_is_prefix) {
-        body += snippet_to_expand->handle_len;
-    } else {
-        for (size_t i = 0; i < snippet_to_expand->handle_len; i++) delete_char();
+/// BEGIN Auto snippets
+
+static inline bool is_word_char(char c) { return isalnum(c) || c == '_'; }
+
+/* Typed text is fed to the automaton as it is inserted: a handle completed
+ * at the cursor is expanded, unless it is just the end of a longer word */
+void auto_snippet_after_insert(char c, size_t n)
+{
+    if (!editor.config.auto_snippets || editor.in_cmd || editor_is_expanding_snippet()) return;
+    SnippetTrie *automaton = &editor.snippet_automaton;
+    if (automaton->count == 0) return;
+
+    Cursor before = { .x = editor.cursor.x - (editor.cursor.x >= n ? n : editor.cursor.x), .y = editor.cursor.y };
+    bool is_stale = editor.auto_snippet.cursor.x != before.x || editor.auto_snippet.cursor.y != before.y
+                 || editor.auto_snippet.dirty+(int)n != editor.dirty;
+    int state = is_stale ? 0 : editor.auto_snippet.state;
+    if (is_stale) {
+        // NOTE: handles are at most max_depth long, so the tail of the line gives the same state as the whole line
+        size_t x = editor.cursor.x;
+        for (size_t i = x > automaton->max_depth ? x-automaton->max_depth : 0; i < x; i++)
+            state = snippet_automaton_next(automaton, state, LINE(editor.cursor.y)[i]);
+    } else for (size_t i = 0; i < n; i++) state = snippet_automaton_next(automaton, state, c);
+
+    editor.auto_snippet.state = state;
+    editor.auto_snippet.cursor = editor.cursor;
+    editor.auto_snippet.dirty = editor.dirty;
+
+    for (int node = automaton->items[state].output; node >= 0; node = automaton->items[automaton->items[node].fail].output) {
+        Snippet *snippet = &editor.snippets.items[automaton->items[node].snippet];
+        size_t start = editor.cursor.x - snippet->handle_len;
+        if (start > 0 && is_word_char(snippet->handle[0]) && is_word_char(LINE(editor.cursor.y)[start-1])) continue;
+        expand_snippet(snippet);
+        editor.auto_snippet.dirty = -1;
+        break;
     }
+}
 
-    editor.expanding_snippet.base_cursor.x = CURRENT_X_POS - snippet_to_expand->handle_len;
-    editor.expanding_snippet.base_cursor.y = CURRENT_Y_POS;
+/// END Auto snippets
 
-    if (snippet_to_expand->is_inline) insert_cstr(body); 
-    else {
-        // TODO: it should check for tabs
-        size_t indentation = CURRENT_X_POS - (snippet_to_expand->handle_is_prefix ? snippet_to_expand->handle_len : 0);
-        char *current = body;
-        char *next_newline = NULL;
-        while (current) {
-            next_newline = strchr(current, '\n');
-            if (next_newline) *next_newline = '\0';
-            if (current != body && *current)
-                // TODO: it may insert a tab based on indentation size and config
-                for (size_t i = 0; i < indentation; i++) insert_char(' ');
-            insert_cstr(current);
-            if (next_newline) {
-                insert_char('\n');
-                current = next_newline + 1;
-            } else current = NULL;
-        }
-    }
+void expand_snippet(Snippet *snippet_to_expand)
+{
+    log_debug("Expanding snippet: '%s' (%zu - %s) -> '%s'", snippet_to_expand->handle, snippet_to_expand->handle_len,
+            BOOL_AS_CSTR(snippet_to_expand->is_inline), snippet_to_expand->body);
 
+    CursorPtrs targets = {0};
+    if (editor.multicursor.is_enabled) {
+        sort_multicursor(); // NOTE: from the last cursor to the first, so an expansion never moves the ones left to do
+        da_foreach (editor.sorted_multicursor, Cursor *, cursor) da_push(&targets, *cursor);
+    } else da_push(&targets, &editor.cursor);
+
+    // NOTE: every splice moves the main cursor, so the cursors and the expansions are anchored
+    AnchorIds positions = {0};
+    da_foreach (targets, Cursor *, target) da_push(&positions, anchor_add(&editor.anchors, **target));
+
+    AnchorIds bases = {0};
+    String text = {0};
+    size_t main_index = 0;
+    da_enumerate (positions, AnchorId, i, id) {
+        Cursor pos = anchor_get(&editor.anchors, *id);
+        if (!snippet_handle_ends_at(snippet_to_expand, pos)) continue;
+
+        Cursor base = { .x = pos.x - snippet_to_expand->handle_len, .y = pos.y };
+        s_clear(&text);
+        snippet_render(snippet_to_expand, base.x, &text);
+        delete_range(base, pos);
+        insert_text_internal(text.items, text.count);
+        if (targets.items[i] == &editor.cursor) main_index = bases.count;
+        da_push(&bases, anchor_add(&editor.anchors, base));
+    }
+    da_enumerate (targets, Cursor *, i, target) **target = anchor_get(&editor.anchors, positions.items[i]);
+    viewport_follow_cursor();
 
     if (snippet_to_expand->marks_count > 0) {
-        log_this("\nMarks:");
-        for (size_t i = 0; i < snippet_to_expand->marks_count; i++) {
-            SnippetMark *m = &snippet_to_expand->marks[i];
-            log_this("Mark `%s` - %s - (%zu, %zu)", m->name ? m->name : "unnamed",
-                    m->is_primary ? "primary" : "secondary", m->cursor.x, m->cursor.y);
+        expanding_snippet_stop();
+        for (size_t n = 0; n < bases.count; n++) {
+            size_t b = n == 0 ? main_index : (n <= main_index ? n-1 : n); // NOTE: the main expansion first
+            Cursor base = anchor_get(&editor.anchors, bases.items[b]);
+            for (size_t m = 0; m < snippet_to_expand->marks_count; m++)
+                da_push(&editor.expanding_snippet.marks,
+                        anchor_add(&editor.anchors, snippet_mark_position(base, &snippet_to_expand->marks[m])));
         }
-        log_this("\n");
         editor.expanding_snippet.snippet = snippet_to_expand;
-        editor.expanding_snippet.mark_index = -1;
         expanding_snippet_next_mark();
     }
+
+    anchors_remove_all(&editor.anchors, &positions);
+    anchors_remove_all(&editor.anchors, &bases);
+    da_free(&positions);
+    da_free(&bases);
+    da_free(&targets);
+    s_free(&text);
 }
 
 void process_pressed_key(void)
 {
     int key = read_key();
     if (key == ERR) return;
+    frame_stats_key_read();
+
+    if (editor.is_choosing_register) {
+        editor.is_choosing_register = false;
+        int index = register_index_from_char(key);
+        if (index == -1) write_message("ERROR: invalid register name, use a-z, 0-9 or \"");
+        else editor.current_register = index;
+        return;
+    }
 
     bool has_inserted_number = false;
+    if (key != TAB) completion.is_cycling = false;
 
     switch (key)
     {
@@ -3343,16 +7865,19 @@ void process_pressed_key(void)
             break;
 
         case KEY_UP:
-        case ALT_k: N_TIMES move_cursor_up();    break;
+        case ALT_k: move_cursor_up(N_OR_DEFAULT(1));    break;
 
         case KEY_DOWN:
-        case ALT_j: N_TIMES move_cursor_down();  break;
+        case ALT_j: move_cursor_down(N_OR_DEFAULT(1));  break;
 
         case KEY_LEFT:
-        case ALT_h: N_TIMES move_cursor_left();  break;
+        case ALT_h: move_cursor_left(N_OR_DEFAULT(1));  break;
 
         case KEY_RIGHT:
-        case ALT_l: N_TIMES move_cursor_right(); break;
+        case ALT_l: move_cursor_right(N_OR_DEFAULT(1)); break;
+
+        case ALT_g: goto_line(N_OR_DEFAULT(1)); break;
+        case ALT_G: move_cursor_end_of_file();   break;
 
         case ALT_K: move_cursor_begin_of_screen(); break;
         case ALT_J: move_cursor_end_of_screen();   break;
@@ -3360,46 +7885,47 @@ void process_pressed_key(void)
         case ALT_L: move_cursor_last_non_space();  break;
 
         case ALT_m:
-            if (!cs_is_empty(editor.messages)) {
-                    editor.is_showing_message = !editor.is_showing_message;
-            }
+            if (editor.is_showing_message) editor.is_showing_message = false;
+            else messages_show();
             break;
 
         case ALT_p:
-            if (editor.in_cmd) {
-                char *previous_command = cs_previous(&editor.commands_history);
-                size_t len = strlen(previous_command);
-                s_clear(&editor.cmd);
-                s_push_str(&editor.cmd, previous_command, len);
-                editor.cmd_pos = len;
-            } else cs_previous(&editor.messages);
+            if (editor.in_cmd && editor.prompt != PROMPT_COMMAND) break;
+            if (editor.in_cmd) history_browse(-1);
+            else messages_previous();
             break;
 
         case ALT_n:
-            if (editor.in_cmd) {
-                char *next_command = cs_next(&editor.commands_history);
-                size_t len = strlen(next_command);
-                s_clear(&editor.cmd);
-                s_push_str(&editor.cmd, next_command, len);
-                editor.cmd_pos = len;
-            } else cs_next(&editor.messages);
+            if (editor.in_cmd && editor.prompt != PROMPT_COMMAND) break;
+            if (editor.in_cmd) history_browse(+1);
+            else messages_next();
+            break;
+
+        case ALT_v:
+            if (editor.selection.is_active) selection_stop();
+            else selection_start();
             break;
 
+        case ALT_QUOTE: if (!editor.in_cmd) editor.is_choosing_register = true; break;
+        case ALT_y: selection_yank(false); break;
+        case ALT_x: selection_yank(true); break;
+        case ALT_P: if (!editor.in_cmd) paste_register(); break;
+
         case ALT_c: add_multicursor_mark(); break;
         case ALT_C: enable_multicursor(); break;
         case CTRL_ALT_C: disable_multicursor(); break;
 
-        case CTRL_K: N_TIMES scroll_up();   break;
-        case CTRL_J: N_TIMES scroll_down(); break;
+        case CTRL_K: scroll_up(N_OR_DEFAULT(1));   break;
+        case CTRL_J: scroll_down(N_OR_DEFAULT(1)); break;
 
         //case CTRL_H: write_message("TODO: CTRL-H"); break;
         //case CTRL_L: write_message("TODO: CTRL-L"); break;
 
         case KEY_PPAGE:
-        case CTRL_ALT_K: N_TIMES move_page_up(); break; 
+        case CTRL_ALT_K: move_page_up(N_OR_DEFAULT(1)); break; 
 
         case KEY_NPAGE:
-        case CTRL_ALT_J: N_TIMES move_page_down(); break;
+        case CTRL_ALT_J: move_page_down(N_OR_DEFAULT(1)); break;
 
         //case ALT_h: write_message("TODO: ALT-h"); break;
         //case ALT_l: write_message("TODO: ALT-l"); break;
@@ -3409,19 +7935,33 @@ void process_pressed_key(void)
         //case ALT_H: move_cursor_begin_of_line(); break;
         //case ALT_L: move_cursor_end_of_line();   break; 
 
-        case ALT_COLON: editor.in_cmd = true; break;
-        case ALT_BACKSPACE: N_TIMES delete_word(); break;
+        case ALT_COLON:
+            if (!editor.in_cmd) {
+                editor.in_cmd = true;
+                editor.prompt = PROMPT_COMMAND;
+                history.browsed = HISTORY_NO_ENTRY;
+            }
+            break;
+        case CTRL_R:
+            if (editor.in_cmd && editor.prompt == PROMPT_HISTORY) history_search_older();
+            else if (!editor.in_cmd || editor.prompt == PROMPT_COMMAND) {
+                editor.in_cmd = true;
+                editor.prompt = PROMPT_COMMAND;
+                history_search_open();
+            }
+            break;
+        case ALT_SLASH: search_open_prompt(false); break;
+        case ALT_QUESTION_MARK: search_open_prompt(true); break;
+        case CTRL_N: search_next(false); break;
+        case CTRL_P: search_next(true);  break;
+        case ALT_BACKSPACE: delete_word(N_OR_DEFAULT(1)); break;
 
         case TAB:
-            if (editor.in_cmd) {
-                // TODO: autocomplete command
-            } else {
-                N_TIMES {
-                    if (editor.config.tab_to_spaces) {
-                        for (size_t i = 0; i < editor.config.tab_spaces_number; i++)
-                            insert_char(' ');
-                    } else insert_char('\t');
-                }
+            if (editor.in_cmd) complete_command_line();
+            else {
+                if (editor.config.tab_to_spaces) {
+                    insert_char_n_times(' ', N_OR_DEFAULT(1)*editor.config.tab_spaces_number);
+                } else insert_char_n_times('\t', N_OR_DEFAULT(1));
             }
             break;
 
@@ -3431,7 +7971,7 @@ void process_pressed_key(void)
             break;
 
         case ENTER: // TODO: se si e' in_cmd si esegue execute_command (che fa anche il resto)
-            N_TIMES insert_char('\n');
+            insert_char_n_times('\n', editor.in_cmd ? 1 : N_OR_DEFAULT(1));
             break;
 
         case CTRL_Q:
@@ -3443,40 +7983,506 @@ void process_pressed_key(void)
             break;
 
         case KEY_BACKSPACE:
-            N_TIMES delete_char();
+            delete_chars(N_OR_DEFAULT(1));
             break;
 
         case ESC:
-            if (editor.in_cmd) {
-                s_push_null(&editor.cmd);
-                cs_push(&editor.commands_history, editor.cmd.items);
+            if (editor.in_cmd && editor.prompt == PROMPT_SEARCH) search_cancel();
+            else if (editor.in_cmd && editor.prompt == PROMPT_HISTORY) history_search_cancel();
+            else if (editor.in_cmd) { // NOTE: an aborted command does not go in the history
                 editor.in_cmd = false;
                 editor.cmd_pos = 0;
                 s_clear(&editor.cmd);
-            }
+            } else if (editor.selection.is_active) selection_stop();
+            else match_index_disable(); // NOTE: hides the highlighted matches, CTRL-N and CTRL-P bring them back
             break;
 
         default:
-            if (isprint(key)) N_TIMES insert_char(key);
+            if (isprint(key)) {
+                insert_char_n_times(key, N_OR_DEFAULT(1));
+                auto_snippet_after_insert(key, N_OR_DEFAULT(1));
+            }
             break;
     }
+    if (editor.in_cmd && editor.prompt == PROMPT_SEARCH) search_sync_with_prompt();
+    if (editor.in_cmd && editor.prompt == PROMPT_HISTORY) history_search_sync_with_prompt();
     if (!has_inserted_number) editor.N = N_DEFAULT;
     editor.current_quit_times = editor.config.quit_times;
 }
 
-int main(int argc, char **argv)
+/// BEGIN Headless
+
+/* With --headless the keys come from a script instead of the terminal, the screen is drawn on /dev/null and
+ * at the end of the script (or on quit) the buffer and the timing stats are written out. The config is the
+ * one given with --config or else the built-in defaults, nothing is written in the config directory.
+ *
+ * In the script every byte is a key, except newlines (ignored, to wrap long scripts) and these escapes:
+ *     \e ESC    \r ENTER    \n CTRL-J    \t TAB    \\ backslash    \^X CTRL-X    \xHH any byte
+ *     \. no key for one frame, e.g. `\e\.` is ESC alone and not the start of an ALT-X sequence
+ *     \<up> \<down> \<left> \<right> \<pgup> \<pgdn> \<btab> \<bs> */
+
+#define HEADLESS_NO_KEY ERR
+
+bool headless_parse_script(const char *script, Keys *keys)
+{
+    const struct { const char *name; int key; } named_keys[] = {
+        {"up", KEY_UP}, {"down", KEY_DOWN}, {"left", KEY_LEFT}, {"right", KEY_RIGHT},
+        {"pgup", KEY_PPAGE}, {"pgdn", KEY_NPAGE}, {"btab", KEY_BTAB}, {"bs", KEY_BACKSPACE},
+    };
+
+    for (const char *it = script; *it; it++) {
+        if (*it == '\n') continue;
+        if (*it != '\\') {
+            da_push(keys, (unsigned char)*it);
+            continue;
+        }
+        it++;
+        switch (*it)
+        {
+            case 'e':  da_push(keys, ESC);             break;
+            case 'r':  da_push(keys, '\r');            break;
+            case 'n':  da_push(keys, '\n');            break;
+            case 't':  da_push(keys, '\t');            break;
+            case '\\': da_push(keys, '\\');            break;
+            case '.':  da_push(keys, HEADLESS_NO_KEY); break;
+            case '^':
+                if (it[1] == '\0') return false;
+                it++;
+                da_push(keys, toupper((unsigned char)*it) & 0x1f);
+                break;
+            case 'x': {
+                unsigned value;
+                if (!isxdigit((unsigned char)it[1]) || !isxdigit((unsigned char)it[2]) || sscanf(it+1, "%2x", &value) != 1)
+                    return false;
+                da_push(keys, value);
+                it += 2;
+            } break;
+            case '<': {
+                const char *end = strchr(it, '>');
+                if (end == NULL) return false;
+                bool found = false;
+                for (size_t i = 0; i < sizeof(named_keys)/sizeof(named_keys[0]) && !found; i++) {
+                    if ((size_t)(end - it - 1) == strlen(named_keys[i].name) && strneq(it+1, named_keys[i].name, end - it - 1)) {
+                        da_push(keys, named_keys[i].key);
+                        found = true;
+                    }
+                }
+                if (!found) return false;
+                it = end;
+            } break;
+            default: return false;
+        }
+    }
+    return true;
+}
+
+int headless_next_key(void)
+{
+    if (headless.next >= headless.keys.count) return ERR;
+    return headless.keys.items[headless.next++];
+}
+
+static inline bool headless_is_done(void)
+{
+    return headless.next >= headless.keys.count && !editor.search.is_scanning;
+}
+
+_Noreturn void headless_finish(void)
+{
+    uint64_t elapsed_ns = monotonic_ns() - headless.begin_ns;
+
+    FILE *out = headless.output_path ? fopen(headless.output_path, "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: could not open `%s`: %s\n", headless.output_path, strerror(errno));
+        exit(1);
+    }
+    da_foreach(editor.rows, Row, row) {
+        fwrite(row->content.items, 1, row->content.count, out);
+        fputc('\n', out);
+    }
+    if (out != stdout) fclose(out);
+    else fflush(stdout);
+
+    double keys = frame_stats.keys ? frame_stats.keys : 1;
+    fprintf(stderr, "%zu keys in %.3fms | key to paint p50 %.3fms p99 %.3fms max %.3fms | "
+                    "per key: process %.4fms, update_windows %.4fms, doupdate %.4fms\n",
+            headless.next, elapsed_ns/1e6,
+            histogram_percentile(&frame_stats.key_to_paint, 50)/1e6,
+            histogram_percentile(&frame_stats.key_to_paint, 99)/1e6,
+            frame_stats.key_to_paint.max/1e6,
+            frame_stats.key_phases_ns[FRAME_PROCESS_KEY]/keys/1e6,
+            frame_stats.key_phases_ns[FRAME_UPDATE_WINDOWS]/keys/1e6,
+            frame_stats.key_phases_ns[FRAME_DOUPDATE]/keys/1e6);
+
+    endwin();
+    exit(0);
+}
+
+/// END Headless
+
+/// BEGIN Bench
+
+#ifdef BENCH
+
+/* Built by `./build.sh bench`: runs the core operations on synthetic buffers, through the same functions
+ * the keys end up calling, and appends one JSON line per case to bench_output.txt. Every case runs its
+ * operation until BENCH_MAX_OPS or BENCH_TIME_BUDGET_NS, whatever comes first. */
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define BENCH_OUTPUT          "bench_output.txt"
+#define BENCH_DIR             "/tmp/editor_bench"
+#define BENCH_TIME_BUDGET_NS  2000000000ull
+#define BENCH_MAX_OPS         10000
+#define BENCH_SNIPPETS        5000
+
+static FILE *bench_output = NULL;
+static uint64_t bench_seed = 0x9e3779b97f4a7c15ull;
+
+static uint64_t bench_random(void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+/* NOTE: writes s as a quoted JSON string, the params can come from the command line */
+static void bench_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c == '\n')        fputs("\\n", f);
+        else if (c == '\t')        fputs("\\t", f);
+        else if (c < 0x20)         fprintf(f, "\\u%04x", c);
+        else                       fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+void bench_report(const char *name, const char *param, uint64_t ns, uint64_t ops, uint64_t bytes)
+{
+    fprintf(bench_output, "{\"version\": ");
+    bench_json_string(bench_output, BENCH_VERSION);
+    fprintf(bench_output, ", \"time\": %ld, \"name\": ", (long)time(NULL));
+    bench_json_string(bench_output, name);
+    fprintf(bench_output, ", \"param\": ");
+    bench_json_string(bench_output, param);
+    fprintf(bench_output, ", \"ops\": %"PRIu64", \"ns\": %"PRIu64", \"ns_per_op\": %.1f",
+            ops, ns, ops ? (double)ns/ops : 0.0);
+    if (bytes > 0) fprintf(bench_output, ", \"bytes\": %"PRIu64", \"mb_per_s\": %.1f", bytes, bytes/1e6 / (ns/1e9));
+    fprintf(bench_output, "}\n");
+    fflush(bench_output);
+    fprintf(stderr, "%-24s %-12s %10"PRIu64" ops %12.1f ns/op\n", name, param, ops, ops ? (double)ns/ops : 0.0);
+}
+
+/* NOTE: runs op until the budget is over, returns the number of times it ran and the time in *ns */
+static uint64_t bench_loop(void (*op)(uint64_t i), uint64_t max_ops, uint64_t *ns)
+{
+    uint64_t begin = monotonic_ns(), ops = 0;
+    while (ops < max_ops && monotonic_ns() - begin < BENCH_TIME_BUDGET_NS) op(ops++);
+    *ns = monotonic_ns() - begin;
+    return ops;
+}
+
+/* NOTE: source-like lines with a log line every few, so that the regex cases have something to match */
+const char *bench_make_file(size_t mb)
+{
+    static char path[PATH_MAX];
+    snprintf(path, sizeof(path), BENCH_DIR"/buffer_%zumb.txt", mb);
+    struct stat st;
+    if (stat(path, &st) == 0 && (size_t)st.st_size >= mb*1000*1000) return path;
+
+    const char *words[] = {"int", "size_t", "return", "editor", "cursor", "row", "count", "if", "for", "while",
+                           "struct", "static", "void", "char", "items", "snippet", "config", "match", "=", "+"};
+    const char *levels[] = {"INFO", "DEBUG", "WARNING", "ERROR"};
+    FILE *f = fopen(path, "w");
+    if (f == NULL) print_error_and_exit("Could not create %s: %s\n", path, strerror(errno));
+    size_t written = 0;
+    for (size_t line = 0; written < mb*1000*1000; line++) {
+        int n;
+        if (line % 8 == 0) {
+            uint64_t r = bench_random();
+            n = fprintf(f, "2026-10-%02d %02d:%02d:%02d %s [worker-%d] request %d took %dms\n",
+                    (int)(r%28)+1, (int)(r>>8)%24, (int)(r>>16)%60, (int)(r>>24)%60, levels[(r>>32)%4],
+                    (int)(r>>40)%64, (int)(r>>20)%100000, (int)(r>>48)%5000);
+        } else {
+            n = fprintf(f, "%*s", (int)(bench_random()%4)*4, "");
+            size_t words_count = 3 + bench_random()%10;
+            for (size_t w = 0; w < words_count; w++)
+                n += fprintf(f, "%s%s", w ? " " : "", words[bench_random()%(sizeof(words)/sizeof(words[0]))]);
+            n += fprintf(f, ";\n");
+        }
+        written += n;
+    }
+    fclose(f);
+    return path;
+}
+
+/* NOTE: snippets h0..hN, some commands and variables, in a $HOME of its own */
+void bench_make_config(void)
+{
+    mkdir(BENCH_DIR"/home", 0755);
+    mkdir(BENCH_DIR"/home/.config", 0755);
+    mkdir(BENCH_DIR"/home/.config/editor", 0755);
+    FILE *f = fopen(BENCH_DIR"/home/.config/editor/config.pisquy", "w");
+    if (f == NULL) print_error_and_exit("Could not create the bench config: %s\n", strerror(errno));
+    static_assert(CONFIG_FIELDS_COUNT == 8, "Set all config fields in the bench config");
+    fprintf(f, "set quit_times = 3\nset line_numbers = relative\nset tab_to_spaces = true\nset tab_spaces_number = 4\n"
+               "set configlog_level = error\nset auto_snippets = false\nset log_level = off\nset msg_lifetime = 5\n");
+    for (size_t i = 0; i < 100; i++) fprintf(f, "var v%zu = %zu\ndef cmd%zu = %zu mvd mvu\n", i, i, i, i+1);
+    fprintf(f, "snippet for = \"{\n    for (${i} = 0; ${i} < $; ${i}++) {\n        $\n    }\n}\"\n");
+    for (size_t i = 0; i < BENCH_SNIPPETS; i++) fprintf(f, "snippet h%zu = \"body of snippet %zu\"\n", i, i);
+    fclose(f);
+    setenv("HOME", BENCH_DIR"/home", 1);
+    headless.config_path = BENCH_DIR"/home/.config/editor/config.pisquy";
+}
+
+void bench_close_buffer(void)
+{
+    disable_multicursor();
+    search_set_pattern(NULL, 0, false);
+    da_foreach(editor.rows, Row, row) s_free(&row->content);
+    da_free(&editor.rows);
+    open_file(NULL);
+}
+
+static inline void bench_op_insert_char(uint64_t i) { (void)i; insert_char('x'); }
+
+static inline void bench_op_newline(uint64_t i) { (void)i; insert_char('\n'); }
+
+void bench_buffer(size_t mb)
+{
+    char param[64], name[PATH_MAX];
+    snprintf(param, sizeof(param), "%zumb", mb);
+    const char *path = bench_make_file(mb);
+    struct stat st;
+    stat(path, &st);
+
+    bench_close_buffer();
+    uint64_t begin = monotonic_ns();
+    if (!open_file((char *)path)) print_error_and_exit("Could not open %s\n", path);
+    bench_report("open_file", param, monotonic_ns() - begin, 1, st.st_size);
+    size_t rows = editor.rows.count;
+
+    snprintf(name, sizeof(name), BENCH_DIR"/saved_%zumb.txt", mb);
+    free(editor.filepath);
+    editor.filepath = strdup(name);
+    begin = monotonic_ns();
+    save();
+    bench_report("save", param, monotonic_ns() - begin, 1, st.st_size);
+
+    uint64_t ns, ops;
+    struct { const char *name; size_t y; } positions[] = { {"type_start", 0}, {"type_middle", rows/2}, {"type_end", rows-1} };
+    for (size_t i = 0; i < 3; i++) {
+        editor.cursor = (Cursor){ .y = positions[i].y, .x = i == 2 ? ROW(rows-1)->content.count : 0 };
+        ops = bench_loop(bench_op_insert_char, BENCH_MAX_OPS, &ns);
+        bench_report(positions[i].name, param, ns, ops, 0);
+    }
+
+    editor.cursor = (Cursor){ .y = rows/2, .x = ROW(rows/2)->content.count/2 };
+    ops = bench_loop(bench_op_newline, BENCH_MAX_OPS, &ns);
+    bench_report("newline_split", param, ns, ops, 0);
+
+    size_t cursors_counts[] = {10, 1000, 100000};
+    for (size_t i = 0; i < 3; i++) {
+        size_t n = cursors_counts[i];
+        if (n > editor.rows.count) continue;
+        editor.cursor = (Cursor){0};
+        for (size_t c = 1; c < n; c++) da_push(&editor.multicursor, ((Cursor){ .y = c*(editor.rows.count/n) }));
+        enable_multicursor();
+        ops = bench_loop(bench_op_insert_char, 100, &ns);
+        disable_multicursor();
+        snprintf(param, sizeof(param), "%zumb_%zu", mb, n);
+        bench_report("multicursor_insert", param, ns, ops, 0);
+    }
+    snprintf(param, sizeof(param), "%zumb", mb);
+
+    struct { const char *name; const char *pattern; bool is_regex; } searches[] = {
+        {"search_literal", "snippet config", false},
+        {"search_regex", "ERROR \\[worker-[0-9]+\\]", true},
+        {"search_regex", "took [0-9][0-9][0-9][0-9]ms", true},
+        {"search_regex", "^2026-10-1[0-9] .* WARNING", true},
+    };
+    size_t text_bytes = 0;
+    da_foreach(editor.rows, Row, row) text_bytes += row->content.count+1;
+    for (size_t i = 0; i < sizeof(searches)/sizeof(searches[0]); i++) {
+        begin = monotonic_ns();
+        search_set_pattern(searches[i].pattern, strlen(searches[i].pattern), searches[i].is_regex);
+        while (!match_index_is_complete()) match_index_update(UINT64_MAX);
+        ns = monotonic_ns() - begin;
+        snprintf(name, sizeof(name), "%s %s", param, searches[i].pattern);
+        bench_report(searches[i].name, name, ns, 1, text_bytes);
+    }
+    search_set_pattern(NULL, 0, false);
+}
+
+/* NOTE: a single row full of matches, where the cost of a search grows with the row instead of the buffer */
+void bench_long_line(size_t len)
+{
+    char path[PATH_MAX], param[64];
+    snprintf(path, sizeof(path), BENCH_DIR"/long_line_%zu.txt", len);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) print_error_and_exit("Could not create %s: %s\n", path, strerror(errno));
+    for (size_t written = 0; written < len;) written += fprintf(f, "took %dms ", (int)(bench_random()%5000));
+    fputc('\n', f);
+    fclose(f);
+
+    bench_close_buffer();
+    if (!open_file(path)) print_error_and_exit("Could not open %s\n", path);
+    const char *patterns[] = {"took [0-9]+ms", "[0-9]"};
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++) {
+        uint64_t begin = monotonic_ns();
+        search_set_pattern(patterns[i], strlen(patterns[i]), true);
+        while (!match_index_is_complete()) match_index_update(UINT64_MAX);
+        snprintf(param, sizeof(param), "%zu %s", len, patterns[i]);
+        bench_report("search_regex_long_line", param, monotonic_ns() - begin, 1, len);
+    }
+    search_set_pattern(NULL, 0, false);
+}
+
+void bench_config(void)
+{
+    char cache_path[PATH_MAX];
+    snprintf(cache_path, sizeof(cache_path), BENCH_DIR"/home/.config/editor/config.pisquy"CONFIG_CACHE_SUFFIX);
+
+    for (int cached = 0; cached < 2; cached++) {
+        uint64_t ns = 0, ops = 0;
+        for (; ops < 100 && ns < BENCH_TIME_BUDGET_NS; ops++) {
+            if (!cached) unlink(cache_path);
+            ConfigState previous = config_state_take();
+            config_state_free(&previous);
+            String log = {0};
+            uint64_t begin = monotonic_ns();
+            if (!load_config(NULL, &log)) print_error_and_exit("Bench config has errors:\n"S_FMT, S_ARG(log));
+            ns += monotonic_ns() - begin;
+            s_free(&log);
+        }
+        bench_report("config_load", cached ? "cached" : "parsed", ns, ops, 0);
+    }
+}
+
+static inline void bench_op_expand_snippet(uint64_t i)
+{
+    char handle[32];
+    int len = snprintf(handle, sizeof(handle), " h%"PRIu64, bench_random()%BENCH_SNIPPETS);
+    if (i % 100 == 0) insert_char('\n');
+    insert_text(handle, len);
+    try_to_expand_snippet();
+}
+
+void bench_snippets(void)
+{
+    bench_close_buffer();
+    uint64_t ns;
+    uint64_t ops = bench_loop(bench_op_expand_snippet, BENCH_MAX_OPS*10, &ns);
+    char param[32];
+    snprintf(param, sizeof(param), "%d_snippets", BENCH_SNIPPETS);
+    bench_report("snippet_expand", param, ns, ops, 0);
+}
+
+int bench_main(int argc, char **argv)
 {
-    if (argc <= 0 || argc >= 3) {
-        printw("TODO: usage\n");
+    size_t sizes[16] = {1, 100, 1000}, sizes_count = 3;
+    for (int i = 1; i < argc; i++) {
+        if (streq(argv[i], "--sizes") && i+1 < argc) {
+            sizes_count = 0;
+            for (char *it = strtok(argv[++i], ","); it && sizes_count < 16; it = strtok(NULL, ","))
+                sizes[sizes_count++] = strtoul(it, NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [--sizes 1,100,1000] (sizes of the buffers in MB)\n", argv[0]);
+            return 1;
+        }
+    }
+
+    mkdir(BENCH_DIR, 0755);
+    bench_output = fopen(BENCH_OUTPUT, "a");
+    if (bench_output == NULL) {
+        fprintf(stderr, "ERROR: could not open "BENCH_OUTPUT": %s\n", strerror(errno));
         return 1;
     }
 
-    char *filepath = argc == 2 ? argv[1] : NULL;
+    headless.is_enabled = true; // NOTE: for the screen on /dev/null, the keys are never read
+    logger_init();
+    bench_make_config();
+    ncurses_init();
+    bench_config();
+    editor_init();
+    create_windows();
+    open_file(NULL);
+
+    bench_snippets();
+    for (size_t i = 0; i < sizes_count; i++) bench_buffer(sizes[i]);
+    size_t long_lines[] = {10000, 100000, 300000};
+    for (size_t i = 0; i < sizeof(long_lines)/sizeof(long_lines[0]); i++) bench_long_line(long_lines[i]);
+
+    endwin();
+    fclose(bench_output);
+    return 0;
+}
+
+int main(int argc, char **argv) { return bench_main(argc, argv); }
+
+#else
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [file]\n", program);
+    fprintf(stderr, "       %s --headless --script keys.txt [--config path] [--output path] [file]\n", program);
+}
+
+int main(int argc, char **argv)
+{
+    char *filepath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if      (streq(argv[i], "--headless"))              headless.is_enabled = true;
+        else if (streq(argv[i], "--script") && i+1 < argc)  headless.script_path = argv[++i];
+        else if (streq(argv[i], "--output") && i+1 < argc)  headless.output_path = argv[++i];
+        else if (streq(argv[i], "--config") && i+1 < argc)  headless.config_path = argv[++i];
+        else if (argv[i][0] != '-' && filepath == NULL)     filepath = argv[i];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (headless.config_path && !headless.is_enabled) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (headless.is_enabled) {
+        char *script = headless.script_path ? read_file(headless.script_path) : NULL;
+        if (script == NULL) {
+            if (headless.script_path) fprintf(stderr, "ERROR: could not read script `%s`\n", headless.script_path);
+            else usage(argv[0]);
+            return 1;
+        }
+        if (!headless_parse_script(script, &headless.keys)) {
+            fprintf(stderr, "ERROR: invalid escape in script `%s`\n", headless.script_path);
+            return 1;
+        }
+        free(script);
+    }
 
-    log_this("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~");
+    logger_init();
+    log_info("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~");
 
     ncurses_init();
-    load_config();
+    if (headless.is_enabled) {
+        config_cache_is_enabled = false;
+        String config_log = {0};
+        bool ok = load_config(NULL, &config_log);
+        fprintf(stderr, S_FMT, S_ARG(config_log));
+        s_free(&config_log);
+        if (!ok) return 1;
+    } else {
+        load_config(NULL, NULL);
+        config_watcher_start();
+        history_load();
+    }
     editor_init();
     initialize_colors();
     create_windows();
@@ -3486,11 +8492,20 @@ int main(int argc, char **argv)
         else          print_error_and_exit("Could not open new file. %s.\n", errno ? strerror(errno) : "");
     }
 
+    headless.begin_ns = monotonic_ns();
     while (true) {
+        if (headless.is_enabled && headless_is_done()) headless_finish();
+        frame_stats_begin();
         process_pressed_key();
+        config_reload_apply();
+        search_continue();
+        messages_expire();
+        frame_stats_phase(FRAME_PROCESS_KEY);
         update_windows();
         update_cursor();
+        frame_stats_phase(FRAME_UPDATE_WINDOWS);
         doupdate();
+        frame_stats_end();
     }
 
     // NOTE: this code should be unreachable
@@ -3498,3 +8513,7 @@ int main(int argc, char **argv)
 
     return 0;
 }
+
+#endif // BENCH
+
+/// END Bench